@@ -0,0 +1,356 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+
+/* Storage and memory benchmarks. The storage tests go through the vfs_*
+ * calls exactly as cp and friends do, so they measure what real commands
+ * see. */
+
+#define DEFAULT_SIZE (1024*1024)
+#define DEFAULT_BLOCK 4096
+#define RANDOM_BLOCK 512
+#define MAX_RANDOM_OPS 2048
+#define MAX_SAMPLES 4096
+#define MEM_PASSES 4
+
+static uint32_t* samples;
+static uint32_t numsamples;
+static uint32_t stride;
+static uint32_t opcount;
+
+static void samples_begin(uint32_t ops)
+{
+	stride = (ops + MAX_SAMPLES - 1) / MAX_SAMPLES;
+	if (stride == 0)
+		stride = 1;
+	numsamples = 0;
+	opcount = 0;
+}
+
+static void sample(uint32_t us)
+{
+	if (((opcount++ % stride) == 0) && (numsamples < MAX_SAMPLES))
+		samples[numsamples++] = us;
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+	uint32_t ua = *(const uint32_t*) a;
+	uint32_t ub = *(const uint32_t*) b;
+	return (ua > ub) - (ua < ub);
+}
+
+/* Prints a rate in MB/s (bytes per microsecond) to two decimal places
+ * without using floating point. */
+
+static void print_rate(uint32_t bytes, uint32_t us)
+{
+	uint32_t frac;
+
+	if (us < 100)
+		us = 100;
+	frac = (bytes % us) / (us / 100);
+	if (frac > 99)
+		frac = 99;
+	printf("%8u.%02u MB/s", (unsigned) (bytes / us), (unsigned) frac);
+}
+
+static void report(const char* name, uint32_t bytes, uint32_t ops, uint32_t us)
+{
+	uint32_t iops;
+
+	if (us == 0)
+		us = 1;
+	if (ops < 4000)
+		iops = (ops * 1000000) / us;
+	else
+		iops = (ops * 1000) / ((us / 1000) + 1);
+
+	printf("%-10s", name);
+	print_rate(bytes, us);
+	printf(" %8u IOPS", (unsigned) iops);
+
+	if (numsamples)
+	{
+		qsort(samples, numsamples, sizeof(*samples), compare_samples);
+		printf("  latency us: p50 %u p90 %u p99 %u max %u",
+			(unsigned) samples[numsamples*50/100],
+			(unsigned) samples[numsamples*90/100],
+			(unsigned) samples[numsamples*99/100],
+			(unsigned) samples[numsamples-1]);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static void bench_write(const char* path, uint8_t* buffer, uint32_t size,
+	uint32_t block)
+{
+	struct file* fp = vfs_open(path, O_WRONLY);
+	uint32_t offset = 0;
+	uint32_t start;
+
+	if (!fp)
+		return;
+
+	samples_begin(size / block);
+	start = read_timer();
+	while (offset < size)
+	{
+		uint32_t t = read_timer();
+		uint32_t w = vfs_write(fp, offset, buffer, block);
+		sample(read_timer() - t);
+		if (w != block)
+		{
+			if (!error)
+				setError("short write at offset %x", offset);
+			break;
+		}
+		offset += block;
+	}
+	vfs_close(fp);
+	if (error)
+		return;
+
+	report("seq write", size, size / block, read_timer() - start);
+}
+
+static void bench_read(const char* path, uint8_t* buffer, uint32_t size,
+	uint32_t block)
+{
+	struct file* fp = vfs_open(path, O_RDONLY);
+	uint32_t offset = 0;
+	uint32_t start;
+
+	if (!fp)
+		return;
+
+	samples_begin(size / block);
+	start = read_timer();
+	while (offset < size)
+	{
+		uint32_t t = read_timer();
+		uint32_t r = vfs_read(fp, offset, buffer, block);
+		sample(read_timer() - t);
+		if (r != block)
+		{
+			if (!error)
+				setError("short read at offset %x", offset);
+			break;
+		}
+		offset += block;
+	}
+	vfs_close(fp);
+	if (error)
+		return;
+
+	report("seq read", size, size / block, read_timer() - start);
+}
+
+static void bench_random(const char* path, uint8_t* buffer, uint32_t size)
+{
+	struct file* fp = vfs_open(path, O_RDONLY);
+	uint32_t blocks = size / RANDOM_BLOCK;
+	uint32_t ops = blocks;
+	uint32_t seed = 1;
+	uint32_t start;
+	uint32_t i;
+
+	if (!fp)
+		return;
+	if (ops > MAX_RANDOM_OPS)
+		ops = MAX_RANDOM_OPS;
+
+	samples_begin(ops);
+	start = read_timer();
+	for (i=0; i<ops; i++)
+	{
+		uint32_t t;
+		uint32_t offset;
+
+		/* Fixed LCG, so every run reads the same blocks. */
+		seed = seed*1103515245 + 12345;
+		offset = ((seed >> 8) % blocks) * RANDOM_BLOCK;
+
+		t = read_timer();
+		if (vfs_read(fp, offset, buffer, RANDOM_BLOCK) != RANDOM_BLOCK)
+		{
+			if (!error)
+				setError("short read at offset %x", offset);
+			break;
+		}
+		sample(read_timer() - t);
+	}
+	vfs_close(fp);
+	if (error)
+		return;
+
+	report("rand read", ops * RANDOM_BLOCK, ops, read_timer() - start);
+}
+
+static void bench_io(const char* path, uint32_t size, uint32_t block)
+{
+	uint8_t* buffer;
+
+	if ((block < RANDOM_BLOCK) || (size < block))
+	{
+		setError("size and block size must be at least %d bytes", RANDOM_BLOCK);
+		return;
+	}
+	size -= size % block;
+
+	buffer = malloc(block);
+	if (!buffer)
+	{
+		setError("not enough memory for a %u byte block", (unsigned) block);
+		return;
+	}
+	fill_memory(buffer, 0xdeadbeef, block);
+
+	printf("%s: %u bytes in %u byte blocks\n", path,
+		(unsigned) size, (unsigned) block);
+	bench_write(path, buffer, size, block);
+	if (!error)
+		bench_read(path, buffer, size, block);
+	if (!error)
+		bench_random(path, buffer, size);
+
+	free(buffer);
+}
+
+/* Memory bandwidth; each kernel runs MEM_PASSES times and the best time is
+ * reported. */
+
+static void bench_mem(uint8_t* start, uint32_t len)
+{
+	uint32_t half = (len / 2) & ~3;
+	uint32_t best, t;
+	int i;
+
+	numsamples = 0;
+
+	best = 0xffffffff;
+	for (i=0; i<MEM_PASSES; i++)
+	{
+		t = read_timer();
+		fill_memory(start, 0, len);
+		t = read_timer() - t;
+		if (t < best)
+			best = t;
+	}
+	report("fill", len, 1, best);
+
+	best = 0xffffffff;
+	for (i=0; i<MEM_PASSES; i++)
+	{
+		t = read_timer();
+		move_memory(start + half, start, half);
+		t = read_timer() - t;
+		if (t < best)
+			best = t;
+	}
+	report("move", half, 1, best);
+
+	best = 0xffffffff;
+	for (i=0; i<MEM_PASSES; i++)
+	{
+		t = read_timer();
+		memcpy(start + half, start, half);
+		t = read_timer() - t;
+		if (t < best)
+			best = t;
+	}
+	report("memcpy", half, 1, best);
+
+	best = 0xffffffff;
+	for (i=0; i<MEM_PASSES; i++)
+	{
+		t = read_timer();
+		compare_memory(start + half, start, half);
+		t = read_timer() - t;
+		if (t < best)
+			best = t;
+	}
+	report("compare", half, 1, best);
+}
+
+static int parse_hex(const char* s, uint32_t* value)
+{
+	char* p;
+
+	*value = strtoul(s, &p, 16);
+	if ((p == s) || *p)
+	{
+		setError("unable to parse '%s' (use hex, without 0x)", s);
+		return 0;
+	}
+	return 1;
+}
+
+static void bench_cb(int argc, const char* argv[])
+{
+	samples = malloc(MAX_SAMPLES * sizeof(*samples));
+	if (!samples)
+	{
+		setError("not enough memory for the samples");
+		return;
+	}
+
+	if ((argc >= 3) && (argc <= 5) && (strcmp(argv[1], "io") == 0))
+	{
+		uint32_t size = DEFAULT_SIZE;
+		uint32_t block = DEFAULT_BLOCK;
+
+		if ((argc > 3) && !parse_hex(argv[3], &size))
+			goto exit;
+		if ((argc > 4) && !parse_hex(argv[4], &block))
+			goto exit;
+
+		bench_io(argv[2], size, block);
+	}
+	else if ((argc == 3) && (strcmp(argv[1], "mem") == 0))
+	{
+		const char* s = argv[2];
+		uint32_t addr, len;
+		char* p;
+
+		if (strncmp(s, "mem:", 4) == 0)
+			s += 4;
+		addr = strtoul(s, &p, 16);
+		if ((*p != '+') || !parse_hex(p+1, &len))
+		{
+			setError("malformed range (use <start>+<len>, in hex)");
+			goto exit;
+		}
+
+		bench_mem(pi_phys_to_user((void*)(uintptr_t) addr), len);
+	}
+	else
+		setError("syntax: bench io <filename> [<size> [<blocksize>]] | bench mem <start>+<len>");
+
+exit:
+	free(samples);
+}
+
+const struct command bench_cmd =
+{
+	"bench",
+	"measures storage or memory performance",
+
+	"Syntax:\n"
+	"  bench io <filename> [<size> [<blocksize>]]\n"
+	"  bench mem <start>+<len>\n"
+	"The io form writes <size> bytes (default 100000) to the file in\n"
+	"<blocksize> chunks (default 1000), reads them back, then does random\n"
+	"200-byte reads. The file is overwritten! The mem form times fill and\n"
+	"copy kernels over the range, which is overwritten too. All numbers are\n"
+	"in hex. Reports throughput, operations per second and latency\n"
+	"percentiles.",
+
+	bench_cb
+};
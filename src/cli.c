@@ -6,14 +6,26 @@
  */
 
 #include "globals.h"
+#include "rpc.h"
 #include <termios.h>
 
+#define QUERY_TIMEOUT 200 /* ms to wait for the terminal to answer */
+#define DEFAULT_WIDTH 80
+
 static struct termios oldtermios;
 static char* buffer = NULL;
+static char* shown = NULL; /* what's currently on the screen */
 static int bufferlen = 0;
-static int width;
+static int width = DEFAULT_WIDTH; /* terminal width */
+static int queried = 0; /* whether the terminal has been asked */
 static int xpos;
 
+/* Input which arrived while waiting for the terminal to answer a query,
+ * and which is handed to readline() before anything else. */
+
+static char pushback[32];
+static int pushbacklen = 0;
+
 static void deinit_console(void)
 {
 	tcsetattr(0, TCSAFLUSH, &oldtermios);
@@ -55,34 +67,134 @@ static void extendbuffer(int size)
 {
 	if (size > bufferlen)
 	{
-		bufferlen *= 2;
-		if (bufferlen == 0)
-			bufferlen = 16;
+		while (size > bufferlen)
+		{
+			bufferlen *= 2;
+			if (bufferlen == 0)
+				bufferlen = 16;
+		}
 		buffer = realloc(buffer, bufferlen);
+		shown = realloc(shown, bufferlen);
 	}
 }
 
-static void getcursorpos(int* x, int* y)
+static void unread(const char* s, int len)
+{
+	if (len > ((int) sizeof(pushback) - pushbacklen))
+		len = sizeof(pushback) - pushbacklen;
+	memcpy(pushback + pushbacklen, s, len);
+	pushbacklen += len;
+}
+
+static int input_pending(void)
 {
-	char buffer[16];
+	return pushbacklen || poll_console(0);
+}
+
+static char readchar(void)
+{
+	char c;
+
+	if (pushbacklen)
+	{
+		c = pushback[0];
+		pushbacklen--;
+		memmove(pushback, pushback+1, pushbacklen);
+		return c;
+	}
+
+	wait_for_console();
+	fread(&c, 1, 1, stdin);
+	return c;
+}
+
+/* Returns 0 if the terminal didn't answer. Anything else which arrives
+ * meanwhile (typed ahead or pasted) is kept for readline(). */
+
+static int getcursorpos(int* x, int* y)
+{
+	char reply[16];
 	int i = 0;
+	int state = 0; /* 0: ESC; 1: '['; 2: row; 3: column */
 
 	fwrite("\033[6n", 1, 4, stdout);
 	fflush(stdout);
 
-	while (i<15)
+	while (pushbacklen < (int) sizeof(pushback))
 	{
-		int c = getchar();
-		buffer[i++] = c;
+		int c;
+		int ok;
 
-		if (c == 'R')
+		if (!poll_console(QUERY_TIMEOUT))
 			break;
+		c = getchar();
+		reply[i++] = c;
+
+		switch (state)
+		{
+			case 0:
+				ok = (c == 27);
+				state = 1;
+				break;
+
+			case 1:
+				ok = (c == '[');
+				state = 2;
+				break;
+
+			case 2:
+				ok = isdigit(c) || (c == ';');
+				if (c == ';')
+					state = 3;
+				break;
+
+			default:
+				ok = isdigit(c) || (c == 'R');
+				if (c == 'R')
+				{
+					reply[i] = '\0';
+					return (sscanf(reply, "\033[%d;%dR", y, x) == 2);
+				}
+				break;
+		}
+
+		if (!ok || (i == ((int) sizeof(reply)-1)))
+		{
+			unread(reply, i);
+			i = state = 0;
+		}
+	}
+
+	unread(reply, i);
+	return 0;
+}
+
+/* Finds out where the cursor is and how big the terminal is. This costs
+ * two round trips, so the result is cached until the user asks for it to
+ * be refreshed (with ^L). If the terminal doesn't answer, DEFAULT_WIDTH is
+ * used, and it isn't asked again until ^L. */
+
+static void querygeometry(void)
+{
+	int x, y, w, h;
+
+	queried = 1;
+	if (getcursorpos(&x, &y))
+	{
+		printf("\033[999;999f");
+		if (getcursorpos(&w, &h))
+		{
+			printf("\033[%d;%df", y, x);
+			printf("\033[7l"); /* disable line wrap */
+			xpos = x-1;
+			width = w;
+			return;
+		}
+		printf("\033[%d;%df", y, x);
 	}
-	buffer[i] = '\0';
 
-	i = sscanf(buffer, "\033[%d;%dR", y, x);
-	if (i != 2)
-		*x = *y = 0;
+	/* No answer (a script, or something which isn't a terminal); guess. */
+	width = DEFAULT_WIDTH;
 }
 
 static void backspaces(int n)
@@ -119,44 +231,135 @@ static void outstring(const char* s, int len)
 		outchar(*s++);
 }
 
-char* readline(void)
+/* Brings the screen up to date with the buffer, sending only the part of
+ * the line which has actually changed. */
+
+static int shownlen;
+static int showncursor;
+
+/* Moving right is done by re-sending what's already on the screen. */
+
+static void movecursor(int from, int to)
+{
+	if (to < from)
+		backspaces(from - to);
+	else
+		outstring(shown + from, to - from);
+}
+
+static void redraw(int stringlen, int cursor)
 {
-	int cursor = 0;
-	int oldcursor = 0;
-	int stringlen = 0;
-	int oldstringlen = 0;
-	int i;
-	char c;
+	int d = 0;
+
+	while ((d < stringlen) && (d < shownlen) && (buffer[d] == shown[d]))
+		d++;
+
+	if ((d == stringlen) && (d == shownlen))
+	{
+		/* Nothing's changed except (perhaps) the cursor position. */
+		movecursor(showncursor, cursor);
+	}
+	else
+	{
+		/* Send the new tail, and erase whatever's left of the old one. */
+
+		movecursor(showncursor, d);
+		outstring(buffer + d, stringlen - d);
+		if (stringlen < shownlen)
+			printf("\033[J");
+		backspaces(stringlen - cursor);
+	}
+
+	memcpy(shown, buffer, stringlen);
+	shownlen = stringlen;
+	showncursor = cursor;
+}
 
 #if defined TARGET_TESTBED
-	//sleep(10);
-#endif
 
-	/* Find out where the cursor is and how big the terminal is. */
+/* Input isn't coming from a terminal, so there's nobody to echo to or to
+ * send editing keys; just collect characters up to the end of the line.
+ * Only the testbed can tell; on the Pi the console is the UART, which has
+ * no way of knowing what's on the other end, so it's treated as a
+ * terminal (and the geometry query copes with one that doesn't answer). */
 
+static char* readline_raw(void)
+{
+	int stringlen = 0;
+
+	for (;;)
 	{
-		int ypos, height;
-		getcursorpos(&xpos, &ypos);
-		printf("\033[999;999f");
-		getcursorpos(&width, &height);
-		width++; /* because the value read above is inclusive */
-		printf("\033[%d;%df", ypos, xpos);
+		int c;
+
+		wait_for_console();
+		c = getchar();
+		switch (c)
+		{
+			case EOF:
+				if (stringlen == 0)
+					exit(0);
+				/* fall through */
+			case '\n':
+			case '\r':
+				goto eos;
+
+			case RPC_SYNC0:
+				if (stringlen == 0)
+				{
+					extendbuffer(4);
+					strcpy(buffer, "rpc");
+					return buffer;
+				}
+				break;
+
+			default:
+				if ((c >= 32) && (c <= 126))
+				{
+					extendbuffer(stringlen+1);
+					buffer[stringlen++] = c;
+				}
+				break;
+		}
 	}
+eos:
+
+	extendbuffer(stringlen+1);
+	buffer[stringlen] = '\0';
+	return buffer;
+}
+
+#endif
+
+char* readline(const char* prompt)
+{
+	int cursor = 0;
+	int stringlen = 0;
+	char c;
 
-	printf("\033[7l"); /* disable line wrap */
+	fputs(prompt, stdout);
+#if defined TARGET_TESTBED
+	if (!isatty(0))
+		return readline_raw();
+#endif
+
+	xpos = strlen(prompt);
+	if (!queried && !input_pending())
+		querygeometry();
 
+	extendbuffer(1);
+	shownlen = showncursor = 0;
 	for (;;)
 	{
-		backspaces(oldcursor);
-		printf("\033[K\033[J");
-		outstring(buffer, stringlen);
-		backspaces(stringlen-cursor);
+		/* Don't bother updating the screen until we've caught up with the
+		 * input (which matters when text is pasted). */
 
-		oldstringlen = stringlen;
-		oldcursor = cursor;
+		if (!input_pending())
+		{
+			redraw(stringlen, cursor);
+			fflush(stdout);
+		}
 
-		fflush(stdout);
-		fread(&c, 1, 1, stdin);
+		c = readchar();
 		switch (c)
 		{
 			case '\n':
@@ -204,6 +407,24 @@ char* readline(void)
 				}
 				break;
 
+			case 12: /* ^L; re-read the terminal size and redraw */
+				backspaces(showncursor);
+				printf("\033[J");
+				shownlen = showncursor = 0;
+				querygeometry();
+				break;
+
+			case (char) RPC_SYNC0:
+				/* A host program wants to talk to us in binary. */
+				if (stringlen == 0)
+				{
+					extendbuffer(4);
+					strcpy(buffer, "rpc");
+					printf("\n");
+					return buffer;
+				}
+				break;
+
 			default:
 				if ((c >= 32) && (c <= 126))
 				{
@@ -220,6 +441,7 @@ char* readline(void)
 	}
 eos:
 
+	redraw(stringlen, stringlen);
 	extendbuffer(stringlen+1);
 	buffer[stringlen] = '\0';
 	printf("\n");
@@ -0,0 +1,262 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+#include "ff.h"
+
+/* Fragmentation reports and defragmentation for the FAT volumes (sd: and
+ * ram:). A file in one piece can be read with a single multiple-block
+ * transfer and without walking the FAT; each break in its cluster chain
+ * costs a FAT lookup and a new card command. The work is done in ff.c
+ * (f_fragments() and f_defrag()), which knows how to move a chain safely;
+ * this is just the commands. */
+
+#define WORK_MAX (64*1024) /* f_defrag() moves at most 128 sectors at once */
+
+typedef void file_f(const char* path, const char* name);
+
+static uint8_t* work;
+static uint32_t worksize;
+static uint32_t files;
+static uint32_t fragmented;
+static uint32_t fragments;
+
+/* Calls fn on the file at path or, if it's a directory, on each of the
+ * files in it. Stops at the first error. */
+
+static void for_each_file(const char* path, file_f* fn)
+{
+	DIR* dir = pool_alloc(&fat_pool);
+	FILINFO fno;
+	FRESULT r;
+
+	if (!dir)
+		return;
+	r = f_opendir(dir, path);
+	if (r != FR_OK)
+	{
+		/* Not a directory; try it as a file. */
+
+		const char* name = strrchr(path, '/');
+		pool_free(&fat_pool, dir);
+		fn(path, name ? (name+1) : path);
+		return;
+	}
+
+	for (;;)
+	{
+		char* child;
+		int len;
+
+		memset(&fno, 0, sizeof(fno));
+		r = f_readdir(dir, &fno);
+		if (r != FR_OK)
+		{
+			set_fat_error(r);
+			break;
+		}
+		if (!fno.fname[0])
+			break;
+		if (fno.fattrib & AM_DIR)
+			continue;
+
+		len = strlen(path);
+		child = malloc(len + strlen(fno.fname) + 2);
+		strcpy(child, path);
+		if (len && (path[len-1] != '/') && (path[len-1] != ':'))
+			strcat(child, "/");
+		strcat(child, fno.fname);
+
+		fn(child, fno.fname);
+		free(child);
+		if (error)
+			break;
+	}
+
+	pool_free(&fat_pool, dir);
+}
+
+/* Opens the file and counts its fragments; returns NULL on error. */
+
+static FIL* open_file(const char* path, BYTE mode, DWORD* clusters,
+		DWORD* frags)
+{
+	FIL* fp = pool_alloc(&fat_pool);
+	FRESULT r;
+
+	if (!fp)
+		return NULL;
+	memset(fp, 0, sizeof(FIL));
+	r = f_open(fp, path, mode|FA_OPEN_EXISTING);
+	if (r == FR_OK)
+	{
+		r = f_fragments(fp, clusters, frags);
+		if (r == FR_OK)
+			return fp;
+		f_close(fp);
+	}
+
+	set_fat_error(r);
+	pool_free(&fat_pool, fp);
+	return NULL;
+}
+
+static void close_file(FIL* fp)
+{
+	FRESULT r = f_close(fp);
+	pool_free(&fat_pool, fp);
+	if ((r != FR_OK) && !error)
+		set_fat_error(r);
+}
+
+static void count(DWORD frags)
+{
+	files++;
+	if (frags > 1)
+		fragmented++;
+	fragments += frags;
+}
+
+/* Sets up for one of the commands; returns the FatFs path, which must be
+ * freed, or NULL. */
+
+static char* start(const char* path)
+{
+	files = fragmented = fragments = 0;
+	return fat_path(path);
+}
+
+static void frag_file(const char* path, const char* name)
+{
+	DWORD clusters, frags;
+	FIL* fp = open_file(path, FA_READ, &clusters, &frags);
+
+	if (!fp)
+		return;
+	close_file(fp);
+
+	if (files == 0)
+		printf("   frags  clusters  name\n");
+	printf("%8u %9u  %s\n", (unsigned) frags, (unsigned) clusters, name);
+	count(frags);
+}
+
+static void frag_cb(int argc, const char* argv[])
+{
+	char* path;
+
+	if (argc != 2)
+	{
+		setError("syntax: frag <file|dir>");
+		return;
+	}
+
+	sched_lock(&vfs_lock);
+	path = start(argv[1]);
+	if (path)
+	{
+		for_each_file(path, frag_file);
+		free(path);
+	}
+	sched_unlock(&vfs_lock);
+
+	if (!error && (files > 1))
+		printf("%u files, %u fragmented, %u fragments in all\n",
+			(unsigned) files, (unsigned) fragmented, (unsigned) fragments);
+}
+
+const struct command frag_cmd =
+{
+	"frag",
+	"shows how fragmented files are",
+
+	"Syntax:\n"
+	"  frag <file|dir>\n"
+	"Shows how many pieces (fragments) a file on sd: or ram: is split into,\n"
+	"or each of the files in a directory. A file in one fragment can be\n"
+	"read fastest; see 'help defrag'.",
+
+	frag_cb
+};
+
+static void defrag_file(const char* path, const char* name)
+{
+	DWORD clusters, before, after;
+	FIL* fp = open_file(path, FA_READ|FA_WRITE, &clusters, &before);
+	FRESULT r;
+
+	if (!fp)
+		return;
+
+	after = before;
+	if (before > 1)
+	{
+		r = f_defrag(fp, work, worksize);
+		if (r == FR_OK)
+			r = f_fragments(fp, &clusters, &after);
+		if (r == FR_DENIED)
+			setError("not enough contiguous free space for %s (%u clusters)",
+				name, (unsigned) clusters);
+		else if (r != FR_OK)
+			set_fat_error(r);
+	}
+	close_file(fp);
+	if (error)
+		return;
+
+	if (before > 1)
+		printf("%s: %u fragments -> %u\n", name, (unsigned) before,
+			(unsigned) after);
+	else
+		printf("%s: contiguous\n", name);
+	count(before);
+}
+
+static void defrag_cb(int argc, const char* argv[])
+{
+	char* path;
+
+	if (argc != 2)
+	{
+		setError("syntax: defrag <file|dir>");
+		return;
+	}
+
+	work = scratch_alloc_upto(512, WORK_MAX, &worksize);
+	if (!work)
+		return;
+	sched_lock(&vfs_lock);
+	path = start(argv[1]);
+	if (path)
+	{
+		for_each_file(path, defrag_file);
+		free(path);
+	}
+	sched_unlock(&vfs_lock);
+
+	if (!error && (files > 1))
+		printf("%u of %u files defragmented\n",
+			(unsigned) fragmented, (unsigned) files);
+}
+
+const struct command defrag_cmd =
+{
+	"defrag",
+	"makes files contiguous",
+
+	"Syntax:\n"
+	"  defrag <file|dir>\n"
+	"Moves a file on sd: or ram: (or each of the files in a directory) into\n"
+	"a single run of clusters, so it can be read in one go; useful for\n"
+	"kernels and other boot images. Each file needs a run of free space as\n"
+	"big as itself. The new copy is written and linked in before the old\n"
+	"one is freed, so an interrupted defrag loses no data (at worst, some\n"
+	"free space until the card is checked). Don't defrag a file which a\n"
+	"background job has open.",
+
+	defrag_cb
+};
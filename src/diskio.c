@@ -0,0 +1,88 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+#include "diskio.h"
+
+/* FatFs's disk interface. Each physical drive has its own driver; this
+ * just picks the right one, and does the accounting common to all. */
+
+DSTATUS disk_initialize (
+	BYTE pdrv				/* Physical drive nmuber (0..) */
+)
+{
+	switch (pdrv)
+	{
+		case DRIVE_MMC: return mmc_disk_initialize(pdrv);
+		case DRIVE_RAM: return ram_disk_initialize(pdrv);
+	}
+	return STA_NOINIT;
+}
+
+DSTATUS disk_status (
+	BYTE pdrv		/* Physical drive nmuber (0..) */
+)
+{
+	switch (pdrv)
+	{
+		case DRIVE_MMC: return mmc_disk_status(pdrv);
+		case DRIVE_RAM: return ram_disk_status(pdrv);
+	}
+	return STA_NOINIT;
+}
+
+DRESULT disk_read (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE *buff,		/* Data buffer to store read data */
+	DWORD sector,	/* Sector address (LBA) */
+	BYTE count		/* Number of sectors to read (1..128) */
+)
+{
+	count_stat(STAT_DISK_SECTORS_READ, count);
+	trace(TRACE_DISK_READ, sector, (pdrv << 8) | count);
+	switch (pdrv)
+	{
+		case DRIVE_MMC: return mmc_disk_read(pdrv, buff, sector, count);
+		case DRIVE_RAM: return ram_disk_read(pdrv, buff, sector, count);
+	}
+	return RES_PARERR;
+}
+
+#if _USE_WRITE
+DRESULT disk_write (
+	BYTE pdrv,			/* Physical drive nmuber (0..) */
+	const BYTE *buff,	/* Data to be written */
+	DWORD sector,		/* Sector address (LBA) */
+	BYTE count			/* Number of sectors to write (1..128) */
+)
+{
+	count_stat(STAT_DISK_SECTORS_WRITTEN, count);
+	trace(TRACE_DISK_WRITE, sector, (pdrv << 8) | count);
+	switch (pdrv)
+	{
+		case DRIVE_MMC: return mmc_disk_write(pdrv, buff, sector, count);
+		case DRIVE_RAM: return ram_disk_write(pdrv, buff, sector, count);
+	}
+	return RES_PARERR;
+}
+#endif
+
+#if _USE_IOCTL
+DRESULT disk_ioctl (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE cmd,		/* Control code */
+	void *buff		/* Buffer to send/receive control data */
+)
+{
+	switch (pdrv)
+	{
+		case DRIVE_MMC: return mmc_disk_ioctl(pdrv, cmd, buff);
+		case DRIVE_RAM: return ram_disk_ioctl(pdrv, cmd, buff);
+	}
+	return RES_PARERR;
+}
+#endif
@@ -7,52 +7,181 @@
 
 #include "globals.h"
 
+/* The file is read CHUNK bytes at a time; each chunk is formatted into a
+ * text buffer, which is then written out in one go. Both fit in the
+ * scratch arena. */
+
+#define CHUNK 512
+#define LINE_BYTES 16
+#define MAX_LINE 80 /* longest line the formatter can produce */
+
+static char hexbytes[256][2];
+static int hexinited = 0;
+
+static void init_hex(void)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i=0; i<256; i++)
+	{
+		hexbytes[i][0] = digits[i >> 4];
+		hexbytes[i][1] = digits[i & 15];
+	}
+	hexinited = 1;
+}
+
+static char* puthex32(char* p, uint32_t value)
+{
+	memcpy(p+0, hexbytes[(value >> 24) & 0xff], 2);
+	memcpy(p+2, hexbytes[(value >> 16) & 0xff], 2);
+	memcpy(p+4, hexbytes[(value >> 8) & 0xff], 2);
+	memcpy(p+6, hexbytes[value & 0xff], 2);
+	return p+8;
+}
+
+/* Formats one line of up to LINE_BYTES bytes; returns the end of the
+ * text. Elements of more than one byte are little-endian. */
+
+static char* format_line(char* p, uint32_t address, const uint8_t* data,
+	int len, unsigned size)
+{
+	int i, j;
+
+	p = puthex32(p, address);
+	*p++ = ' ';
+	*p++ = ':';
+	*p++ = ' ';
+
+	for (i=0; i<LINE_BYTES; i+=size)
+	{
+		if ((i+size) <= len)
+		{
+			for (j=size-1; j>=0; j--)
+			{
+				memcpy(p, hexbytes[data[i+j]], 2);
+				p += 2;
+			}
+		}
+		else
+		{
+			memset(p, ' ', size*2);
+			p += size*2;
+		}
+		*p++ = ' ';
+	}
+
+	*p++ = ':';
+	*p++ = ' ';
+
+	for (i=0; i<len; i++)
+	{
+		uint8_t c = data[i];
+		if ((c <= 32) || (c >= 127))
+			c = '.';
+		*p++ = c;
+	}
+	*p++ = '\n';
+	return p;
+}
+
+static int parse_range(const char* s, uint32_t* offset, uint32_t* len)
+{
+	char* p;
+
+	*offset = strtoul(s, &p, 16);
+	if (p == s)
+		goto malformed;
+	if (*p == '+')
+	{
+		s = p+1;
+		*len = strtoul(s, &p, 16);
+		if (p == s)
+			goto malformed;
+	}
+	if (*p)
+		goto malformed;
+	return 1;
+
+malformed:
+	setError("malformed range (use <offset> or <offset>+<len>, in hex)");
+	return 0;
+}
+
 static void dump_cb(int argc, const char* argv[])
 {
-	struct file* fp;
+	struct file* fp = NULL;
+	uint8_t* buffer = NULL;
+	char* text = NULL;
+	unsigned size = 1;
 	uint32_t base;
-	uint32_t offset;
-	uint8_t buffer[16];
+	uint32_t filelen;
+	uint32_t offset = 0;
+	uint32_t len = 0xffffffff;
+	int i = 1;
 
-	if (argc != 2)
+	if (argc > 2)
 	{
-		setError("syntax: dump <filename>");
+		if (strcmp(argv[i], "quad") == 0)
+			size = 4, i++;
+		else if (strcmp(argv[i], "word") == 0)
+			size = 2, i++;
+		else if (strcmp(argv[i], "byte") == 0)
+			size = 1, i++;
+	}
+
+	if ((argc - i) == 2)
+	{
+		if (!parse_range(argv[i+1], &offset, &len))
+			return;
+	}
+	else if ((argc - i) != 1)
+	{
+		setError("syntax: dump [quad|word|byte] <filename> [<offset>[+<len>]]");
 		return;
 	}
 
-	fp = vfs_open(argv[1], O_RDONLY);
+	fp = vfs_open(argv[i], O_RDONLY);
 	if (!fp)
 		return;
 
-	vfs_info(fp, &base, NULL);
-	offset = 0;
-	for (;;)
-	{
-		int i;
-		int r = vfs_read(fp, offset, buffer, 16);
-		printf("%08x : ", offset + base);
+	if (!hexinited)
+		init_hex();
+	buffer = scratch_alloc(CHUNK);
+	text = scratch_alloc((CHUNK/LINE_BYTES) * MAX_LINE);
+	if (!buffer || !text)
+		goto exit;
 
-		for (i=0; i<r; i++)
-			printf("%02x ", buffer[i]);
-		for (i=r; i<16; i++)
-			printf("   ");
+	vfs_info(fp, &base, &filelen);
+	if (offset > filelen)
+		offset = filelen;
+	if (len > (filelen - offset))
+		len = filelen - offset;
 
-		printf(": ");
+	while (len)
+	{
+		uint32_t r = (len > CHUNK) ? CHUNK : len;
+		char* p = text;
+		uint32_t j;
 
-		for (i=0; i<r; i++)
+		r = vfs_read(fp, offset, buffer, r);
+		if (r == 0)
+			break;
+
+		for (j=0; j<r; j+=LINE_BYTES)
 		{
-			uint8_t c = buffer[i];
-			if ((c <= 32) || (c >= 127))
-				c = '.';
-			putchar(c);
+			int n = r - j;
+			if (n > LINE_BYTES)
+				n = LINE_BYTES;
+			p = format_line(p, base + offset + j, buffer + j, n, size);
 		}
-		printf("\n");
+		fwrite(text, 1, p - text, stdout);
 
-		if (r != 16)
-			break;
-		offset += 16;
+		offset += r;
+		len -= r;
 	}
 
+exit:
 	vfs_close(fp);
 }
 
@@ -62,11 +191,11 @@ const struct command dump_cmd =
 	"hex-dumps a file",
 
 	"Syntax:\n"
-	"  dump <filename>\n"
+	"  dump [quad|word|byte] <filename> [<offset>[+<len>]]\n"
+	"Shows the contents of the file as bytes (the default), 16-bit words or\n"
+	"32-bit quads. The optional range (in hex) selects part of the file.\n"
 	"To dump memory, use a mem: file, e.g.:\n"
-	"  dump mem:80000000+ff",
+	"  dump quad mem:80000000+ff",
 
 	dump_cb
 };
-
-
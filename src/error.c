@@ -7,28 +7,23 @@
 
 #include "globals.h"
 
+/* There's only ever one error, so it lives in a static buffer. (The
+ * scheduler keeps a copy for each background job.) */
+
+static char buffer[ERROR_SIZE];
 char* error;
 
 void clearError(void)
 {
-	free(error);
 	error = NULL;
 }
 
 void setError(const char* msg, ...)
 {
 	va_list ap;
-	int bytes;
-
-	clearError();
-
-	va_start(ap, msg);
-	bytes = vsnprintf(NULL, 0, msg, ap);
-	va_end(ap);
 
-	error = malloc(bytes+1);
 	va_start(ap, msg);
-	vsnprintf(error, bytes+1, msg, ap);
+	vsnprintf(buffer, sizeof(buffer), msg, ap);
 	va_end(ap);
+	error = buffer;
 }
-
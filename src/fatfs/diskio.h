@@ -38,6 +38,24 @@ DRESULT disk_read (BYTE pdrv, BYTE*buff, DWORD sector, BYTE count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, BYTE count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 
+/* piface: the drivers behind each physical drive, dispatched by
+ * src/diskio.c. */
+
+#define DRIVE_MMC 0
+#define DRIVE_RAM 1
+
+DSTATUS mmc_disk_initialize (BYTE pdrv);
+DSTATUS mmc_disk_status (BYTE pdrv);
+DRESULT mmc_disk_read (BYTE pdrv, BYTE*buff, DWORD sector, BYTE count);
+DRESULT mmc_disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, BYTE count);
+DRESULT mmc_disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
+
+DSTATUS ram_disk_initialize (BYTE pdrv);
+DSTATUS ram_disk_status (BYTE pdrv);
+DRESULT ram_disk_read (BYTE pdrv, BYTE*buff, DWORD sector, BYTE count);
+DRESULT ram_disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, BYTE count);
+DRESULT ram_disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
+
 
 /* Disk Status Bits (DSTATUS) */
 #define STA_NOINIT		0x01	/* Drive not initialized */
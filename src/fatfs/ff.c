@@ -98,6 +98,7 @@
 
 #include "ff.h"			/* FatFs configurations and declarations */
 #include "diskio.h"		/* Declarations of low level disk I/O functions */
+#include "../globals.h"	/* piface: performance counters and tracing */
 
 
 /*--------------------------------------------------------------------------
@@ -738,6 +739,8 @@ FRESULT sync_window (
 
 	
 	if (fs->wflag) {	/* Write back the sector if it is dirty */
+		count_stat(STAT_FAT_WINDOW_WRITES, 1);
+		trace(TRACE_FAT_SYNC, fs->winsect, 0);
 		wsect = fs->winsect;	/* Current sector number */
 		if (disk_write(fs->drv, fs->win, wsect, 1) != RES_OK)
 			return FR_DISK_ERR;
@@ -765,6 +768,8 @@ FRESULT move_window (
 		if (sync_window(fs) != FR_OK)
 			return FR_DISK_ERR;
 #endif
+		count_stat(STAT_FAT_WINDOW_READS, 1);
+		trace(TRACE_FAT_MOVE, sector, fs->winsect);
 		if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK)
 			return FR_DISK_ERR;
 		fs->winsect = sector;
@@ -851,6 +856,7 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, Else:Cluster status
 	if (clst < 2 || clst >= fs->n_fatent)	/* Check range */
 		return 1;
 
+	count_stat(STAT_FAT_LOOKUPS, 1);
 	switch (fs->fs_type) {
 	case FS_FAT12 :
 		bc = (UINT)clst; bc += bc / 2;
@@ -3116,6 +3122,89 @@ FRESULT f_readdir (
 
 
 
+
+#if !_USE_LFN
+/*-----------------------------------------------------------------------*/
+/* Read Directory Entries in Bulk (piface)                               */
+/*-----------------------------------------------------------------------*/
+/* Reads as many directory sectors as are contiguous (up to the size of
+/  the work buffer) with one disk_read() and picks the items out of them,
+/  rather than moving the window a sector at a time. Returns items in the
+/  same order as f_readdir(); *count is 0 at the end of the directory. */
+
+FRESULT f_readdir_batch (
+	DIR *dj,			/* Pointer to the open directory object */
+	FILINFO *fno,		/* Array to return file information in */
+	UINT n,				/* Number of items the array can hold */
+	UINT *count,		/* Pointer to a variable to return the number of items read */
+	void *work,			/* Pointer to a buffer for directory sectors */
+	UINT worksize		/* Size of the buffer in bytes (at least one sector) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD start;
+	UINT per, ns, rem;
+	BYTE a, c, *dir, *save;
+
+
+	*count = 0;
+	res = validate(dj);						/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(dj->fs, res);
+	fs = dj->fs;
+	per = SS(fs) / SZ_DIR;					/* Entries per sector */
+	ns = worksize / SS(fs);
+	if (ns > 128) ns = 128;					/* disk_read() takes a BYTE count */
+	if (!ns || !n) LEAVE_FF(fs, FR_INVALID_PARAMETER);
+#if !_FS_READONLY
+	res = sync_window(fs);					/* The disk must be up to date */
+#endif
+
+	while (res == FR_OK && dj->sect && *count < n) {
+		/* Read the rest of the cluster (or static root table) in one go */
+		if (dj->clust == 0)
+			rem = fs->n_rootdir / per - dj->index / per;
+		else
+			rem = fs->csize - (dj->sect - fs->database) % fs->csize;
+		if (rem > ns) rem = ns;
+		start = dj->sect;
+		if (disk_read(fs->drv, work, start, (BYTE)rem) != RES_OK) {
+			res = FR_DISK_ERR;
+			break;
+		}
+
+		/* Pick out the valid entries, as dir_read() does */
+		for (;;) {
+			dir = (BYTE*)work + (dj->sect - start) * SS(fs) + (dj->index % per) * SZ_DIR;
+			c = dir[DIR_Name];
+			if (c == 0) {					/* Reached the end of the table */
+				dj->sect = 0;
+				break;
+			}
+			a = dir[DIR_Attr] & AM_MASK;
+			if (c != DDE && (_FS_RPATH || c != '.') && a != AM_LFN && a != AM_VOL) {
+				save = dj->dir;
+				dj->dir = dir;
+				get_fileinfo(dj, &fno[(*count)++]);
+				dj->dir = save;
+			}
+			res = dir_next(dj, 0);			/* Next entry */
+			if (res != FR_OK) {
+				if (res == FR_NO_FILE) res = FR_OK;
+				dj->sect = 0;
+				break;
+			}
+			if (*count == n || dj->sect < start || dj->sect >= start + rem)
+				break;						/* Full, or past what was read */
+		}
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif /* !_USE_LFN */
+
+
+
 #if _FS_MINIMIZE == 0
 /*-----------------------------------------------------------------------*/
 /* Get File Status                                                       */
@@ -3264,6 +3353,182 @@ FRESULT f_truncate (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Flush and Forget Cached Sectors of a Volume (piface)                  */
+/*-----------------------------------------------------------------------*/
+/* For when the volume's sectors are about to be, or have been, written
+/  behind FatFs's back: anything dirty is written back, and the FAT and
+/  directories are read afresh (and the free clusters recounted) when next
+/  needed. Open files stay valid, but keep any data they have buffered. */
+
+#if !_FS_READONLY
+FRESULT f_flushvol (
+	BYTE vol		/* Logical drive number */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	if (vol >= _VOLUMES) return FR_INVALID_DRIVE;
+	fs = FatFs[vol];
+	if (!fs || !fs->fs_type) return FR_OK;	/* Not mounted; nothing cached */
+
+	ENTER_FF(fs);
+	res = sync_fs(fs);
+	if (res == FR_OK) {
+		fs->winsect = 0;					/* Invalidate sector cache */
+		fs->free_clust = 0xFFFFFFFF;		/* Recount free clusters */
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Count Fragments of a File (piface)                                    */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_fragments (
+	FIL *fp,		/* Pointer to the file object */
+	DWORD *nclst,	/* Pointer to a variable to return number of clusters */
+	DWORD *nfrag	/* Pointer to a variable to return number of fragments */
+)
+{
+	FRESULT res;
+	DWORD clst, nxt;
+
+
+	*nclst = *nfrag = 0;
+	res = validate(fp);						/* Check validity of the object */
+	if (res == FR_OK) {
+		clst = fp->sclust;
+		if (clst) *nfrag = 1;
+		while (clst >= 2 && clst < fp->fs->n_fatent) {	/* Follow the chain to the last link */
+			if (++*nclst > fp->fs->n_fatent) { res = FR_INT_ERR; break; }	/* Loop? */
+			nxt = get_fat(fp->fs, clst);
+			if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (nxt < 2) { res = FR_INT_ERR; break; }
+			if (nxt < fp->fs->n_fatent && nxt != clst + 1) (*nfrag)++;	/* A break in the chain */
+			clst = nxt;
+		}
+	}
+
+	LEAVE_FF(fp->fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Make a File Contiguous (piface)                                       */
+/*-----------------------------------------------------------------------*/
+/* The data is copied into the first free run of clusters big enough to
+/  hold it, which is then linked up and written out before the directory
+/  entry is switched over to it; only then is the old chain freed. If
+/  anything goes wrong part way, the worst left behind is lost clusters.
+/  The file pointer is rewound to the top of the file. */
+
+FRESULT f_defrag (
+	FIL *fp,		/* Pointer to the file object (opened with FA_WRITE) */
+	void *work,		/* Pointer to a buffer to move data through */
+	UINT worksize	/* Size of the buffer in bytes (at least one sector) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, nfrag, scl, ncl, clst, nxt, i, r, sect, dsect, left;
+	UINT nsect, cnt;
+
+
+	res = f_sync(fp);						/* Flush the file (and check validity) */
+	if (res == FR_OK && !(fp->flag & FA_WRITE)) res = FR_DENIED;
+	if (res == FR_OK) res = f_fragments(fp, &n, &nfrag);
+	if (res != FR_OK || nfrag <= 1) LEAVE_FF(fp->fs, res);	/* Error or nothing to do */
+
+	fs = fp->fs;
+	nsect = worksize / SS(fs);
+	if (nsect > 128) nsect = 128;			/* disk_read() takes a BYTE count */
+	if (!nsect) LEAVE_FF(fs, FR_INVALID_PARAMETER);
+
+	/* Find n free clusters in a row */
+	r = 0;
+	for (ncl = 2; ncl < fs->n_fatent; ncl++) {
+		nxt = get_fat(fs, ncl);
+		if (nxt == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+		if (nxt == 1) LEAVE_FF(fs, FR_INT_ERR);
+		if (nxt != 0) {
+			r = 0;
+		} else {
+			if (++r == n) break;
+		}
+	}
+	if (r < n) LEAVE_FF(fs, FR_DENIED);		/* No room */
+	scl = ncl - n + 1;
+
+	/* Copy the data, one run of contiguous source clusters at a time */
+	clst = fp->sclust;
+	for (i = 0; i < n; i += r) {
+		r = 0;
+		nxt = clst;
+		do {
+			r++;
+			nxt = get_fat(fs, nxt);
+			if (nxt == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+			if (nxt < 2) LEAVE_FF(fs, FR_INT_ERR);
+		} while (nxt == clst + r);
+		sect = clust2sect(fs, clst);
+		dsect = clust2sect(fs, scl + i);
+		for (left = r * fs->csize; left; left -= cnt) {
+			cnt = (left < nsect) ? (UINT)left : nsect;
+			if (disk_read(fs->drv, work, sect, (BYTE)cnt) != RES_OK)
+				LEAVE_FF(fs, FR_DISK_ERR);
+			if (disk_write(fs->drv, work, dsect, (BYTE)cnt) != RES_OK)
+				LEAVE_FF(fs, FR_DISK_ERR);
+			sect += cnt; dsect += cnt;
+		}
+		clst = nxt;
+	}
+
+	/* Link up the new chain and make sure it is on the disk */
+	for (i = 0; i < n; i++) {
+		res = put_fat(fs, scl + i, (i == n - 1) ? 0x0FFFFFFF : scl + i + 1);
+		if (res != FR_OK) LEAVE_FF(fs, res);
+	}
+	if (fs->free_clust != 0xFFFFFFFF) {
+		fs->free_clust -= n;
+		fs->fsi_flag = 1;
+	}
+	res = sync_window(fs);
+
+	/* Switch the directory entry over to it */
+	if (res == FR_OK) res = move_window(fs, fp->dir_sect);
+	if (res == FR_OK) {
+		st_clust(fp->dir_ptr, scl);
+		fs->wflag = 1;
+		res = sync_window(fs);
+	}
+	if (res != FR_OK) ABORT(fs, res);
+
+	/* Free the old chain */
+	clst = fp->sclust;
+	fp->sclust = scl;
+	fp->fptr = 0;
+	fp->clust = scl;
+	fp->dsect = 0;							/* Invalidate the sector buffer */
+	res = remove_chain(fs, clst);
+	if (res == FR_OK) res = sync_fs(fs);
+	if (res != FR_OK) fp->flag |= FA__ERROR;
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Delete a File or Directory                                            */
@@ -210,11 +210,15 @@ FRESULT f_lseek (FIL* fp, DWORD ofs);								/* Move file pointer of a file obje
 FRESULT f_close (FIL* fp);											/* Close an open file object */
 FRESULT f_opendir (DIR* dj, const TCHAR* path);						/* Open an existing directory */
 FRESULT f_readdir (DIR* dj, FILINFO* fno);							/* Read a directory item */
+FRESULT f_readdir_batch (DIR* dj, FILINFO* fno, UINT n, UINT* count, void* work, UINT worksize);	/* Read directory items in bulk (piface) */
 FRESULT f_stat (const TCHAR* path, FILINFO* fno);					/* Get file status */
 FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data to a file */
 FRESULT f_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get number of free clusters on the drive */
 FRESULT f_truncate (FIL* fp);										/* Truncate file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of a writing file */
+FRESULT f_flushvol (BYTE vol);										/* Flush and forget cached sectors of a volume (piface) */
+FRESULT f_fragments (FIL* fp, DWORD* nclst, DWORD* nfrag);			/* Count the fragments of a file (piface) */
+FRESULT f_defrag (FIL* fp, void* work, UINT worksize);				/* Make a file contiguous (piface) */
 FRESULT f_unlink (const TCHAR* path);								/* Delete an existing file or directory */
 FRESULT	f_mkdir (const TCHAR* path);								/* Create a new directory */
 FRESULT f_chmod (const TCHAR* path, BYTE value, BYTE mask);			/* Change attribute of the file/dir */
@@ -7,53 +7,109 @@
 
 #include "globals.h"
 
-#define BUFFER_SIZE 512
+/* Transfer buffers take whatever is left of the scratch arena, in whole
+ * sectors, so that blk: and sd: get multiple-block transfers; but at
+ * most this much. */
+#define BUFFER_MAX (64*1024)
 
-static void cp_cb(int argc, const char* argv[])
+
+/* Prints the totals for a batch of files. */
+
+static void report(uint32_t files, uint32_t bytes, uint32_t us)
+{
+	uint32_t ms = us / 1000;
+	uint32_t rate = 0;
+
+	if (ms)
+		rate = (bytes / ms * 1000) + ((bytes % ms) * 1000 / ms);
+
+	printf("%u files, %u bytes in %u.%03u s (%u bytes/s)\n",
+		(unsigned) files, (unsigned) bytes, (unsigned) (ms / 1000),
+		(unsigned) (ms % 1000), (unsigned) rate);
+}
+
+/* Copies one file through a buffer; returns the number of bytes copied.
+ * Copies to mem: need no buffer, as the source is read straight into
+ * place, in one go; that lets lz4: and gz: decode directly into the
+ * destination, without a window (see vfs_compress.c). */
+
+static uint32_t copy_file(const char* src, const char* dest)
 {
+	uint32_t mark = scratch_mark();
+	uint8_t* buffer;
+	uint8_t* target;
+	uint32_t size;
+	uint32_t room;
 	struct file* srcfile = NULL;
 	struct file* destfile = NULL;
-	char* buffer = NULL;
 	uint32_t len;
-	uint32_t offset;
+	uint32_t offset = 0;
 	uint32_t prevoffset;
 
-	if (argc != 3)
-	{
-		setError("syntax: cp <srcfile> <destfile>");
-		return;
-	}
-
-	srcfile = vfs_open(argv[1], O_RDONLY);
+	srcfile = vfs_open(src, O_RDONLY);
 	if (!srcfile)
 		goto exit;
 
-	destfile = vfs_open(argv[2], O_WRONLY);
+	destfile = vfs_open(dest, O_WRONLY);
 	if (!destfile)
 		goto exit;
 
-	buffer = malloc(BUFFER_SIZE);
+	target = vfs_mem_address(destfile, &room);
+	if (target)
+		size = room;
+	else
+	{
+		buffer = scratch_alloc_upto(512, BUFFER_MAX, &size);
+		if (!buffer)
+			goto exit;
+	}
 	vfs_info(srcfile, NULL, &len);
-	offset = 0;
 
 	prevoffset = 0;
 	for (;;)
 	{
-		uint32_t w;
 		uint32_t r = len - offset;
 		if (r == 0)
 			break;
-		if (r > BUFFER_SIZE)
-			r = BUFFER_SIZE;
+		if (r > size)
+			r = size;
 
-		r = vfs_read(srcfile, offset, buffer, r);
+		if (target)
+		{
+			if (offset == room)
+			{
+				setError("destination is full");
+				goto exit;
+			}
+			if (r > (room - offset))
+				r = room - offset;
+			buffer = target + offset;
+		}
 
-		w = 0;
-		while (w < r)
+		r = vfs_read(srcfile, offset, buffer, r);
+		if (r == 0)
+		{
+			if (!error)
+				setError("source file is shorter than it claims");
+			goto exit;
+		}
+		if (target)
+			offset += r;
+		else
 		{
-			uint32_t i = vfs_write(destfile, offset, buffer+w, r-w);
-			w += i;
-			offset += i;
+			uint32_t w = 0;
+			while (w < r)
+			{
+				uint32_t i = vfs_write(destfile, offset, buffer+w, r-w);
+				if (i == 0)
+				{
+					if (!error)
+						setError("destination is full");
+					goto exit;
+				}
+				w += i;
+				offset += i;
+			}
 		}
 
 		if ((offset - prevoffset) >= (16*1024))
@@ -62,27 +118,91 @@ static void cp_cb(int argc, const char* argv[])
 			fflush(stdout);
 			prevoffset = offset;
 		}
+		yield();
 	}
 	printf("\n");
 
 exit:
-	if (buffer)
-		free(buffer);
 	if (srcfile)
 		vfs_close(srcfile);
 	if (destfile)
 		vfs_close(destfile);
+	scratch_release(mark);
+	return offset;
+}
+
+static void cp_cb(int argc, const char* argv[])
+{
+	struct vfs_match* sources;
+	struct vfs_match* m;
+	const char* dest;
+	int todir;
+	int len;
+	uint32_t files = 0;
+	uint32_t bytes = 0;
+	uint32_t start;
+
+	if (argc < 3)
+	{
+		setError("syntax: cp <srcfile...> <dest>");
+		return;
+	}
+
+	sources = vfs_glob(argc-2, argv+1, 0);
+	if (!sources)
+		return;
+
+	/* With more than one source, or a destination ending in a separator,
+	 * the destination is a directory. */
+
+	dest = argv[argc-1];
+	len = strlen(dest);
+	todir = sources->next ||
+		(len && ((dest[len-1] == '/') || (dest[len-1] == ':')));
+
+	start = read_timer();
+	for (m = sources; m; m = m->next)
+	{
+		const char* target = dest;
+
+		if (todir)
+		{
+			char* p = scratch_alloc(len + strlen(m->name) + 2);
+			if (!p)
+				return;
+			strcpy(p, dest);
+			if (len && (dest[len-1] != '/') && (dest[len-1] != ':'))
+				strcat(p, "/");
+			strcat(p, m->name);
+			target = p;
+			printf("%s -> %s\n", m->path, target);
+		}
+
+		bytes += copy_file(m->path, target);
+		if (error)
+			return;
+		files++;
+	}
+
+	if (files > 1)
+		report(files, bytes, read_timer() - start);
 }
 
 const struct command cp_cmd =
 {
 	"cp",
-	"copies one file to another",
+	"copies files",
 
 	"Syntax:\n"
 	"  cp <srcfile> <destfile>\n"
-	"Copies a file. Any filesystem scheme can be used. Wildcards are not\n"
-	"supported!",
+	"  cp <srcfile...> <destdir>\n"
+	"Copies a file, or several files into a directory (which must already\n"
+	"exist). Any filesystem scheme can be used. Sources may contain * and ?\n"
+	"wildcards in their last component, on filesystems which can list\n"
+	"their files (sd:, ram:, blk:). Compressed files can be unpacked on the\n"
+	"way by prefixing the source with lz4: or gz:, as in lz4:sd:/kernel.lz4.\n"
+	"To write a disk image, copy it to blk: (the whole card) or blk:<n>\n"
+	"(partition n).",
 
 	cp_cb
 };
@@ -96,15 +216,67 @@ static void ls_enumerate_cb(const char* path, int isdir, uint32_t len)
 	printf("%s\n", path);
 }
 
+static void ls_enter(struct walker* w, const char* path)
+{
+	if (w->dirs)
+		printf("\n");
+	printf("%s:\n", path);
+}
+
+static void ls_entry(struct walker* w, const char* path,
+		const struct vfs_dirent* de)
+{
+	ls_enumerate_cb(de->name, de->isdir, de->length);
+}
+
 static void ls_cb(int argc, const char* argv[])
 {
-	if (argc != 2)
+	struct vfs_match* list;
+	struct vfs_match* m;
+	const char* root[2];
+	int recursive = 0;
+
+	if ((argc > 1) && (strcmp(argv[1], "-R") == 0))
+	{
+		recursive = 1;
+		argc--;
+		argv++;
+	}
+
+	/* There's no current directory, so with no path, list the card. */
+	if (argc < 2)
+	{
+		root[0] = argv[0];
+		root[1] = "sd:";
+		argc = 2;
+		argv = root;
+	}
+
+	if (recursive)
 	{
-		setError("syntax: ls <path>");
+		struct walker w;
+		int i;
+
+		memset(&w, 0, sizeof(w));
+		w.enter = ls_enter;
+		w.entry = ls_entry;
+		for (i=1; (i<argc) && !error; i++)
+			walk_tree(&w, argv[i]);
 		return;
 	}
 
-	vfs_enumerate(argv[1], ls_enumerate_cb);
+	list = vfs_glob(argc-1, argv+1, 1);
+	for (m = list; m && !error; m = m->next)
+	{
+		if (m->isdir != -1)
+			ls_enumerate_cb(m->name, m->isdir, m->length);
+		else
+		{
+			if (argc > 2)
+				printf("%s:\n", m->path);
+			vfs_enumerate(m->path, ls_enumerate_cb);
+		}
+	}
 }
 
 const struct command ls_cmd =
@@ -113,9 +285,90 @@ const struct command ls_cmd =
 	"lists files available at a path",
 
 	"Syntax:\n"
-	"  ls <path>\n"
+	"  ls [-R] [<path...>]\n"
 	"Lists files available at a particular path (if the file system supports\n"
-	"it).",
+	"it), or on sd: if no path is given. A path with * or ? wildcards in its\n"
+	"last component lists just the matching files. With -R, lists every\n"
+	"directory under the path too; see also du and findfile.",
 
 	ls_cb
 };
+
+static void crc_cb(int argc, const char* argv[])
+{
+	struct vfs_match* list;
+	struct vfs_match* m;
+	uint8_t* buffer;
+	uint32_t size;
+	uint32_t files = 0;
+	uint32_t bytes = 0;
+	uint32_t start;
+
+	if (argc < 2)
+	{
+		setError("syntax: crc <file...>");
+		return;
+	}
+
+	list = vfs_glob(argc-1, argv+1, 0);
+	if (!list)
+		return;
+	buffer = scratch_alloc_upto(512, BUFFER_MAX, &size);
+	if (!buffer)
+		return;
+
+	start = read_timer();
+	for (m = list; m && !error; m = m->next)
+	{
+		struct file* fp = vfs_open(m->path, O_RDONLY);
+		uint32_t crc = 0;
+		uint32_t offset = 0;
+		uint32_t len;
+
+		if (!fp)
+			break;
+
+		vfs_info(fp, NULL, &len);
+		while (offset < len)
+		{
+			uint32_t n = len - offset;
+			if (n > size)
+				n = size;
+
+			n = vfs_read(fp, offset, buffer, n);
+			if (n == 0)
+			{
+				if (!error)
+					setError("%s is shorter than it claims", m->path);
+				break;
+			}
+			crc = update_crc32(crc, buffer, n);
+			offset += n;
+			yield();
+		}
+		vfs_close(fp);
+
+		if (error)
+			break;
+		printf("%08x %10u  %s\n", (unsigned) crc, (unsigned) len, m->path);
+		files++;
+		bytes += offset;
+	}
+
+	/* (Including when it stopped early, for the files it did.) */
+	if (files > 1)
+		report(files, bytes, read_timer() - start);
+}
+
+const struct command crc_cmd =
+{
+	"crc",
+	"calculates the CRC-32 of files",
+
+	"Syntax:\n"
+	"  crc <file...>\n"
+	"Prints the CRC-32 (as used by zip and gzip) and the length of each\n"
+	"file. Wildcards work as they do for cp.",
+
+	crc_cb
+};
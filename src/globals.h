@@ -30,10 +30,130 @@ extern char** environ;
 
 /* Error reporting */
 
+#define ERROR_SIZE 256 /* longer messages are truncated */
+
 extern char* error;
 extern void clearError(void);
 extern void setError(const char* msg, ...);
 
+/* Memory: fixed-size pools and the per-command scratch arena (see mem.c). */
+
+struct pool
+{
+	const char* name;
+	uint32_t size;
+	uint32_t count;
+	uint8_t* storage;
+	void* freelist;
+	int inited;
+	uint32_t used;
+	uint32_t highwater;
+	uint32_t overflows;
+};
+
+#define SCRATCH_SIZE (8*1024)
+
+struct overflow;
+
+struct arena
+{
+	uint8_t* base;
+	uint32_t size;
+	uint32_t top;
+	uint32_t high;
+	struct overflow* overflow;
+	uint32_t overflows;
+};
+
+extern struct pool file_pool;
+extern struct pool fat_pool;
+extern struct pool sector_pool;
+
+extern void mem_init(void);
+extern void* pool_alloc(struct pool* p);
+extern void pool_free(struct pool* p, void* o);
+extern void* scratch_alloc(uint32_t size);
+extern void* scratch_alloc_upto(uint32_t unit, uint32_t max, uint32_t* size);
+extern void* scratch_borrow(uint32_t unit, uint32_t max, uint32_t* size);
+extern void scratch_return(void* p, uint32_t size);
+extern uint32_t scratch_mark(void);
+extern void scratch_release(uint32_t mark);
+extern void scratch_switch(struct arena* a);
+
+/* Cooperative scheduler for background jobs (see sched.c). */
+
+struct command;
+
+struct lock
+{
+	void* owner;
+	int depth;
+};
+
+extern void sched_run(void (*console)(void));
+extern void sched_spawn(const struct command* cmd, int argc, char* argv[]);
+extern int sched_busy(void);
+extern void sched_report(void);
+extern void yield(void);
+extern void sched_idle(void);
+extern void sched_lock(struct lock* l);
+extern void sched_unlock(struct lock* l);
+
+/* Performance counters. To add one, add it here and give it a name in
+ * stats.c. */
+
+enum
+{
+	STAT_VFS_OPENS,
+	STAT_VFS_READS,
+	STAT_VFS_READ_BYTES,
+	STAT_VFS_WRITES,
+	STAT_VFS_WRITE_BYTES,
+	STAT_FAT_WINDOW_READS,
+	STAT_FAT_WINDOW_WRITES,
+	STAT_FAT_LOOKUPS,
+	STAT_DISK_SECTORS_READ,
+	STAT_DISK_SECTORS_WRITTEN,
+	STAT_MMC_COMMANDS,
+	STAT_MMC_RETRIES,
+	STAT_XMODEM_BLOCKS,
+	STAT_XMODEM_NAKS,
+	STAT_XMODEM_TIMEOUTS,
+	STAT_RPC_PACKETS_IN,
+	STAT_RPC_PACKETS_OUT,
+	STAT_RPC_CRC_ERRORS,
+
+	NUM_STATS
+};
+
+extern uint32_t stats[NUM_STATS];
+extern const char* stat_names[NUM_STATS];
+#define count_stat(s, n) (stats[s] += (n))
+
+/* Event tracing into an in-memory ring; see trace.c. Each event carries
+ * two event-specific arguments. */
+
+enum
+{
+	TRACE_VFS_OPEN,     /* flags */
+	TRACE_VFS_CLOSE,
+	TRACE_VFS_READ,     /* offset, length */
+	TRACE_VFS_WRITE,    /* offset, length */
+	TRACE_FAT_MOVE,     /* new sector, old sector */
+	TRACE_FAT_SYNC,     /* sector */
+	TRACE_DISK_READ,    /* sector, drive<<8 | count */
+	TRACE_DISK_WRITE,   /* sector, drive<<8 | count */
+	TRACE_MMC_COMMAND,  /* command, argument */
+	TRACE_MMC_RETRY,    /* card address, attempt */
+
+	NUM_TRACE_EVENTS
+};
+
+extern int trace_enabled;
+extern void trace_event(int event, uint32_t a, uint32_t b);
+#define trace(e, a, b) \
+	do { if (trace_enabled) trace_event(e, a, b); } while (0)
+
 /* User commands */
 
 struct command
@@ -49,27 +169,63 @@ extern const struct command recv_cmd;
 extern const struct command dump_cmd;
 extern const struct command go_cmd;
 extern const struct command poke_cmd;
+extern const struct command fill_cmd;
+extern const struct command cmp_cmd;
+extern const struct command move_cmd;
+extern const struct command find_cmd;
 extern const struct command cp_cmd;
 extern const struct command ls_cmd;
+extern const struct command crc_cmd;
+extern const struct command du_cmd;
+extern const struct command findfile_cmd;
+extern const struct command rpc_cmd;
+extern const struct command bench_cmd;
+extern const struct command stats_cmd;
+extern const struct command trace_cmd;
+extern const struct command ramdisk_cmd;
+extern const struct command load_cmd;
+extern const struct command mem_cmd;
+extern const struct command jobs_cmd;
+extern const struct command wait_cmd;
+extern const struct command frag_cmd;
+extern const struct command defrag_cmd;
 
 /* Command line parser (do not use reentrantly) */
 
 extern void init_console(void);
 extern void newlines_on(void);
 extern void newlines_off(void);
-extern char* readline(void);
+extern char* readline(const char* prompt);
 extern void execute_command(char* cmd);
+extern void execute_rpc_command(char* cmd);
+extern char* real_command(char* argv[]);
+extern int console_command(const char* name);
+extern void execute_script(const char* filename);
 
 /* VFS declarations */
 
 typedef void vfs_enumerate_f(const char* path, int isdir, uint32_t length);
 
+struct vfs_dirent
+{
+	const char* name;
+	int isdir;
+	uint32_t length;
+};
+
+/* Called with a batch of directory entries, which only last for the
+ * duration of the call. It mustn't enumerate anything itself. */
+typedef void vfs_batch_f(const struct vfs_dirent* entries, int count,
+	void* context);
+
 struct vfs
 {
 	const char* name;
 	const struct filecbs* callbacks;
 	void* (*open)(const char* path, int flags);
 	void (*enumerate)(const char* path, vfs_enumerate_f* callback);
+	void (*enumerate_batch)(const char* path, vfs_batch_f* callback,
+		void* context); /* may be NULL */
 };
 
 struct filecbs
@@ -80,6 +236,7 @@ struct filecbs
 	uint32_t (*write)(void* backend,
 		uint32_t offset, void* buffer, uint32_t length);
 	void (*info)(void* backend, uint32_t* base, uint32_t* length);
+	void (*truncate)(void* backend, uint32_t length); /* may be NULL */
 };
 
 struct file
@@ -96,21 +253,84 @@ extern uint32_t vfs_write(struct file* fp,
 	uint32_t offset, void* buffer, uint32_t length);
 extern void vfs_info(struct file* fp,
 	uint32_t* base, uint32_t* length);
+extern void vfs_truncate(struct file* fp, uint32_t length);
 extern void vfs_enumerate(const char* path, vfs_enumerate_f* callback);
+extern void vfs_enumerate_batch(const char* path, vfs_batch_f* callback,
+	void* context);
+
+extern struct lock vfs_lock; /* for anything using a filesystem directly */
+
+/* Wildcard expansion: see vfs_glob(). */
+
+struct vfs_match
+{
+	struct vfs_match* next;
+	const char* name; /* last component of path */
+	int isdir; /* -1 if not known */
+	uint32_t length;
+	char path[1];
+};
+
+extern int vfs_is_glob(const char* path);
+
+/* Tree walking (see walk.c). Any of the callbacks may be NULL. */
+
+struct walker
+{
+	void (*enter)(struct walker* w, const char* path);
+	void (*entry)(struct walker* w, const char* path,
+		const struct vfs_dirent* de);
+	void (*leave)(struct walker* w, const char* path, uint32_t kb);
+	void* context;
+	uint32_t dirs;
+	uint32_t files;
+};
+
+extern uint32_t walk_tree(struct walker* w, const char* path);
+extern struct vfs_match* vfs_glob(int argc, const char* argv[], int dirs);
 
 extern const struct vfs vfs_host;
 extern const struct vfs vfs_mem;
 extern const struct vfs vfs_sd;
+extern const struct vfs vfs_ram;
+extern const struct vfs vfs_lz4;
+extern const struct vfs vfs_gz;
+extern const struct vfs vfs_blk;
 
+extern void vfs_sd_init(void);
 extern void vfs_sd_deinit(void);
+extern void vfs_sd_flush(void);
+extern uint8_t* vfs_mem_address(struct file* fp, uint32_t* length);
+extern void set_fat_error(int r);
+extern char* fat_path(const char* path);
+extern int ramdisk_present(void);
 
 /* MMC interface */
 
 extern void mmc_init(void);
 extern void mmc_deinit(void);
+extern uint32_t mmc_raw_sectors(void);
+extern int mmc_raw_read(uint32_t sector, void* buffer, uint32_t count);
+extern int mmc_raw_write(uint32_t sector, const void* buffer, uint32_t count);
+
+#if defined MMC_SIM
+extern uint32_t mmc_sim_read(uint32_t reg);
+extern void mmc_sim_write(uint32_t reg, uint32_t value);
+#endif
 
 /* Utilities */
 
 extern void millisleep(uint32_t ms);
+extern uint32_t read_timer(void);
+extern int timer_expired(uint32_t start, uint32_t timeout);
+extern int poll_console(uint32_t ms);
+extern void wait_for_console(void);
+extern void fill_memory(void* dest, uint32_t pattern, uint32_t len);
+extern uint32_t compare_memory(const void* a, const void* b, uint32_t len);
+extern void move_memory(void* dest, const void* src, uint32_t len);
+extern uint16_t update_crc16(uint16_t crc, const void* data, uint32_t len);
+extern uint32_t update_crc32(uint32_t crc, const void* data, uint32_t len);
+extern int match_glob(const char* pattern, const char* name);
+extern int find_fat_partition(const uint8_t* mbr, uint32_t* offset);
 
 #endif
@@ -0,0 +1,194 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+
+/* ELF32 definitions (just the bits we use). Fields are decoded by hand so
+ * we don't care about the compiler's idea of structure layout. */
+
+#define EI_NIDENT 16
+#define EHDR_SIZE 52
+#define PHDR_SIZE 32
+#define PT_LOAD 1
+
+static uint32_t get16(const uint8_t* p)
+{
+	return p[0] | (p[1]<<8);
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static int is_elf(const uint8_t* ehdr, uint32_t len)
+{
+	return (len >= EHDR_SIZE)
+		&& (ehdr[0] == 0x7f) && (ehdr[1] == 'E')
+		&& (ehdr[2] == 'L') && (ehdr[3] == 'F');
+}
+
+/* Streams each PT_LOAD segment straight from the file to its physical
+ * address and zeroes the rest of the segment. Returns the entry point, or
+ * 0 on error. */
+
+static uint32_t load_elf(struct file* fp, const uint8_t* ehdr, uint32_t len)
+{
+	uint32_t phoff, phentsize, phnum;
+	uint8_t phdr[PHDR_SIZE];
+	int i;
+
+	if ((ehdr[4] != 1) || (ehdr[5] != 1))
+	{
+		setError("only 32-bit little-endian ELF files are supported");
+		return 0;
+	}
+
+	phoff = get32(ehdr+28);
+	phentsize = get16(ehdr+42);
+	phnum = get16(ehdr+44);
+	if (phentsize < PHDR_SIZE)
+	{
+		setError("malformed ELF program header table");
+		return 0;
+	}
+
+	for (i=0; i<phnum; i++)
+	{
+		uint32_t offset, paddr, filesz, memsz;
+		uint8_t* dest;
+
+		if (vfs_read(fp, phoff + i*phentsize, phdr, PHDR_SIZE) != PHDR_SIZE)
+		{
+			setError("truncated ELF program header table");
+			return 0;
+		}
+
+		if (get32(phdr+0) != PT_LOAD)
+			continue;
+
+		offset = get32(phdr+4);
+		paddr = get32(phdr+12);
+		filesz = get32(phdr+16);
+		memsz = get32(phdr+20);
+		if ((filesz > memsz) || (offset > len) || (filesz > (len - offset)))
+		{
+			setError("malformed ELF segment %d", i);
+			return 0;
+		}
+
+		printf("segment %d: %08x+%x (%x in file)\n", i, paddr, memsz, filesz);
+		fflush(stdout);
+
+		dest = pi_phys_to_user((void*)(uintptr_t) paddr);
+		if (vfs_read(fp, offset, dest, filesz) != filesz)
+		{
+			if (!error)
+				setError("short read on ELF segment %d", i);
+			return 0;
+		}
+		fill_memory(dest + filesz, 0, memsz - filesz);
+	}
+
+	return get32(ehdr+24);
+}
+
+static uint32_t load_raw(struct file* fp, uint32_t addr, uint32_t len)
+{
+	printf("raw: %08x+%x\n", addr, len);
+	fflush(stdout);
+
+	if (vfs_read(fp, 0, pi_phys_to_user((void*)(uintptr_t) addr), len) != len)
+	{
+		if (!error)
+			setError("short read");
+		return 0;
+	}
+	return addr;
+}
+
+static void load_cb(int argc, const char* argv[])
+{
+	struct file* fp;
+	uint8_t ehdr[EHDR_SIZE];
+	uint32_t len, r;
+	uint32_t entry;
+	uint32_t addr = 0;
+	int haveaddr = 0;
+	int run = 0;
+	int i = 1;
+
+	if ((argc > 1) && (strcmp(argv[1], "-g") == 0))
+	{
+		run = 1;
+		i++;
+	}
+
+	if ((argc - i) == 2)
+	{
+		char* p;
+		addr = strtoul(argv[i+1], &p, 16);
+		if (*p)
+		{
+			setError("unable to parse address (don't put 0x on the front)");
+			return;
+		}
+		haveaddr = 1;
+	}
+	else if ((argc - i) != 1)
+	{
+		setError("syntax: load [-g] <filename> [<address>]");
+		return;
+	}
+
+	fp = vfs_open(argv[i], O_RDONLY);
+	if (!fp)
+		return;
+
+	vfs_info(fp, NULL, &len);
+	r = vfs_read(fp, 0, ehdr, EHDR_SIZE);
+
+	if (haveaddr)
+		entry = load_raw(fp, addr, len);
+	else if (is_elf(ehdr, r))
+		entry = load_elf(fp, ehdr, len);
+	else
+	{
+		setError("not an ELF file (give an address to load a raw binary)");
+		entry = 0;
+	}
+	vfs_close(fp);
+
+	if (error)
+		return;
+
+	printf("entry point: %08x\n", entry);
+	if (run)
+	{
+		typedef void func_t(void);
+		func_t* cb = (func_t*) pi_phys_to_user((void*)(uintptr_t) entry);
+
+		fflush(stdout);
+		cb();
+	}
+}
+
+const struct command load_cmd =
+{
+	"load",
+	"loads a program into memory",
+
+	"Syntax:\n"
+	"  load [-g] <filename> [<address>]\n"
+	"Loads an ELF executable, placing each segment directly at its\n"
+	"physical address and zeroing its .bss. If <address> is given (in hex,\n"
+	"without a leading 0x), the file is loaded as a raw binary there\n"
+	"instead. With -g, jumps to the entry point (or the load address)\n"
+	"afterwards.",
+
+	load_cb
+};
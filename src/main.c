@@ -7,30 +7,52 @@
 
 #include "globals.h"
 
-int main(int argc, const char* argv[])
+/* If this script exists, it's run at startup unless a key is pressed
+ * within AUTOBOOT_DELAY ms. */
+
+#define AUTOBOOT_SCRIPT "sd:/piface.rc"
+#define AUTOBOOT_DELAY 500
+
+static void autoboot(void)
 {
-	#if defined TARGET_PI && !defined(__GNUC__)
-		pi_init_uart();
-	#endif
+	struct file* fp = vfs_open(AUTOBOOT_SCRIPT, O_RDONLY);
+	if (!fp)
+	{
+		/* No script (or no card); nothing to do. */
+		clearError();
+		return;
+	}
+	vfs_close(fp);
 
-	init_console();
-	newlines_on();
-	newlines_off();
-	newlines_on();
+	printf("Press any key within %dms to skip %s.\n",
+		AUTOBOOT_DELAY, AUTOBOOT_SCRIPT);
+	if (poll_console(AUTOBOOT_DELAY))
+	{
+		getchar();
+		printf("Autoboot skipped.\n");
+		return;
+	}
 
-	environ = NULL;
-	printf("\n\nPiFace v%s (c) 2013 David Given\n", VERSION);
+	execute_script(AUTOBOOT_SCRIPT);
+	if (error)
+		printf("Error: %s\n", error);
+	clearError();
+}
+
+/* The command loop. This runs as the scheduler's console job, so that
+ * background jobs get a turn while it waits for input. */
 
+static void console(void)
+{
 	for (;;)
 	{
 		char* buffer;
 
-		#if defined TARGET_PI
+		sched_report();
+		if (!sched_busy())
 			vfs_sd_deinit();
-		#endif
 
-		printf("> ");
-		buffer = readline();
+		buffer = readline("> ");
 
 		execute_command(buffer);
 
@@ -38,7 +60,25 @@ int main(int argc, const char* argv[])
 			printf("Error: %s\n", error);
 		clearError();
 	}
+}
+
+int main(int argc, const char* argv[])
+{
+	mem_init();
+
+	#if defined TARGET_PI && !defined(__GNUC__)
+		pi_init_uart();
+	#endif
 
+	init_console();
+	newlines_on();
+	newlines_off();
+	newlines_on();
+
+	environ = NULL;
+	printf("\n\nPiFace v%s (c) 2013 David Given\n", VERSION);
+	autoboot();
+
+	sched_run(console);
 	return 0;
 }
-
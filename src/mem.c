@@ -0,0 +1,339 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+#include "ff.h"
+
+/* Memory management for the things which get allocated over and over.
+ *
+ * Objects with a fixed size (file handles, FatFs file and directory
+ * objects, sector buffers) come from pools of static storage, so opening
+ * and closing files doesn't fragment the heap. If a pool runs dry it falls
+ * back to malloc(), and the mem command says so; if that fails too,
+ * pool_alloc() returns NULL (and sets the error).
+ *
+ * Transfer buffers come from the scratch arena instead, which is a stack:
+ * execute_command() notes the top before running a command and drops
+ * everything above it afterwards, so commands never free their buffers and
+ * nested commands (scripts, rpc) work. Background jobs each have an arena
+ * of their own, which the scheduler switches to (see sched.c).
+ *
+ * The arena is only a few kB, as on the Pi it's in the VPU's SRAM along
+ * with everything else. Allocations which don't fit come from the heap,
+ * like pool overflows, and are freed when the arena is released past them;
+ * commands whose buffers work at any size use scratch_alloc_upto() to take
+ * what's left instead. Offsets above the arena's size stand for the heap
+ * blocks, so marks still work once it has overflowed. */
+
+#define STACK_PAINT (8*1024) /* bytes of stack to watch */
+#define PAINT 0xa5
+
+/* A pool's storage is an array of this, so that every object is big
+ * enough and aligned enough to hold the free list link. */
+
+#define POOL(var, name, type, n) \
+	static union { type object; void* link; } var##_storage[n]; \
+	struct pool var = { name, sizeof(*var##_storage), n, \
+		(uint8_t*) var##_storage }
+
+union fatobj
+{
+	FIL fil;
+	DIR dir;
+};
+
+struct sector
+{
+	uint32_t data[128];
+};
+
+POOL(file_pool, "files", struct file, 16);
+POOL(fat_pool, "fat", union fatobj, 8);
+POOL(sector_pool, "sectors", struct sector, 4);
+
+static struct pool* pools[] =
+{
+	&file_pool,
+	&fat_pool,
+	&sector_pool
+};
+#define NUM_POOLS (sizeof(pools)/sizeof(*pools))
+
+/* A heap block holding an allocation which didn't fit in the arena. */
+
+struct overflow
+{
+	struct overflow* next;
+	uint32_t start; /* the arena's top before it was allocated */
+};
+
+static uint32_t scratch[SCRATCH_SIZE/4];
+static struct arena console_arena = { (uint8_t*) scratch, SCRATCH_SIZE };
+static struct arena* arena = &console_arena;
+
+static char* heap_base;
+static uint8_t* stack_top;
+static uintptr_t stack_bottom;
+
+void* pool_alloc(struct pool* p)
+{
+	void* o;
+
+	if (!p->inited)
+	{
+		uint32_t i;
+
+		for (i=0; i<p->count; i++)
+		{
+			o = p->storage + i*p->size;
+			*(void**)o = p->freelist;
+			p->freelist = o;
+		}
+		p->inited = 1;
+	}
+
+	o = p->freelist;
+	if (o)
+		p->freelist = *(void**)o;
+	else
+	{
+		o = malloc(p->size);
+		if (!o)
+		{
+			setError("out of memory (wanted %u bytes for a pool)",
+				(unsigned) p->size);
+			return NULL;
+		}
+		p->overflows++;
+	}
+
+	p->used++;
+	if (p->used > p->highwater)
+		p->highwater = p->used;
+	return o;
+}
+
+void pool_free(struct pool* p, void* o)
+{
+	uint8_t* b = o;
+
+	if (!o)
+		return;
+	p->used--;
+	if ((b >= p->storage) && (b < (p->storage + p->size*p->count)))
+	{
+		*(void**)o = p->freelist;
+		p->freelist = o;
+	}
+	else
+		free(o);
+}
+
+static uint32_t scratch_free(struct arena* a)
+{
+	return (a->top < a->size) ? (a->size - a->top) : 0;
+}
+
+/* Returns NULL (and sets the error) if there's no memory left at all. */
+
+void* scratch_alloc(uint32_t size)
+{
+	struct arena* a = arena;
+	struct overflow* o;
+	void* p;
+
+	size = (size + 3) & ~3;
+	if (size <= scratch_free(a))
+	{
+		p = a->base + a->top;
+		a->top += size;
+		if (a->top > a->high)
+			a->high = a->top;
+		return p;
+	}
+
+	o = malloc(sizeof(struct overflow) + size);
+	if (!o)
+	{
+		setError("out of memory (wanted %u bytes of scratch)", (unsigned) size);
+		return NULL;
+	}
+	o->start = a->top;
+	o->next = a->overflow;
+	a->overflow = o;
+	a->overflows++;
+	if (a->top < a->size)
+		a->top = a->size;
+	a->top += size;
+	return o + 1;
+}
+
+/* For buffers which work at any size: returns whatever is free in the
+ * arena, up to max and rounded down to a multiple of unit, and sets *size
+ * to how much that is. If less than unit is free, returns unit bytes (from
+ * the heap). */
+
+void* scratch_alloc_upto(uint32_t unit, uint32_t max, uint32_t* size)
+{
+	uint32_t n = scratch_free(arena);
+
+	if (n > max)
+		n = max;
+	n -= n % unit;
+	if (n == 0)
+		n = unit;
+
+	*size = n;
+	return scratch_alloc(n);
+}
+
+/* Temporary buffers, taken from the far end of the arena so that anything
+ * scratch_alloc()ed while they're held survives scratch_return(). Takes at
+ * most half of what's free (leaving the rest for those allocations), up to
+ * max and rounded down to a multiple of unit; if that's less than unit,
+ * returns unit bytes from the heap. Buffers must be returned in reverse
+ * order. */
+
+void* scratch_borrow(uint32_t unit, uint32_t max, uint32_t* size)
+{
+	struct arena* a = arena;
+	uint32_t n = scratch_free(a) / 2;
+	void* p;
+
+	if (n > max)
+		n = max;
+	n -= n % unit;
+	n &= ~3;
+	if (n < unit)
+	{
+		p = malloc(unit);
+		if (!p)
+			setError("out of memory (wanted %u bytes of scratch)",
+				(unsigned) unit);
+		*size = unit;
+		return p;
+	}
+
+	a->size -= n;
+	*size = n;
+	return a->base + a->size;
+}
+
+void scratch_return(void* p, uint32_t size)
+{
+	struct arena* a = arena;
+	uint8_t* b = p;
+
+	if ((b >= a->base) && (b <= (a->base + a->size)))
+		a->size += size;
+	else
+		free(p);
+}
+
+uint32_t scratch_mark(void)
+{
+	return arena->top;
+}
+
+void scratch_release(uint32_t mark)
+{
+	struct arena* a = arena;
+
+	while (a->overflow && (a->overflow->start >= mark))
+	{
+		struct overflow* o = a->overflow;
+		a->overflow = o->next;
+		free(o);
+	}
+	a->top = mark;
+}
+
+/* Makes a the current arena (NULL means the console's). */
+
+void scratch_switch(struct arena* a)
+{
+	arena = a ? a : &console_arena;
+}
+
+/* Fills the STACK_PAINT bytes below the caller's frame with a known
+ * value; how much of it gets overwritten shows how deep the stack has
+ * been. */
+
+static void paint_stack(void)
+{
+	volatile uint8_t area[STACK_PAINT];
+	uint32_t i;
+
+	for (i=0; i<STACK_PAINT; i++)
+		area[i] = PAINT;
+	stack_bottom = (uintptr_t) area;
+}
+
+/* Called first thing in main(). */
+
+void mem_init(void)
+{
+	uint8_t here;
+
+	stack_top = &here;
+	heap_base = sbrk(0);
+	paint_stack();
+}
+
+static uint32_t stack_used(void)
+{
+	volatile uint8_t* p = (volatile uint8_t*) stack_bottom;
+
+	while ((p < stack_top) && (*p == PAINT))
+		p++;
+	return stack_top - p;
+}
+
+static void mem_cb(int argc, const char* argv[])
+{
+	uint32_t stack;
+	int i;
+
+	if (argc != 1)
+	{
+		setError("syntax: mem");
+		return;
+	}
+
+	stack = stack_used();
+	printf("heap        %8u bytes\n", (unsigned) ((char*) sbrk(0) - heap_base));
+	printf("stack       %8u bytes%s\n", (unsigned) stack,
+		(stack >= ((uintptr_t) stack_top - stack_bottom)) ? " (or more)" : "");
+	printf("scratch     %8u bytes of %u (%u now), %u overflows\n",
+		(unsigned) console_arena.high, SCRATCH_SIZE,
+		(unsigned) console_arena.top, (unsigned) console_arena.overflows);
+
+	printf("\npool         size  count   used   high  overflows\n");
+	for (i=0; i<NUM_POOLS; i++)
+	{
+		struct pool* p = pools[i];
+		printf("%-10s %6u %6u %6u %6u %10u\n", p->name,
+			(unsigned) p->size, (unsigned) p->count, (unsigned) p->used,
+			(unsigned) p->highwater, (unsigned) p->overflows);
+	}
+}
+
+const struct command mem_cmd =
+{
+	"mem",
+	"shows memory usage",
+
+	"Syntax:\n"
+	"  mem\n"
+	"Shows the most heap, stack and scratch memory used since startup, and\n"
+	"how full the fixed-size pools (file handles, FatFs objects and sector\n"
+	"buffers) have got. Overflows are allocations which didn't fit in a\n"
+	"pool or the scratch arena and came from the heap instead. The stack is\n"
+	"only watched to a depth of 8kB.",
+
+	mem_cb
+};
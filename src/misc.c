@@ -7,6 +7,89 @@
 
 #include "globals.h"
 
+/* Parses 'quad', 'word' or 'byte'; returns the size in bytes, or 0. */
+
+static unsigned parse_size(const char* s)
+{
+	if (strcmp(s, "quad") == 0)
+		return 4;
+	else if (strcmp(s, "word") == 0)
+		return 2;
+	else if (strcmp(s, "byte") == 0)
+		return 1;
+
+	setError("use 'quad', 'word' or 'byte' for the size");
+	return 0;
+}
+
+static int parse_address(const char* s, uint32_t* addr)
+{
+	char* p;
+
+	if (strncmp(s, "mem:", 4) == 0)
+		s += 4;
+	*addr = strtoul(s, &p, 16);
+	if (*p || !*s)
+	{
+		setError("unable to parse address (don't put 0x on the front)");
+		return 0;
+	}
+	return 1;
+}
+
+/* Parses a mem:-style range, <start>+<len> (the mem: is optional). */
+
+static int parse_range(const char* s, uint8_t** start, uint32_t* len)
+{
+	uint32_t addr;
+	char* p;
+
+	if (strncmp(s, "mem:", 4) == 0)
+		s += 4;
+	addr = strtoul(s, &p, 16);
+	if ((p == s) || (*p != '+'))
+		goto malformed;
+	s = p+1;
+	*len = strtoul(s, &p, 16);
+	if ((p == s) || *p)
+		goto malformed;
+
+	*start = pi_phys_to_user((void*)(uintptr_t) addr);
+	return 1;
+
+malformed:
+	setError("malformed range (use <start>+<len>, in hex)");
+	return 0;
+}
+
+static int parse_value(const char* s, uint32_t* value)
+{
+	char* p;
+
+	*value = strtoul(s, &p, 16);
+	if (*p || !*s)
+	{
+		setError("unable to parse value '%s' (don't put 0x on the front)", s);
+		return 0;
+	}
+	return 1;
+}
+
+static uint32_t read_element(const uint8_t* p, unsigned size)
+{
+	switch (size)
+	{
+		case 4: return *(const uint32_t*)p;
+		case 2: return *(const uint16_t*)p;
+		default: return *p;
+	}
+}
+
+static uint32_t user_to_phys(const void* p)
+{
+	return (uint32_t)(uintptr_t) pi_user_to_phys((void*) p);
+}
+
 static void go_cb(int argc, const char* argv[])
 {
 	uint32_t addr;
@@ -52,7 +135,6 @@ static void poke_cb(int argc, const char* argv[])
 {
 	unsigned size;
 	uint32_t addr;
-	char* p;
 	int i;
 
 	if (argc <= 3)
@@ -61,34 +143,19 @@ static void poke_cb(int argc, const char* argv[])
 		return;
 	}
 
-	if (strcmp(argv[1], "quad") == 0)
-		size = 4;
-	else if (strcmp(argv[1], "word") == 0)
-		size = 2;
-	else if (strcmp(argv[1], "byte") == 0)
-		size = 1;
-	else
-	{
-		setError("use 'quad', 'word' or 'byte' for the size");
+	size = parse_size(argv[1]);
+	if (!size)
 		return;
-	}
 
-    addr = strtoul(argv[2], &p, 16);
-    if (*p)
-    {
-        setError("unable to parse address (don't put 0x on the front)");
-        return;
-    }
+	if (!parse_address(argv[2], &addr))
+		return;
 
 	addr = (uint32_t) pi_phys_to_user((void*) addr);
 	for (i=3; i<argc; i++)
 	{
-		uint32_t value = strtoul(argv[i], &p, 16);
-		if (*p)
-		{
-			setError("unable to parse value %d (don't put 0x on the front)", i);
+		uint32_t value;
+		if (!parse_value(argv[i], &value))
 			return;
-		}
 
 		switch (size)
 		{
@@ -124,3 +191,243 @@ const struct command poke_cmd =
 
 	poke_cb
 };
+
+static void fill_cb(int argc, const char* argv[])
+{
+	unsigned size;
+	uint8_t* start;
+	uint32_t len;
+	uint32_t value;
+
+	if (argc != 4)
+	{
+		setError("syntax: fill <size> <start>+<len> <value>");
+		return;
+	}
+
+	size = parse_size(argv[1]);
+	if (!size || !parse_range(argv[2], &start, &len)
+			|| !parse_value(argv[3], &value))
+		return;
+
+	/* Widen the value into a 32-bit pattern. */
+
+	switch (size)
+	{
+		case 1:
+			value &= 0xff;
+			value |= value << 8;
+			/* fall through */
+		case 2:
+			value &= 0xffff;
+			value |= value << 16;
+			break;
+	}
+
+	fill_memory(start, value, len);
+}
+
+const struct command fill_cmd =
+{
+	"fill",
+	"fills a range of memory with a value",
+
+	"Syntax:\n"
+	"  fill <size> <start>+<len> <value>\n"
+	"<size> is either 'quad', 'word' or 'byte'. Fills <len> bytes of memory\n"
+	"starting at <start> with copies of <value>. All numbers are in hex.",
+
+	fill_cb
+};
+
+#define MAX_REPORTED 16
+
+static void cmp_cb(int argc, const char* argv[])
+{
+	unsigned size;
+	uint8_t* a;
+	uint8_t* b;
+	uint32_t addr;
+	uint32_t len;
+	uint32_t pos;
+	uint32_t differences;
+
+	if (argc != 4)
+	{
+		setError("syntax: cmp <size> <start>+<len> <start>");
+		return;
+	}
+
+	size = parse_size(argv[1]);
+	if (!size || !parse_range(argv[2], &a, &len)
+			|| !parse_address(argv[3], &addr))
+		return;
+	b = pi_phys_to_user((void*)(uintptr_t) addr);
+	len &= ~(size-1);
+
+	differences = 0;
+	pos = 0;
+	for (;;)
+	{
+		pos += compare_memory(a+pos, b+pos, len-pos);
+		if (pos == len)
+			break;
+
+		pos &= ~(size-1);
+		if (differences < MAX_REPORTED)
+			printf("%08x: %0*x != %08x: %0*x\n",
+				user_to_phys(a+pos), size*2, read_element(a+pos, size),
+				user_to_phys(b+pos), size*2, read_element(b+pos, size));
+		differences++;
+		pos += size;
+	}
+
+	if (differences > MAX_REPORTED)
+		printf("...\n");
+	if (differences)
+		printf("%d differences\n", differences);
+	else
+		printf("ranges are identical\n");
+}
+
+const struct command cmp_cmd =
+{
+	"cmp",
+	"compares two ranges of memory",
+
+	"Syntax:\n"
+	"  cmp <size> <start>+<len> <start>\n"
+	"<size> is either 'quad', 'word' or 'byte'. Compares <len> bytes at the\n"
+	"first address with the same number at the second, and reports the\n"
+	"values which differ. All numbers are in hex.",
+
+	cmp_cb
+};
+
+static void move_cb(int argc, const char* argv[])
+{
+	uint8_t* src;
+	uint32_t len;
+	uint32_t addr;
+
+	if (argc != 3)
+	{
+		setError("syntax: move <start>+<len> <dest>");
+		return;
+	}
+
+	if (!parse_range(argv[1], &src, &len) || !parse_address(argv[2], &addr))
+		return;
+
+	move_memory(pi_phys_to_user((void*)(uintptr_t) addr), src, len);
+}
+
+const struct command move_cmd =
+{
+	"move",
+	"copies a range of memory",
+
+	"Syntax:\n"
+	"  move <start>+<len> <dest>\n"
+	"Copies <len> bytes from <start> to <dest>. The ranges may overlap.\n"
+	"All numbers are in hex.",
+
+	move_cb
+};
+
+/* Boyer-Moore-Horspool search. Returns the offset of the first match at or
+ * after start, or -1. */
+
+static uint32_t skip[256];
+
+static int32_t search(const uint8_t* haystack, uint32_t len, uint32_t start,
+	const uint8_t* needle, uint32_t nlen)
+{
+	uint32_t i = start;
+
+	while ((len - i) >= nlen)
+	{
+		uint8_t last = haystack[i + nlen - 1];
+		if ((last == needle[nlen-1]) && (memcmp(haystack+i, needle, nlen-1) == 0))
+			return i;
+		i += skip[last];
+	}
+	return -1;
+}
+
+static void find_cb(int argc, const char* argv[])
+{
+	unsigned size;
+	uint8_t* start;
+	uint32_t len;
+	uint8_t* needle;
+	uint32_t nlen;
+	uint32_t matches;
+	int32_t pos;
+	int i;
+
+	if (argc < 4)
+	{
+		setError("syntax: find <size> <start>+<len> <values...>");
+		return;
+	}
+
+	size = parse_size(argv[1]);
+	if (!size || !parse_range(argv[2], &start, &len))
+		return;
+
+	/* Build the byte pattern (little-endian, as it is in memory). */
+
+	nlen = (argc - 3) * size;
+	needle = scratch_alloc(nlen);
+	if (!needle)
+		return;
+	for (i=3; i<argc; i++)
+	{
+		uint32_t value;
+		unsigned j;
+
+		if (!parse_value(argv[i], &value))
+			return;
+		for (j=0; j<size; j++)
+			needle[(i-3)*size + j] = value >> (j*8);
+	}
+
+	for (i=0; i<256; i++)
+		skip[i] = nlen;
+	for (i=0; i<(nlen-1); i++)
+		skip[needle[i]] = nlen - 1 - i;
+
+	/* Matches only count if they're aligned to the element size. */
+
+	matches = 0;
+	pos = 0;
+	for (;;)
+	{
+		pos = search(start, len, pos, needle, nlen);
+		if (pos == -1)
+			break;
+
+		if (!(pos & (size-1)))
+		{
+			printf("%08x\n", user_to_phys(start+pos));
+			matches++;
+		}
+		pos++;
+	}
+	printf("%d matches\n", matches);
+}
+
+const struct command find_cmd =
+{
+	"find",
+	"searches memory for a sequence of values",
+
+	"Syntax:\n"
+	"  find <size> <start>+<len> <values...>\n"
+	"<size> is either 'quad', 'word' or 'byte'. Lists every address in the\n"
+	"range where the given values appear consecutively (aligned to <size>).\n"
+	"All numbers are in hex.",
+
+	find_cb
+};
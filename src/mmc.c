@@ -7,8 +7,9 @@
 
 #include "globals.h"
 #include "diskio.h"
+#include <stddef.h>
 
-#if defined TARGET_PI
+#if defined TARGET_PI || defined MMC_SIM
 
 /* See the SD card spec at:
  *
@@ -80,57 +81,146 @@ enum
     MMC_FIFO_STATUS = 1<<0
 };
 
+/* All controller accesses go through these, so that the testbed can
+ * build this driver against the register model in mmc_sim.c. */
+
+#if defined MMC_SIM
+	#define mmc_get(r) mmc_sim_read(offsetof(struct mmc_interface, r))
+	#define mmc_set(r, v) mmc_sim_write(offsetof(struct mmc_interface, r), v)
+#else
+	#define mmc_get(r) (altmmc->r)
+	#define mmc_set(r, v) (altmmc->r = (v))
+#endif
+
+/* How long to wait for the controller before giving up, and how many times
+ * to retry a failed transfer. */
+
+#define MMC_TIMEOUT 100000 /* us */
+#define MMC_INIT_TIMEOUT 1000000 /* us, for the card to power up */
+#define MMC_RETRIES 10
+
 static struct mmc_interface* altmmc;
 static struct gpio_interface* gpio;
 
+static int card_ready;
 static int sdhc;
 static int highcap;
 static uint32_t partition_offset;
 
-static void read_block(uint32_t sector, uint32_t* buffer);
-static void write_block(uint32_t sector, uint32_t* buffer);
+static uint32_t card_sectors;
+
+static int read_blocks(uint32_t sector, uint32_t* buffer, uint32_t count);
+static int write_blocks(uint32_t sector, const uint32_t* buffer, uint32_t count);
 
-static void wait_for_mmc(void)
+static int wait_for_mmc(void)
 {
-	while (altmmc->cmd & MMC_ENABLE)
-		;
+	uint32_t start = read_timer();
+
+	while (mmc_get(cmd) & MMC_ENABLE)
+	{
+		if (timer_expired(start, MMC_TIMEOUT))
+			return 0;
+		yield();
+	}
+	return 1;
+}
+
+static int wait_for_fifo(void)
+{
+	uint32_t start = read_timer();
+
+	while (!(mmc_get(status) & MMC_FIFO_STATUS))
+	{
+		if (timer_expired(start, MMC_TIMEOUT))
+			return 0;
+	}
+	return 1;
 }
 
 static uint32_t mmc_rpc(uint32_t cmd, uint32_t arg)
 {
 	uint8_t e;
 
+	count_stat(STAT_MMC_COMMANDS, 1);
+	trace(TRACE_MMC_COMMAND, cmd, arg);
 	wait_for_mmc();
 
-	e = altmmc->status;
+	e = mmc_get(status);
 	if (e)
-		altmmc->status &= e;
+		mmc_set(status, mmc_get(status) & e);
+
+	mmc_set(arg, arg);
+	mmc_set(cmd, MMC_ENABLE | cmd);
+
+	return mmc_get(status);
+}
+
+/* Extracts bits hi..lo of the 128-bit long response; rsp0 holds the
+ * least significant word. */
+
+static uint32_t response_bits(int hi, int lo)
+{
+	uint32_t r[4];
+	uint32_t v = 0;
+	int i;
+
+	r[0] = mmc_get(rsp0);
+	r[1] = mmc_get(rsp1);
+	r[2] = mmc_get(rsp2);
+	r[3] = mmc_get(rsp3);
 
-	altmmc->arg = arg;
-	altmmc->cmd = MMC_ENABLE | cmd;
+	for (i=hi; i>=lo; i--)
+		v = (v << 1) | ((r[i/32] >> (i%32)) & 1);
+	return v;
+}
+
+/* Works out the size of the card, in sectors, from the CSD. Returns 0 if
+ * the CSD doesn't make sense. */
 
-	return altmmc->status;
+static uint32_t read_card_size(void)
+{
+	switch (response_bits(127, 126)) /* CSD_STRUCTURE */
+	{
+		case 0: /* standard capacity */
+		{
+			uint32_t c_size = response_bits(73, 62);
+			uint32_t c_size_mult = response_bits(49, 47);
+			uint32_t read_bl_len = response_bits(83, 80);
+
+			if ((read_bl_len < 9) || (read_bl_len > 11))
+				return 0;
+			return (c_size+1) << (c_size_mult + 2 + read_bl_len - 9);
+		}
+
+		case 1: /* high capacity */
+			return (response_bits(69, 48) + 1) * 1024;
+	}
+	return 0;
 }
 
 void mmc_init(void)
 {
 	uint32_t i;
+	uint32_t start;
 
 	altmmc = pi_phys_to_user((void*) 0x7e202000);
 	gpio = pi_phys_to_user((void*) 0x7e200000);
 
-	gpio->fsel4 = 0x24000000;
-	gpio->fsel5 = 0x924;
-    gpio->pud = 2;
+	#if !defined MMC_SIM
+		gpio->fsel4 = 0x24000000;
+		gpio->fsel5 = 0x924;
+		gpio->pud = 2;
+	#endif
 
-	altmmc->clkdiv = 0x96;
-	altmmc->host_cfg = 0xa;
-    altmmc->vdd = 0x1;
+	mmc_set(clkdiv, 0x96);
+	mmc_set(host_cfg, 0xa);
+    mmc_set(vdd, 0x1);
 
 	printf("[mounting SD card: ");
 	fflush(stdout);
 
-	altmmc->cmd = 0;
+	card_ready = 0;
+	mmc_set(cmd, 0);
 	mmc_rpc(0, 0); /* GO_IDLE_STATE */
 
 	sdhc = 0;
@@ -138,7 +228,7 @@ void mmc_init(void)
 	/* Test for SDHC cards. */
 	i = mmc_rpc(8, 0x155); /* SEND_IF_COND */
 	wait_for_mmc();
-	if (!i && ((altmmc->rsp0 & 0xff) == 0x55))
+	if (!i && ((mmc_get(rsp0) & 0xff) == 0x55))
 	{
 		printf("SDHCv2: ");
 		fflush(stdout);
@@ -153,18 +243,25 @@ void mmc_init(void)
 
 	/* Enable high capacity mode (if available). */
 
+	start = read_timer();
 	for (;;)
 	{
 		mmc_rpc(55, 0); /* APP_CMD */
 		i = mmc_rpc(41, (sdhc==2) ? 0x40100000 : 0x00100000); /* SD_SEND_OP_CMD */
 		wait_for_mmc();
 
-		if ((i == 0) && (altmmc->rsp0 & (1<<31)))
+		if ((i == 0) && (mmc_get(rsp0) & (1<<31)))
 			break;
+		if (timer_expired(start, MMC_INIT_TIMEOUT))
+		{
+			printf("card not responding]\n");
+			fflush(stdout);
+			return;
+		}
 		millisleep(100);
 	}
 
-	highcap = !!(altmmc->rsp0 & (1<<30));
+	highcap = !!(mmc_get(rsp0) & (1<<30));
 	if (highcap)
 		printf("high capacity: ");
 	fflush(stdout);
@@ -179,7 +276,12 @@ void mmc_init(void)
 
         mmc_rpc(3, 0); /* SEND_RELATIVE_RCA */
         wait_for_mmc();
-        rca = altmmc->rsp0 & 0xffff0000;
+        rca = mmc_get(rsp0) & 0xffff0000;
+
+		mmc_rpc(MMC_LONG_RSP | 9, rca); /* SEND_CSD */
+		wait_for_mmc();
+		card_sectors = read_card_size();
+		printf("%u MB: ", (unsigned) (card_sectors / 2048));
 
 		mmc_rpc(7, rca); /* SELECT_CARD */
 		wait_for_mmc();
@@ -189,209 +291,213 @@ void mmc_init(void)
 
     mmc_rpc(16, 512); /* SET_BLOCKLEN */
 
-	altmmc->clkdiv = 0;
+	mmc_set(clkdiv, 0);
 
 	{
 		int partition;
 
-		uint8_t* buffer = malloc(512);
+		uint8_t* buffer = pool_alloc(&sector_pool);
 		partition_offset = 0;
-		read_block(0, (uint32_t*) buffer);
-
-		if ((buffer[510] == 0x55) && (buffer[511] == 0xaa))
+		card_ready = 1;
+		if (!buffer || !read_blocks(0, (uint32_t*) buffer, 1))
 		{
-			partition = -1;
-			for (i=0; i<4; i++)
-			{
-				uint8_t* p = &buffer[0x1be + i*16];
-				switch (p[4])
-				{
-	                case 0x01: /* FAT12 */
-	                case 0x04: /* FAT16, <32MB */
-	                case 0x06: /* FAT16, >32MB */
-	                case 0x0b: /* FAT32 */
-	                case 0x0c: /* FAT32X */
-	                case 0x0e: /* FAT16X */
-	                    partition = i;
-	                    partition_offset = p[8] | (p[9]<<8) | (p[10]<<16) | (p[11]<<24);
-				}
-
-				if (partition != -1)
-					break;
-			}
+			printf("cannot read MBR]\n");
+			fflush(stdout);
+			card_ready = 0;
+			pool_free(&sector_pool, buffer);
+			return;
+		}
 
+		partition = find_fat_partition(buffer, &partition_offset);
+		if (partition != -2)
 			printf("partition %d @ 0x%08x]\n", partition, partition_offset);
-		}
 		else
 			printf("whole partition mode]\n");
 
 		fflush(stdout);
 
-		free(buffer);
+		pool_free(&sector_pool, buffer);
 	}
 }
 
- static void read_block(uint32_t sector, uint32_t* buffer)
- {
- 	int i;
- 	int count;
- 	int crcfailed;
-
- 	sector += partition_offset;
- 	#if 0
- 		printf("read sector %d\n", sector);
- 		fflush(stdout);
- 	#endif
-
- 	if (!highcap)
- 		sector <<= 9;
-
- 	for (;;)
- 	{
- 		crcfailed = 0;
-
- 	    i = mmc_rpc(MMC_READ | MMC_BUSY | 18, sector); /* READ_MULTIPLE_BLOCK */
- 	    wait_for_mmc();
-
- 	    for (i=0; i<128; i++)
- 	    {
- 			while (!(altmmc->status & MMC_FIFO_STATUS))
- 				;
-
- 			if (altmmc->status != MMC_FIFO_STATUS)
- 			{
- 				crcfailed = 1;
- 				#if 0
- 					printf("[block retry]\n");
- 					fflush(stdout);
- 				#endif
- 				break;
- 			}
-
- 			buffer[i] = altmmc->data;
- 			#if 0
- 				if (i > 120)
- 					printf("%d %08x %08x\n", i, buffer[i], altmmc->status);
- 			#endif
- 	    }
-
- 		mmc_rpc(12, 0); /* STOP_TRANSMISSION */
-
- 	    if (!crcfailed)
- 	    {
-			millisleep(10);
- 	        break;
- 	    }
- 	}
- }
-
-static void write_block(uint32_t sector, uint32_t* buffer)
+/* Transfers count blocks, starting at the card's sector (not the
+ * partition's), with a single multiple-block command. If a block fails,
+ * the transfer is restarted from that block. */
+
+static int read_blocks(uint32_t sector, uint32_t* buffer, uint32_t count)
 {
 	int i;
-	int count;
+	int retries = 0;
 	int crcfailed;
+	uint32_t done;
 
-	sector += partition_offset;
-	#if 0
-		printf("write sector %d\n", sector);
-		fflush(stdout);
-	#endif
+	while (count)
+	{
+		crcfailed = 0;
+		done = 0;
 
-	if (!highcap)
-		sector <<= 9;
+	    mmc_rpc(MMC_READ | MMC_BUSY | 18, highcap ? sector : (sector << 9)); /* READ_MULTIPLE_BLOCK */
+	    wait_for_mmc();
 
-	for (;;)
+		while (done < count)
+		{
+		    for (i=0; i<128; i++)
+		    {
+				if (!wait_for_fifo() || (mmc_get(status) != MMC_FIFO_STATUS))
+				{
+					crcfailed = 1;
+					break;
+				}
+
+				buffer[i] = mmc_get(data);
+		    }
+			if (crcfailed)
+				break;
+			buffer += 128;
+			done++;
+		}
+
+		mmc_rpc(12, 0); /* STOP_TRANSMISSION */
+		sector += done;
+		count -= done;
+
+		if (crcfailed)
+		{
+			count_stat(STAT_MMC_RETRIES, 1);
+			trace(TRACE_MMC_RETRY, sector, retries);
+			if (done)
+				retries = 0;
+			if (++retries == MMC_RETRIES)
+				return 0;
+		}
+	}
+
+	millisleep(10);
+	return 1;
+}
+
+static int write_blocks(uint32_t sector, const uint32_t* buffer, uint32_t count)
+{
+	int i;
+	int retries = 0;
+	int crcfailed;
+	uint32_t done;
+
+	while (count)
 	{
 		crcfailed = 0;
+		done = 0;
 
-	    i = mmc_rpc(MMC_WRITE | MMC_BUSY | 25, sector); /* WRITE_MULTIPLE_BLOCK */
+	    mmc_rpc(MMC_WRITE | MMC_BUSY | 25, highcap ? sector : (sector << 9)); /* WRITE_MULTIPLE_BLOCK */
 	    wait_for_mmc();
 
-	    for (i=0; i<128; i++)
-	    {
-			altmmc->data = buffer[i];
-
-			while (!(altmmc->status & MMC_FIFO_STATUS))
-				;
+		while (done < count)
+		{
+		    for (i=0; i<128; i++)
+		    {
+				mmc_set(data, buffer[i]);
 
-			if (altmmc->status != MMC_FIFO_STATUS)
-			{
-				crcfailed = 1;
-				#if 0
-					printf("[block retry]\n");
-					fflush(stdout);
-				#endif
+				if (!wait_for_fifo() || (mmc_get(status) != MMC_FIFO_STATUS))
+				{
+					crcfailed = 1;
+					break;
+				}
+		    }
+			if (crcfailed)
 				break;
-			}
-	    }
+			buffer += 128;
+			done++;
+		}
 
 		mmc_rpc(12, 0); /* STOP_TRANSMISSION */
+		sector += done;
+		count -= done;
 
-	    if (!crcfailed)
-	    {
-			millisleep(10);
-	        break;
-	    }
+		if (crcfailed)
+		{
+			count_stat(STAT_MMC_RETRIES, 1);
+			trace(TRACE_MMC_RETRY, sector, retries);
+			if (done)
+				retries = 0;
+			if (++retries == MMC_RETRIES)
+				return 0;
+		}
 	}
-	fflush(stdout);
+
+	millisleep(10);
+	return 1;
 }
 
 void mmc_deinit(void)
 {
 }
 
-/* FatFS's interface. */
+/* Raw access to the whole card, for the blk: filesystem. Sectors are
+ * counted from the start of the card. */
+
+uint32_t mmc_raw_sectors(void)
+{
+	return card_ready ? card_sectors : 0;
+}
 
-DSTATUS disk_initialize (
+int mmc_raw_read(uint32_t sector, void* buffer, uint32_t count)
+{
+	if (!card_ready)
+		return 0;
+	return read_blocks(sector, buffer, count);
+}
+
+int mmc_raw_write(uint32_t sector, const void* buffer, uint32_t count)
+{
+	if (!card_ready)
+		return 0;
+	return write_blocks(sector, buffer, count);
+}
+
+/* FatFS's interface, via diskio.c. */
+
+DSTATUS mmc_disk_initialize (
 	BYTE pdrv				/* Physical drive nmuber (0..) */
 )
 {
-	return 0;
+	return card_ready ? 0 : STA_NOINIT;
 }
 
-DSTATUS disk_status (
+DSTATUS mmc_disk_status (
 	BYTE pdrv		/* Physical drive nmuber (0..) */
 )
 {
-	return 0;
+	return card_ready ? 0 : STA_NOINIT;
 }
 
-DRESULT disk_read (
+DRESULT mmc_disk_read (
 	BYTE pdrv,		/* Physical drive nmuber (0..) */
 	BYTE *buff,		/* Data buffer to store read data */
 	DWORD sector,	/* Sector address (LBA) */
 	BYTE count		/* Number of sectors to read (1..128) */
 )
 {
-	while (count--)
-	{
-		read_block(sector, (uint32_t*) buff);
-		sector++;
-		buff += 512;
-	}
+	if (!read_blocks(sector + partition_offset, (uint32_t*) buff, count))
+		return RES_ERROR;
 	return 0;
 }
 
 #if _USE_WRITE
-DRESULT disk_write (
+DRESULT mmc_disk_write (
 	BYTE pdrv,			/* Physical drive nmuber (0..) */
 	const BYTE *buff,	/* Data to be written */
 	DWORD sector,		/* Sector address (LBA) */
 	BYTE count			/* Number of sectors to write (1..128) */
 )
 {
-	while (count--)
-	{
-		write_block(sector, (uint32_t*) buff);
-		sector++;
-		buff += 512;
-	}
+	if (!write_blocks(sector + partition_offset, (const uint32_t*) buff, count))
+		return RES_ERROR;
 	return 0;
 }
 #endif
 
 #if _USE_IOCTL
-DRESULT disk_ioctl (
+DRESULT mmc_disk_ioctl (
 	BYTE pdrv,		/* Physical drive nmuber (0..) */
 	BYTE cmd,		/* Control code */
 	void *buff		/* Buffer to send/receive control data */
@@ -407,7 +513,7 @@ DRESULT disk_ioctl (
 			return 0;
 
 		case GET_SECTOR_COUNT:
-			*(WORD*)buff = 0;
+			*(DWORD*)buff = card_sectors ? (card_sectors - partition_offset) : 0;
 			return 0;
 
 		case GET_BLOCK_SIZE:
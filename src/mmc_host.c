@@ -0,0 +1,224 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+#include "diskio.h"
+
+#if defined TARGET_TESTBED && !defined MMC_SIM
+
+#include <time.h>
+
+/* Testbed replacement for mmc.c: the 'SD card' is a disk image file on the
+ * host, so the FatFs and sd: code paths can be run and profiled on Linux.
+ * It's configured with piface environment variables:
+ *
+ *   SDIMAGE    path of the image (default sd.img)
+ *   SDLATENCY  extra delay per sector, in us, to mimic a real card
+ *
+ * The image may be a bare filesystem or have an MBR, exactly as on a
+ * card. */
+
+#define DEFAULT_IMAGE "sd.img"
+
+static int fd = -1;
+static uint32_t partition_offset;
+static uint32_t latency;
+static uint32_t sectors;
+static uint32_t card_sectors;
+
+/* Spins on the timer rather than sleeping, as a real card would, so that
+ * timings stay accurate for short delays; background jobs get the time
+ * through yield(). */
+
+static void delay(uint32_t count)
+{
+	uint32_t start;
+
+	if (!latency)
+		return;
+
+	start = read_timer();
+	while (!timer_expired(start, latency * count))
+		yield();
+}
+
+void mmc_init(void)
+{
+	const char* image = getenv("SDIMAGE");
+	const char* s = getenv("SDLATENCY");
+	uint8_t buffer[512];
+	int partition;
+	off_t size;
+
+	mmc_deinit();
+	if (!image)
+		image = DEFAULT_IMAGE;
+	latency = s ? strtoul(s, NULL, 10) : 0;
+
+	printf("[mounting SD image %s: ", image);
+	fflush(stdout);
+
+	fd = open(image, O_RDWR);
+	if (fd == -1)
+	{
+		printf("%s]\n", strerror(errno));
+		fflush(stdout);
+		return;
+	}
+
+	size = lseek(fd, 0, SEEK_END);
+	partition_offset = 0;
+	if (pread(fd, buffer, 512, 0) != 512)
+	{
+		printf("cannot read MBR]\n");
+		fflush(stdout);
+		close(fd);
+		fd = -1;
+		return;
+	}
+
+	printf("%u MB: ", (unsigned) (size / (1024*1024)));
+	partition = find_fat_partition(buffer, &partition_offset);
+	if (partition != -2)
+		printf("partition %d @ 0x%08x", partition, partition_offset);
+	else
+		printf("whole partition mode");
+	if (latency)
+		printf(", %u us/sector", (unsigned) latency);
+	printf("]\n");
+	fflush(stdout);
+
+	card_sectors = size / 512;
+	sectors = card_sectors - partition_offset;
+}
+
+void mmc_deinit(void)
+{
+	if (fd != -1)
+	{
+		close(fd);
+		fd = -1;
+	}
+}
+
+/* Raw access to the whole image, for the blk: filesystem. */
+
+uint32_t mmc_raw_sectors(void)
+{
+	return (fd != -1) ? card_sectors : 0;
+}
+
+int mmc_raw_read(uint32_t sector, void* buffer, uint32_t count)
+{
+	if (fd == -1)
+		return 0;
+	delay(count);
+	return pread(fd, buffer, count*512, (off_t)sector * 512) == (count*512);
+}
+
+int mmc_raw_write(uint32_t sector, const void* buffer, uint32_t count)
+{
+	if (fd == -1)
+		return 0;
+	delay(count);
+	return pwrite(fd, buffer, count*512, (off_t)sector * 512) == (count*512);
+}
+
+/* FatFS's interface, via diskio.c. */
+
+DSTATUS mmc_disk_initialize (
+	BYTE pdrv				/* Physical drive nmuber (0..) */
+)
+{
+	return (fd != -1) ? 0 : STA_NOINIT;
+}
+
+DSTATUS mmc_disk_status (
+	BYTE pdrv		/* Physical drive nmuber (0..) */
+)
+{
+	return (fd != -1) ? 0 : STA_NOINIT;
+}
+
+DRESULT mmc_disk_read (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE *buff,		/* Data buffer to store read data */
+	DWORD sector,	/* Sector address (LBA) */
+	BYTE count		/* Number of sectors to read (1..128) */
+)
+{
+	off_t offset = (off_t)(sector + partition_offset) * 512;
+
+	delay(count);
+	if (pread(fd, buff, count*512, offset) != (count*512))
+		return RES_ERROR;
+	return 0;
+}
+
+#if _USE_WRITE
+DRESULT mmc_disk_write (
+	BYTE pdrv,			/* Physical drive nmuber (0..) */
+	const BYTE *buff,	/* Data to be written */
+	DWORD sector,		/* Sector address (LBA) */
+	BYTE count			/* Number of sectors to write (1..128) */
+)
+{
+	off_t offset = (off_t)(sector + partition_offset) * 512;
+
+	delay(count);
+	if (pwrite(fd, buff, count*512, offset) != (count*512))
+		return RES_ERROR;
+	return 0;
+}
+#endif
+
+#if _USE_IOCTL
+DRESULT mmc_disk_ioctl (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE cmd,		/* Control code */
+	void *buff		/* Buffer to send/receive control data */
+)
+{
+	switch (cmd)
+	{
+		case CTRL_SYNC:
+			return 0;
+
+		case GET_SECTOR_SIZE:
+			*(WORD*)buff = 512;
+			return 0;
+
+		case GET_SECTOR_COUNT:
+			*(DWORD*)buff = sectors;
+			return 0;
+
+		case GET_BLOCK_SIZE:
+			*(DWORD*)buff = 1;
+			return 0;
+
+        case CTRL_ERASE_SECTOR:
+        	return 0;
+    }
+
+	return RES_PARERR;
+}
+#endif
+
+DWORD get_fattime(void)
+{
+	time_t t = time(NULL);
+	struct tm* tm = localtime(&t);
+
+	return ((DWORD)(tm->tm_year - 80) << 25)
+		| ((DWORD)(tm->tm_mon + 1) << 21)
+		| ((DWORD)tm->tm_mday << 16)
+		| ((DWORD)tm->tm_hour << 11)
+		| ((DWORD)tm->tm_min << 5)
+		| ((DWORD)tm->tm_sec >> 1);
+}
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+
+#if defined MMC_SIM
+
+/* A software model of the SD host controller at 0x7e202000 and an SDHC
+ * card behind it, so that mmc.c can be run unmodified on the testbed (see
+ * the piface-sim build). mmc.c's register accesses come here through
+ * mmc_sim_read() and mmc_sim_write().
+ *
+ * The card is backed by an image file of a whole card, MBR and all. It's
+ * configured with piface environment variables, which are reread every
+ * time the card is reset by GO_IDLE_STATE:
+ *
+ *   SDIMAGE    path of the image (default sd.img)
+ *   SDLATENCY  time for the card to read or program a block, in us
+ *   SDERRORS   if set to N, roughly one block in N fails its CRC
+ *
+ * Commands complete after SIM_COMMAND_TIME us, and data only appears in
+ * (or drains from) the FIFO after the block latency, so the driver's
+ * polling loops and timeouts are exercised as they are on hardware. */
+
+#define DEFAULT_IMAGE "sd.img"
+#define SIM_COMMAND_TIME 5 /* us */
+#define SIM_OCR_POLLS 2 /* ACMD41s before the card reports ready */
+#define SIM_RCA 0x1234
+
+/* Register offsets; these match struct mmc_interface in mmc.c. */
+
+enum
+{
+	REG_CMD = 0x00,
+	REG_ARG = 0x04,
+	REG_RSP0 = 0x10,
+	REG_RSP1 = 0x14,
+	REG_RSP2 = 0x18,
+	REG_RSP3 = 0x1c,
+	REG_STATUS = 0x20,
+	REG_DATA = 0x40,
+	NUM_REGS = 0x54/4
+};
+
+enum
+{
+	/* cmd register */
+
+	CMD_ENABLE = 1<<15,
+	CMD_FAIL = 1<<14,
+
+	/* status register */
+
+	STATUS_DATA = 1<<0,
+	STATUS_FIFO_ERROR = 1<<3,
+	STATUS_CRC16_ERROR = 1<<5,
+	STATUS_CMD_TIMEOUT = 1<<6
+};
+
+/* Card states, as in the SD spec. */
+
+enum
+{
+	CARD_IDLE,
+	CARD_READY,
+	CARD_IDENT,
+	CARD_STBY,
+	CARD_TRAN,
+	CARD_DATA,
+	CARD_RCV
+};
+
+static uint32_t regs[NUM_REGS];
+static uint32_t busy_until;
+
+static int fd = -1;
+static uint32_t latency;
+static uint32_t error_rate;
+static uint32_t seed;
+static uint32_t blocks;
+
+static int state;
+static int appcmd;
+static int ocr_polls;
+
+static uint32_t fifo[128];
+static int fifo_pos;
+static uint32_t block; /* card block being transferred */
+static uint32_t data_ready; /* time at which the FIFO is ready */
+static int block_bad; /* current block will fail its CRC */
+
+static int inject_error(void)
+{
+	if (!error_rate)
+		return 0;
+
+	seed = seed*1103515245 + 12345;
+	return ((seed >> 8) % error_rate) == 0;
+}
+
+/* Loads the next block for a read; past the end of the card, the card
+ * reports an error instead. */
+
+static void fetch_block(void)
+{
+	fifo_pos = 0;
+	data_ready = read_timer() + latency;
+	block_bad = inject_error();
+	if ((block >= blocks) ||
+	    (pread(fd, fifo, 512, (off_t)block * 512) != 512))
+		block_bad = 1;
+}
+
+static void program_block(void)
+{
+	data_ready = read_timer() + latency;
+	if (!inject_error() && (block < blocks))
+		pwrite(fd, fifo, 512, (off_t)block * 512);
+	else
+		regs[REG_STATUS/4] |= STATUS_CRC16_ERROR;
+	block++;
+	fifo_pos = 0;
+}
+
+static void power_on(void)
+{
+	const char* image = getenv("SDIMAGE");
+	const char* s;
+
+	if (fd != -1)
+		close(fd);
+	fd = open(image ? image : DEFAULT_IMAGE, O_RDWR);
+	blocks = 0;
+	if (fd != -1)
+		blocks = lseek(fd, 0, SEEK_END) / 512;
+
+	s = getenv("SDLATENCY");
+	latency = s ? strtoul(s, NULL, 10) : 0;
+	s = getenv("SDERRORS");
+	error_rate = s ? strtoul(s, NULL, 10) : 0;
+	seed = 1;
+
+	ocr_polls = 0;
+}
+
+/* Runs a command; returns 0 if the card doesn't respond. */
+
+static int execute(int index, uint32_t arg)
+{
+	uint32_t* rsp = &regs[REG_RSP0/4];
+	int app = appcmd;
+
+	appcmd = 0;
+	if (index == 0) /* GO_IDLE_STATE */
+	{
+		power_on();
+		state = CARD_IDLE;
+		return 1;
+	}
+	if (fd == -1)
+		return 0;
+
+	if (app)
+	{
+		switch (index)
+		{
+			case 41: /* SD_SEND_OP_COND */
+				if ((state != CARD_IDLE) && (state != CARD_READY))
+					return 0;
+				rsp[0] = 0x00ff8000;
+				if (++ocr_polls >= SIM_OCR_POLLS)
+				{
+					rsp[0] |= 1<<31;
+					if (arg & (1<<30))
+						rsp[0] |= 1<<30; /* high capacity */
+					state = CARD_READY;
+				}
+				return 1;
+		}
+		return 0;
+	}
+
+	switch (index)
+	{
+		case 2: /* ALL_SEND_CID */
+			if (state != CARD_READY)
+				return 0;
+			rsp[0] = 0x50494641; /* 'PIFA' */
+			rsp[1] = 0x43453031;
+			rsp[2] = 0x00000001;
+			rsp[3] = 0x00000000;
+			state = CARD_IDENT;
+			return 1;
+
+		case 3: /* SEND_RELATIVE_ADDR */
+			if ((state != CARD_IDENT) && (state != CARD_STBY))
+				return 0;
+			rsp[0] = SIM_RCA << 16;
+			state = CARD_STBY;
+			return 1;
+
+		case 7: /* SELECT_CARD */
+			if ((arg >> 16) == SIM_RCA)
+			{
+				if (state != CARD_STBY)
+					return 0;
+				state = CARD_TRAN;
+			}
+			else if (state == CARD_TRAN)
+				state = CARD_STBY;
+			return 1;
+
+		case 8: /* SEND_IF_COND */
+			if (state != CARD_IDLE)
+				return 0;
+			rsp[0] = arg & 0xfff;
+			return 1;
+
+		case 9: /* SEND_CSD */
+			if ((state != CARD_STBY) || ((arg >> 16) != SIM_RCA))
+				return 0;
+			/* Version 2.0 CSD; C_SIZE is bits 69..48. */
+			rsp[3] = 0x400e0032;
+			rsp[2] = 0x5b590000 | (((blocks/1024 - 1) >> 16) & 0x3f);
+			rsp[1] = ((blocks/1024 - 1) << 16) | 0x7f80;
+			rsp[0] = 0x0a400001;
+			return 1;
+
+		case 12: /* STOP_TRANSMISSION */
+			if ((state == CARD_DATA) || (state == CARD_RCV))
+				state = CARD_TRAN;
+			return 1;
+
+		case 16: /* SET_BLOCKLEN */
+			return (state == CARD_TRAN) && (arg == 512);
+
+		case 18: /* READ_MULTIPLE_BLOCK */
+			if (state != CARD_TRAN)
+				return 0;
+			state = CARD_DATA;
+			block = arg;
+			fetch_block();
+			return 1;
+
+		case 25: /* WRITE_MULTIPLE_BLOCK */
+			if (state != CARD_TRAN)
+				return 0;
+			state = CARD_RCV;
+			block = arg;
+			fifo_pos = 0;
+			data_ready = read_timer();
+			return 1;
+
+		case 55: /* APP_CMD */
+			appcmd = 1;
+			rsp[0] = state << 9;
+			return 1;
+	}
+	return 0;
+}
+
+/* The data flag means 'a word can be read' when receiving, and 'the card
+ * is ready for more' when sending. A bad block sets the CRC error flag at
+ * the point its data would have arrived. */
+
+static uint32_t read_status(void)
+{
+	uint32_t status = regs[REG_STATUS/4] & ~STATUS_DATA;
+
+	if (((state == CARD_DATA) || (state == CARD_RCV))
+	    && ((int32_t)(read_timer() - data_ready) >= 0))
+	{
+		if ((state == CARD_DATA) && block_bad)
+			status |= STATUS_CRC16_ERROR;
+		status |= STATUS_DATA;
+	}
+
+	regs[REG_STATUS/4] = status & ~STATUS_DATA;
+	return status;
+}
+
+uint32_t mmc_sim_read(uint32_t reg)
+{
+	switch (reg)
+	{
+		case REG_CMD:
+			if (regs[REG_CMD/4] & CMD_ENABLE)
+			{
+				if ((int32_t)(read_timer() - busy_until) >= 0)
+					regs[REG_CMD/4] &= ~CMD_ENABLE;
+			}
+			return regs[REG_CMD/4];
+
+		case REG_STATUS:
+			return read_status();
+
+		case REG_DATA:
+		{
+			uint32_t value;
+
+			if ((state != CARD_DATA) || !(read_status() & STATUS_DATA))
+			{
+				regs[REG_STATUS/4] |= STATUS_FIFO_ERROR;
+				return 0;
+			}
+
+			value = fifo[fifo_pos++];
+			if (fifo_pos == 128)
+			{
+				block++;
+				fetch_block();
+			}
+			return value;
+		}
+	}
+
+	return regs[reg/4];
+}
+
+void mmc_sim_write(uint32_t reg, uint32_t value)
+{
+	switch (reg)
+	{
+		case REG_CMD:
+			regs[REG_CMD/4] = value & ~CMD_FAIL;
+			if (value & CMD_ENABLE)
+			{
+				busy_until = read_timer() + SIM_COMMAND_TIME;
+				if (!execute(value & 0x3f, regs[REG_ARG/4]))
+				{
+					regs[REG_CMD/4] |= CMD_FAIL;
+					regs[REG_STATUS/4] |= STATUS_CMD_TIMEOUT;
+				}
+			}
+			return;
+
+		case REG_STATUS:
+			/* Write one to clear. */
+			regs[REG_STATUS/4] &= ~value;
+			return;
+
+		case REG_DATA:
+			if (state != CARD_RCV)
+			{
+				regs[REG_STATUS/4] |= STATUS_FIFO_ERROR;
+				return;
+			}
+
+			fifo[fifo_pos++] = value;
+			if (fifo_pos == 128)
+				program_block();
+			return;
+	}
+
+	regs[reg/4] = value;
+}
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "pack.h"
+
+/* LZ4 block rules: a match needs at least MIN_MATCH bytes, the last
+ * LAST_LITERALS bytes are always literals, and no match may start in the
+ * last MF_LIMIT bytes. */
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define HASH_BITS 12
+
+static uint16_t hashtable[1 << HASH_BITS];
+
+static uint32_t hash(const uint8_t* p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t* put_length(uint8_t* op, uint32_t len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* Writes one sequence; returns NULL if it won't fit before limit. */
+
+static uint8_t* put_sequence(uint8_t* op, uint8_t* limit,
+	const uint8_t* literals, uint32_t litlen, uint32_t matchlen, uint32_t dist)
+{
+	uint8_t* token = op;
+
+	if ((op + 1 + litlen/255 + 1 + litlen + 2 + matchlen/255 + 1) > limit)
+		return NULL;
+
+	op++;
+	*token = ((litlen < 15) ? litlen : 15) << 4;
+	if (litlen >= 15)
+		op = put_length(op, litlen - 15);
+	memcpy(op, literals, litlen);
+	op += litlen;
+
+	if (matchlen)
+	{
+		matchlen -= MIN_MATCH;
+		*op++ = dist;
+		*op++ = dist >> 8;
+		*token |= (matchlen < 15) ? matchlen : 15;
+		if (matchlen >= 15)
+			op = put_length(op, matchlen - 15);
+	}
+	return op;
+}
+
+uint32_t pack_chunk(const uint8_t* src, uint32_t len, uint8_t* dest)
+{
+	uint8_t* op = dest + 2;
+	uint8_t* limit = dest + 2 + len - 1; /* must beat storing it */
+	uint32_t anchor = 0;
+	uint32_t i = 0;
+	uint32_t size;
+
+	if (len > MF_LIMIT)
+	{
+		memset(hashtable, 0xff, sizeof(hashtable));
+		while ((i + MF_LIMIT) <= len)
+		{
+			uint32_t h = hash(src + i);
+			uint32_t candidate = hashtable[h];
+			uint32_t matchlen;
+
+			hashtable[h] = i;
+			if ((candidate == 0xffff) ||
+			    (memcmp(src + candidate, src + i, MIN_MATCH) != 0))
+			{
+				i++;
+				continue;
+			}
+
+			matchlen = MIN_MATCH;
+			while (((i + matchlen) < (len - LAST_LITERALS)) &&
+			       (src[candidate + matchlen] == src[i + matchlen]))
+				matchlen++;
+
+			op = put_sequence(op, limit, src + anchor, i - anchor,
+				matchlen, i - candidate);
+			if (!op)
+				goto store;
+			i += matchlen;
+			anchor = i;
+		}
+	}
+
+	op = put_sequence(op, limit, src + anchor, len - anchor, 0, 0);
+	if (!op)
+		goto store;
+
+	size = op - (dest + 2);
+	dest[0] = size;
+	dest[1] = size >> 8;
+	return 2 + size;
+
+store:
+	/* Incompressible; pass it through. */
+	dest[0] = len;
+	dest[1] = (len >> 8) | (PACK_STORED >> 8);
+	memcpy(dest + 2, src, len);
+	return 2 + len;
+}
+
+/* Decodes one LZ4 block; returns the decoded length, or -1 if the block
+ * is malformed or won't fit. */
+
+static int32_t unpack_block(const uint8_t* ip, uint32_t len,
+	uint8_t* dest, uint32_t destlen)
+{
+	const uint8_t* iend = ip + len;
+	uint8_t* op = dest;
+	uint8_t* oend = dest + destlen;
+
+	while (ip < iend)
+	{
+		uint32_t token = *ip++;
+		uint32_t litlen = token >> 4;
+		uint32_t matchlen;
+		uint32_t dist;
+		const uint8_t* match;
+
+		if (litlen == 15)
+		{
+			uint32_t b;
+			do
+			{
+				if (ip == iend)
+					return -1;
+				b = *ip++;
+				litlen += b;
+			}
+			while (b == 255);
+		}
+
+		if ((litlen > (uint32_t)(iend - ip)) || (litlen > (uint32_t)(oend - op)))
+			return -1;
+		memcpy(op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+		if (ip == iend)
+			break; /* the last sequence has no match */
+
+		if ((iend - ip) < 2)
+			return -1;
+		dist = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((dist == 0) || (dist > (uint32_t)(op - dest)))
+			return -1;
+
+		matchlen = token & 15;
+		if (matchlen == 15)
+		{
+			uint32_t b;
+			do
+			{
+				if (ip == iend)
+					return -1;
+				b = *ip++;
+				matchlen += b;
+			}
+			while (b == 255);
+		}
+		matchlen += MIN_MATCH;
+
+		if (matchlen > (uint32_t)(oend - op))
+			return -1;
+		match = op - dist;
+		while (matchlen--)
+			*op++ = *match++;
+	}
+
+	return op - dest;
+}
+
+enum
+{
+	STATE_MAGIC,
+	STATE_HEADER,
+	STATE_CHUNK,
+	STATE_TRAILER,
+	STATE_DONE
+};
+
+void unpack_init(struct unpacker* u)
+{
+	u->state = STATE_MAGIC;
+	u->want = PACK_MAGIC_SIZE;
+	u->have = 0;
+	u->total = 0;
+}
+
+/* Collects u->want bytes into u->buffer, then acts on them. */
+
+int unpack_feed(struct unpacker* u, const uint8_t* data, uint32_t len,
+	pack_emit_f* emit, void* context)
+{
+	while (len && (u->state != STATE_DONE))
+	{
+		uint32_t n = u->want - u->have;
+		uint8_t* b = u->buffer;
+
+		if (n > len)
+			n = len;
+		memcpy(b + u->have, data, n);
+		u->have += n;
+		data += n;
+		len -= n;
+		if (u->have < u->want)
+			break;
+		u->have = 0;
+
+		switch (u->state)
+		{
+			case STATE_MAGIC:
+				if (memcmp(b, PACK_MAGIC, PACK_MAGIC_SIZE) != 0)
+					return PACK_CORRUPT;
+				u->state = STATE_HEADER;
+				u->want = 2;
+				break;
+
+			case STATE_HEADER:
+				u->header = b[0] | (b[1] << 8);
+				u->want = u->header & ~PACK_STORED;
+				if (u->header == 0)
+				{
+					u->state = STATE_TRAILER;
+					u->want = 4;
+				}
+				else if (u->want > PACK_CHUNK_SIZE)
+					return PACK_CORRUPT;
+				else
+					u->state = STATE_CHUNK;
+				break;
+
+			case STATE_CHUNK:
+				if (u->header & PACK_STORED)
+				{
+					emit(context, b, u->want);
+					u->total += u->want;
+				}
+				else
+				{
+					int32_t r = unpack_block(b, u->want, u->output,
+						PACK_CHUNK_SIZE);
+					if (r < 0)
+						return PACK_CORRUPT;
+					emit(context, u->output, r);
+					u->total += r;
+				}
+				u->state = STATE_HEADER;
+				u->want = 2;
+				break;
+
+			case STATE_TRAILER:
+				if ((b[0] | (b[1] << 8) | (b[2] << 16) |
+				     ((uint32_t) b[3] << 24)) != u->total)
+					return PACK_CORRUPT;
+				u->state = STATE_DONE;
+				break;
+		}
+	}
+
+	return (u->state == STATE_DONE) ? PACK_DONE : PACK_MORE;
+}
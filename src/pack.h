@@ -0,0 +1,73 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+/* Packed stream format, used to compress XMODEM transfers. This file and
+ * pack.c are shared between piface itself and the host-side tools, so
+ * they must not depend on anything else.
+ *
+ * A packed stream looks like this:
+ *
+ *   'P' 'F' 'Z' '1' <chunk>... 00 00 <length:32>
+ *
+ * Each chunk holds up to PACK_CHUNK_SIZE bytes of the original data and
+ * starts with a 16-bit header. If bit 15 is set, the rest of the header is
+ * the length of the data, which follows as is; otherwise it's the length
+ * of an LZ4 block (see lz4_Block_format.md in the LZ4 distribution) which
+ * decodes to the data. Chunks are independent of each other. A zero header
+ * ends the stream, followed by the total length of the original data as a
+ * check. Anything after that (such as XMODEM padding) is ignored.
+ *
+ * All multibyte values are little-endian.
+ */
+
+#define PACK_MAGIC "PFZ1"
+#define PACK_MAGIC_SIZE 4
+#define PACK_CHUNK_SIZE 4096
+#define PACK_STORED 0x8000
+
+/* The most a chunk can take up, header included. */
+#define PACK_MAX_CHUNK (2 + PACK_CHUNK_SIZE)
+
+/* Packs len bytes (at most PACK_CHUNK_SIZE) as one chunk into dest, which
+ * must have room for PACK_MAX_CHUNK bytes. Returns the size of the chunk.
+ * Not reentrant. */
+
+extern uint32_t pack_chunk(const uint8_t* src, uint32_t len, uint8_t* dest);
+
+/* Incremental unpacker. Feed it the stream in whatever pieces it arrives
+ * in; the original data is passed to the emit callback. unpack_feed()
+ * returns PACK_MORE while it wants more input, PACK_DONE once the end of
+ * the stream has been seen and checked, or PACK_CORRUPT. */
+
+enum
+{
+	PACK_MORE = 0,
+	PACK_DONE = 1,
+	PACK_CORRUPT = -1
+};
+
+typedef void pack_emit_f(void* context, const uint8_t* data, uint32_t len);
+
+struct unpacker
+{
+	int state;
+	uint32_t want;
+	uint32_t have;
+	uint32_t header;
+	uint32_t total;
+	uint8_t buffer[PACK_CHUNK_SIZE];
+	uint8_t output[PACK_CHUNK_SIZE];
+};
+
+extern void unpack_init(struct unpacker* u);
+extern int unpack_feed(struct unpacker* u, const uint8_t* data, uint32_t len,
+	pack_emit_f* emit, void* context);
+
+#endif
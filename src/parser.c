@@ -12,6 +12,8 @@ static char* argv[MAX_WORDS];
 
 static void help_cb(int argc, const char* argv[]);
 static void set_cb(int argc, const char* argv[]);
+static void source_cb(int argc, const char* argv[]);
+static void time_cb(int argc, const char* argv[]);
 
 static const struct command help_cmd =
 {
@@ -43,17 +45,63 @@ static const struct command set_cmd =
 	set_cb
 };
 
+static const struct command source_cmd =
+{
+	"source",
+	"runs the commands in a file",
+
+	"Syntax:\n"
+	"  source <filename>\n"
+	"Executes each line of the file as a command. Blank lines and lines\n"
+	"starting with # are ignored. The script stops at the first command\n"
+	"which fails.",
+
+	source_cb
+};
+
+static const struct command time_cmd =
+{
+	"time",
+	"measures how long a command takes",
+
+	"Syntax:\n"
+	"  time <command...>\n"
+	"Runs the command and then reports the elapsed wall-clock time.",
+
+	time_cb
+};
+
 static const struct command* commands[] =
 {
 	&help_cmd,
 	&set_cmd,
+	&source_cmd,
+	&time_cmd,
 	&send_cmd,
 	&recv_cmd,
 	&dump_cmd,
 	&go_cmd,
+	&load_cmd,
 	&poke_cmd,
+	&fill_cmd,
+	&cmp_cmd,
+	&move_cmd,
+	&find_cmd,
 	&cp_cmd,
 	&ls_cmd,
+	&crc_cmd,
+	&du_cmd,
+	&findfile_cmd,
+	&ramdisk_cmd,
+	&bench_cmd,
+	&stats_cmd,
+	&trace_cmd,
+	&rpc_cmd,
+	&mem_cmd,
+	&jobs_cmd,
+	&wait_cmd,
+	&frag_cmd,
+	&defrag_cmd,
 };
 #define NUM_COMMANDS sizeof(commands)/sizeof(*commands)
 
@@ -208,7 +256,159 @@ static void set_cb(int argc, const char* argv[])
 	}
 }
 
-void execute_command(char* buffer)
+static void time_cb(int argc, const char* argv[])
+{
+	const struct command* cmd;
+	uint32_t start, us;
+
+	if (argc < 2)
+	{
+		setError("syntax: time <command...>");
+		return;
+	}
+
+	cmd = find_command(argv[1]);
+	if (!cmd)
+	{
+		setError("Command '%s' not recognised (try 'help').", argv[1]);
+		return;
+	}
+
+	start = read_timer();
+	cmd->callback(argc-1, argv+1);
+	us = read_timer() - start;
+
+	printf("time: %u.%03u ms\n", (unsigned) (us / 1000), (unsigned) (us % 1000));
+}
+
+/* Scripts may source other scripts, but not forever. */
+
+#define MAX_SCRIPT_DEPTH 8
+static int script_depth = 0;
+
+void execute_script(const char* filename)
+{
+	struct file* fp;
+	char* path;
+	char* text;
+	char* line;
+	uint32_t len;
+	int lineno;
+
+	if (script_depth == MAX_SCRIPT_DEPTH)
+	{
+		setError("scripts nested too deeply");
+		return;
+	}
+
+	/* Read the whole script in first; the file name may live in argv[],
+	 * which running a command will overwrite. */
+
+	fp = vfs_open(filename, O_RDONLY);
+	if (!fp)
+		return;
+	path = strdup(filename);
+
+	vfs_info(fp, NULL, &len);
+	text = malloc(len+1);
+	if (!path || !text)
+	{
+		setError("not enough memory for a %u byte script", (unsigned) len);
+		vfs_close(fp);
+		goto exit;
+	}
+	len = vfs_read(fp, 0, text, len);
+	text[len] = '\0';
+	vfs_close(fp);
+	if (error)
+		goto exit;
+
+	script_depth++;
+	line = text;
+	lineno = 1;
+	while (*line)
+	{
+		char* next = strpbrk(line, "\r\n");
+		if (next)
+		{
+			if ((next[0] == '\r') && (next[1] == '\n'))
+				*next++ = '\0';
+			*next++ = '\0';
+		}
+		else
+			next = line + strlen(line);
+
+		while (isspace(*line))
+			line++;
+		if (*line && (*line != '#'))
+		{
+			execute_command(line);
+			if (error)
+			{
+				char* e = strdup(error);
+				setError("%s:%d: %s", path, lineno, e);
+				free(e);
+				break;
+			}
+		}
+
+		line = next;
+		lineno++;
+	}
+	script_depth--;
+
+exit:
+	free(text);
+	free(path);
+}
+
+static void source_cb(int argc, const char* argv[])
+{
+	if (argc != 2)
+	{
+		setError("syntax: source <filename>");
+		return;
+	}
+
+	execute_script(argv[1]);
+}
+
+/* These talk over the console themselves, or run other command lines
+ * which might, so can only be run from the console: not in the
+ * background, and not over RPC. */
+
+static const char* console_commands[] =
+{
+	"send",
+	"recv",
+	"rpc",
+	"source",
+	NULL
+};
+
+int console_command(const char* name)
+{
+	int i;
+
+	for (i=0; console_commands[i]; i++)
+		if (strcmp(name, console_commands[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/* Returns the command a command line actually runs, looking through any
+ * 'time's. */
+
+char* real_command(char* argv[])
+{
+	int w = 0;
+
+	while ((strcmp(argv[w], "time") == 0) && argv[w+1])
+		w++;
+	return argv[w];
+}
+
+static void run_command(char* buffer, int remote)
 {
 	int argc;
 
@@ -230,13 +430,42 @@ void execute_command(char* buffer)
 	if (argc == 0)
 		return;
 
-	/* Look for the command and run it if it exists. */
+	if (remote && console_command(real_command(argv)))
+	{
+		setError("'%s' can't be run over RPC", real_command(argv));
+		return;
+	}
+
+	/* Look for the command and run it if it exists. Anything it takes
+	 * from the scratch arena is released afterwards. A trailing & runs it
+	 * in the background instead. */
 
 	{
 		const struct command* cmd = find_command(argv[0]);
-		if (cmd)
+		if (cmd && (strcmp(argv[argc-1], "&") == 0))
+		{
+			argv[--argc] = NULL;
+			sched_spawn(cmd, argc, argv);
+		}
+		else if (cmd)
+		{
+			uint32_t mark = scratch_mark();
 			cmd->callback(argc, (const char**) argv);
+			scratch_release(mark);
+		}
 		else
-			setError("Command '%s' not recognised (try 'help').");
+			setError("Command '%s' not recognised (try 'help').", argv[0]);
 	}
 }
+
+void execute_command(char* buffer)
+{
+	run_command(buffer, 0);
+}
+
+/* For RPC_EXEC requests, which mustn't take over the channel. */
+
+void execute_rpc_command(char* buffer)
+{
+	run_command(buffer, 1);
+}
@@ -0,0 +1,335 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+#include "ff.h"
+#include "diskio.h"
+
+/* The RAM disk: a FatFs volume (drive 1, the ram: filesystem) whose
+ * sectors live in memory. The memory is either allocated here or is a
+ * region of SDRAM given by the user, which may already contain an image
+ * (e.g. one received with 'recv mem:...'). */
+
+#define CHUNK 4096
+
+static FATFS fatfs;
+static uint8_t* image;
+static uint32_t sectors;
+static int allocated;
+
+int ramdisk_present(void)
+{
+	return image != NULL;
+}
+
+static void ramdisk_free(void)
+{
+	if (image)
+	{
+		f_mount(DRIVE_RAM, NULL);
+		if (allocated)
+			free(image);
+		image = NULL;
+		sectors = 0;
+		allocated = 0;
+	}
+}
+
+static void ramdisk_attach(uint8_t* start, uint32_t len, int owned)
+{
+	ramdisk_free();
+	image = start;
+	sectors = len / 512;
+	allocated = owned;
+	f_mount(DRIVE_RAM, &fatfs);
+}
+
+/* FatFS's interface, via diskio.c. */
+
+DSTATUS ram_disk_initialize (
+	BYTE pdrv				/* Physical drive nmuber (0..) */
+)
+{
+	return image ? 0 : STA_NOINIT;
+}
+
+DSTATUS ram_disk_status (
+	BYTE pdrv		/* Physical drive nmuber (0..) */
+)
+{
+	return image ? 0 : STA_NOINIT;
+}
+
+DRESULT ram_disk_read (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE *buff,		/* Data buffer to store read data */
+	DWORD sector,	/* Sector address (LBA) */
+	BYTE count		/* Number of sectors to read (1..128) */
+)
+{
+	if ((sector + count) > sectors)
+		return RES_PARERR;
+	memcpy(buff, image + sector*512, count*512);
+	return 0;
+}
+
+#if _USE_WRITE
+DRESULT ram_disk_write (
+	BYTE pdrv,			/* Physical drive nmuber (0..) */
+	const BYTE *buff,	/* Data to be written */
+	DWORD sector,		/* Sector address (LBA) */
+	BYTE count			/* Number of sectors to write (1..128) */
+)
+{
+	if ((sector + count) > sectors)
+		return RES_PARERR;
+	memcpy(image + sector*512, buff, count*512);
+	return 0;
+}
+#endif
+
+#if _USE_IOCTL
+DRESULT ram_disk_ioctl (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE cmd,		/* Control code */
+	void *buff		/* Buffer to send/receive control data */
+)
+{
+	switch (cmd)
+	{
+		case CTRL_SYNC:
+			return 0;
+
+		case GET_SECTOR_SIZE:
+			*(WORD*)buff = 512;
+			return 0;
+
+		case GET_SECTOR_COUNT:
+			*(DWORD*)buff = sectors;
+			return 0;
+
+		case GET_BLOCK_SIZE:
+			*(DWORD*)buff = 1;
+			return 0;
+	}
+
+	return RES_PARERR;
+}
+#endif
+
+/* Parses either <size> or <start>+<len>, in hex. *start is set to NULL
+ * for the first form. */
+
+static int parse_region(const char* s, uint8_t** start, uint32_t* len)
+{
+	uint32_t value;
+	char* p;
+
+	if (strncmp(s, "mem:", 4) == 0)
+		s += 4;
+	value = strtoul(s, &p, 16);
+	if (p == s)
+		goto malformed;
+
+	*start = NULL;
+	*len = value;
+	if (*p == '+')
+	{
+		*start = pi_phys_to_user((void*)(uintptr_t) value);
+		s = p+1;
+		*len = strtoul(s, &p, 16);
+		if (p == s)
+			goto malformed;
+	}
+	if (*p)
+		goto malformed;
+	return 1;
+
+malformed:
+	setError("malformed size or range (use <size> or <start>+<len>, in hex)");
+	return 0;
+}
+
+static void show_status(void)
+{
+	FATFS* fs;
+	DWORD clusters;
+	FRESULT r;
+
+	if (!image)
+	{
+		printf("No RAM disk.\n");
+		return;
+	}
+
+	printf("RAM disk at %p, %u bytes", pi_user_to_phys(image),
+		(unsigned) sectors*512);
+	r = f_getfree("1:", &clusters, &fs);
+	if (r == FR_OK)
+		printf(", %u bytes free\n", (unsigned) (clusters * fs->csize * 512));
+	else
+	{
+		printf("\n");
+		set_fat_error(r);
+	}
+}
+
+static void format(const char* s)
+{
+	uint8_t* start;
+	uint32_t len;
+	int owned = 0;
+	FRESULT r;
+
+	if (!parse_region(s, &start, &len))
+		return;
+	if (!start)
+	{
+		start = malloc(len);
+		if (!start)
+		{
+			setError("not enough memory for a %u byte RAM disk", (unsigned) len);
+			return;
+		}
+		owned = 1;
+	}
+
+	ramdisk_attach(start, len, owned);
+	r = f_mkfs(DRIVE_RAM, 1, 0);
+	if (r != FR_OK)
+	{
+		set_fat_error(r);
+		ramdisk_free();
+	}
+}
+
+static void attach(const char* s)
+{
+	uint8_t* start;
+	uint32_t len;
+
+	if (!parse_region(s, &start, &len))
+		return;
+	if (!start)
+	{
+		setError("attach needs <start>+<len>");
+		return;
+	}
+
+	ramdisk_attach(start, len, 0);
+}
+
+static void load(const char* filename)
+{
+	struct file* fp = vfs_open(filename, O_RDONLY);
+	uint8_t* buffer;
+	uint32_t len, offset;
+
+	if (!fp)
+		return;
+
+	vfs_info(fp, NULL, &len);
+	buffer = malloc(len);
+	if (!buffer)
+	{
+		setError("not enough memory for a %u byte RAM disk", (unsigned) len);
+		goto exit;
+	}
+
+	for (offset=0; offset<len; )
+	{
+		uint32_t r = len - offset;
+		if (r > CHUNK)
+			r = CHUNK;
+		r = vfs_read(fp, offset, buffer+offset, r);
+		if (r == 0)
+		{
+			if (!error)
+				setError("short read at offset %x", offset);
+			free(buffer);
+			goto exit;
+		}
+		offset += r;
+	}
+
+	ramdisk_attach(buffer, len, 1);
+exit:
+	vfs_close(fp);
+}
+
+static void save(const char* filename)
+{
+	struct file* fp;
+	uint32_t len = sectors * 512;
+	uint32_t offset;
+
+	if (!image)
+	{
+		setError("there is no RAM disk");
+		return;
+	}
+
+	fp = vfs_open(filename, O_WRONLY);
+	if (!fp)
+		return;
+
+	for (offset=0; offset<len; )
+	{
+		uint32_t w = len - offset;
+		if (w > CHUNK)
+			w = CHUNK;
+		w = vfs_write(fp, offset, image+offset, w);
+		if (w == 0)
+		{
+			if (!error)
+				setError("short write at offset %x", offset);
+			break;
+		}
+		offset += w;
+	}
+	vfs_close(fp);
+}
+
+static void ramdisk_cb(int argc, const char* argv[])
+{
+	if (argc == 1)
+		show_status();
+	else if ((argc == 3) && (strcmp(argv[1], "format") == 0))
+		format(argv[2]);
+	else if ((argc == 3) && (strcmp(argv[1], "attach") == 0))
+		attach(argv[2]);
+	else if ((argc == 3) && (strcmp(argv[1], "load") == 0))
+		load(argv[2]);
+	else if ((argc == 3) && (strcmp(argv[1], "save") == 0))
+		save(argv[2]);
+	else if ((argc == 2) && (strcmp(argv[1], "free") == 0))
+		ramdisk_free();
+	else
+		setError("syntax: ramdisk [format|attach|load|save|free] ...");
+}
+
+const struct command ramdisk_cmd =
+{
+	"ramdisk",
+	"manages the ram: RAM disk",
+
+	"Syntax:\n"
+	"  ramdisk\n"
+	"  ramdisk format <size> | <start>+<len>\n"
+	"  ramdisk attach <start>+<len>\n"
+	"  ramdisk load <filename>\n"
+	"  ramdisk save <filename>\n"
+	"  ramdisk free\n"
+	"The ram: filesystem is a FAT volume held in memory, and is much faster\n"
+	"than the SD card. 'format' creates an empty one, either in newly\n"
+	"allocated memory or in the given region. 'attach' uses an image which\n"
+	"is already in memory, for example one received with 'recv mem:...'.\n"
+	"'load' copies an image from a file; 'save' writes the RAM disk out to\n"
+	"one. All numbers are in hex. On its own, shows the current RAM disk.",
+
+	ramdisk_cb
+};
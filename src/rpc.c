@@ -0,0 +1,740 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+#include "rpc.h"
+
+/* Binary RPC channel for driving piface from scripts. See rpc.h for the
+ * wire format.
+ *
+ * RPC mode can be entered by accident (by a stray a5 at the prompt), so
+ * it goes back to the console on a ^C between packets, at the end of the
+ * input, or if no request turns up for IDLE_TIMEOUT. */
+
+#define BYTE_TIMEOUT 1000000 /* us; the rest of a packet must follow promptly */
+#define IDLE_TIMEOUT 30000000 /* us */
+#define ESCAPE 3 /* ^C */
+
+/* receive_packet() results, besides a payload length. */
+
+enum
+{
+	PACKET_CORRUPT = -1,
+	PACKET_NONE = -2 /* leave RPC mode */
+};
+
+static uint8_t* rxbuf;
+static uint8_t* txbuf;
+static uint32_t txlen;
+static int txstatus;
+static struct file* handles[RPC_MAX_HANDLES];
+
+/* Enumeration state, as vfs_enumerate callbacks have no context pointer. */
+
+static int enum_index;
+static int enum_first;
+static int enum_more;
+
+static uint32_t get32(const uint8_t* p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static void put32(uint8_t* p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static uint16_t get16(const uint8_t* p)
+{
+	return p[0] | (p[1]<<8);
+}
+
+static void put16(uint8_t* p, uint16_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+/* Reads the rest of a packet; returns 1 on success, 0 if the line goes
+ * quiet first, or -1 at the end of the input. */
+
+static int read_bytes(uint8_t* buffer, int len)
+{
+	uint32_t start = read_timer();
+
+	while (len > 0)
+	{
+		int i;
+
+		if (!poll_console(10))
+		{
+			if (timer_expired(start, BYTE_TIMEOUT))
+				return 0;
+			continue;
+		}
+
+		i = read(0, buffer, len);
+		if (i <= 0)
+			return -1;
+		buffer += i;
+		len -= i;
+		start = read_timer();
+	}
+	return 1;
+}
+
+/* Reply construction. The first byte of txbuf is always the status. */
+
+static void reply_begin(void)
+{
+	txstatus = RPC_OK;
+	txlen = 1;
+}
+
+static int reply_room(void)
+{
+	return RPC_MAX_PAYLOAD - txlen;
+}
+
+static void reply_data(const void* data, uint32_t len)
+{
+	memcpy(txbuf+txlen, data, len);
+	txlen += len;
+}
+
+static void reply_error(const char* msg)
+{
+	int len = strlen(msg);
+	if (len > (RPC_MAX_PAYLOAD-1))
+		len = RPC_MAX_PAYLOAD-1;
+
+	txstatus = RPC_FAILED;
+	txlen = 1;
+	reply_data(msg, len);
+}
+
+static void send_packet(uint8_t seq, uint8_t op)
+{
+	uint8_t header[RPC_HEADER_SIZE];
+	uint8_t trailer[RPC_TRAILER_SIZE];
+	uint16_t crc;
+
+	txbuf[0] = txstatus;
+
+	header[0] = RPC_SYNC0;
+	header[1] = RPC_SYNC1;
+	put16(header+2, txlen);
+	header[4] = seq;
+	header[5] = op;
+
+	crc = update_crc16(0, header+2, RPC_HEADER_SIZE-2);
+	crc = update_crc16(crc, txbuf, txlen);
+	put16(trailer, crc);
+
+	fwrite(header, 1, RPC_HEADER_SIZE, stdout);
+	fwrite(txbuf, 1, txlen, stdout);
+	fwrite(trailer, 1, RPC_TRAILER_SIZE, stdout);
+	fflush(stdout);
+	count_stat(STAT_RPC_PACKETS_OUT, 1);
+}
+
+static void send_hello(uint8_t seq)
+{
+	reply_begin();
+	txbuf[txlen++] = RPC_VERSION;
+	put16(txbuf+txlen, RPC_MAX_PAYLOAD);
+	txlen += 2;
+	send_packet(seq, RPC_HELLO | RPC_REPLY);
+}
+
+/* Waits for and reads a packet; returns the payload length,
+ * PACKET_CORRUPT, or PACKET_NONE if it's time to leave RPC mode. */
+
+static int receive_packet(uint8_t* seq, uint8_t* op)
+{
+	uint8_t header[RPC_HEADER_SIZE];
+	uint8_t trailer[RPC_TRAILER_SIZE];
+	uint32_t start = read_timer();
+	uint16_t len;
+	uint16_t crc;
+	int r;
+
+	/* Hunt for the sync bytes. */
+
+	header[1] = 0;
+	for (;;)
+	{
+		header[0] = header[1];
+		if (!poll_console(10))
+		{
+			if (timer_expired(start, IDLE_TIMEOUT))
+			{
+				setError("no RPC requests for %d s; back to the console",
+					IDLE_TIMEOUT / 1000000);
+				return PACKET_NONE;
+			}
+			continue;
+		}
+
+		if (read(0, &header[1], 1) != 1)
+			return PACKET_NONE;
+		if ((header[0] == RPC_SYNC0) && (header[1] == RPC_SYNC1))
+			break;
+		if (header[1] == ESCAPE)
+			return PACKET_NONE;
+	}
+
+	r = read_bytes(header+2, RPC_HEADER_SIZE-2);
+	if (r <= 0)
+		goto truncated;
+	len = header[2] | (header[3]<<8);
+	*seq = header[4];
+	*op = header[5];
+	if (len > RPC_MAX_PAYLOAD)
+		goto corrupt;
+
+	r = read_bytes(rxbuf, len);
+	if (r > 0)
+		r = read_bytes(trailer, RPC_TRAILER_SIZE);
+	if (r <= 0)
+		goto truncated;
+
+	crc = update_crc16(0, header+2, RPC_HEADER_SIZE-2);
+	crc = update_crc16(crc, rxbuf, len);
+	if (crc != (trailer[0] | (trailer[1]<<8)))
+		goto corrupt;
+
+	count_stat(STAT_RPC_PACKETS_IN, 1);
+	return len;
+
+truncated:
+	if (r < 0)
+		return PACKET_NONE;
+corrupt:
+	count_stat(STAT_RPC_CRC_ERRORS, 1);
+	return PACKET_CORRUPT;
+}
+
+static void do_memread(const uint8_t* p, int len)
+{
+	while (len >= 8)
+	{
+		uint32_t addr = get32(p);
+		uint32_t count = get32(p+4);
+
+		if (count > reply_room())
+		{
+			reply_error("reply too big");
+			return;
+		}
+		reply_data(pi_phys_to_user((void*)(uintptr_t) addr), count);
+		p += 8;
+		len -= 8;
+	}
+}
+
+static void do_memwrite(const uint8_t* p, int len)
+{
+	while (len >= 8)
+	{
+		uint32_t addr = get32(p);
+		uint32_t count = get32(p+4);
+
+		p += 8;
+		len -= 8;
+		if (count > len)
+		{
+			reply_error("truncated write");
+			return;
+		}
+		memcpy(pi_phys_to_user((void*)(uintptr_t) addr), p, count);
+		p += count;
+		len -= count;
+	}
+}
+
+static void do_memfill(const uint8_t* p, int len)
+{
+	while (len >= 12)
+	{
+		uint8_t* addr = pi_phys_to_user((void*)(uintptr_t) get32(p));
+		uint32_t count = get32(p+4);
+		uint8_t pattern[4];
+		uint32_t i;
+
+		memcpy(pattern, p+8, 4);
+		for (i=0; i<count; i++)
+			addr[i] = pattern[i & 3];
+
+		p += 12;
+		len -= 12;
+	}
+}
+
+static struct file* get_handle(const uint8_t* p)
+{
+	if ((p[0] >= RPC_MAX_HANDLES) || !handles[p[0]])
+	{
+		reply_error("bad handle");
+		return NULL;
+	}
+	return handles[p[0]];
+}
+
+static void do_open(const uint8_t* p, int len)
+{
+	int h;
+	int flags;
+	struct file* fp;
+	uint32_t base, length;
+
+	for (h=0; h<RPC_MAX_HANDLES; h++)
+		if (!handles[h])
+			break;
+	if (h == RPC_MAX_HANDLES)
+	{
+		reply_error("too many open files");
+		return;
+	}
+
+	switch (p[0])
+	{
+		case 0: flags = O_RDONLY; break;
+		case 1: flags = O_WRONLY; break;
+		case 2: flags = O_RDWR; break;
+		default:
+			reply_error("bad open flags");
+			return;
+	}
+
+	fp = vfs_open((const char*) p+1, flags);
+	if (!fp)
+		return;
+
+	handles[h] = fp;
+	vfs_info(fp, &base, &length);
+	txbuf[txlen++] = h;
+	put32(txbuf+txlen, base);
+	put32(txbuf+txlen+4, length);
+	txlen += 8;
+}
+
+static void do_read(const uint8_t* p, int len)
+{
+	struct file* fp = get_handle(p);
+	uint32_t count;
+
+	if (!fp)
+		return;
+
+	count = get32(p+5);
+	if (count > reply_room())
+		count = reply_room();
+	txlen += vfs_read(fp, get32(p+1), txbuf+txlen, count);
+}
+
+static void do_write(const uint8_t* p, int len)
+{
+	struct file* fp = get_handle(p);
+	uint32_t w;
+
+	if (!fp)
+		return;
+
+	w = vfs_write(fp, get32(p+1), (void*) (p+5), len-5);
+	put32(txbuf+txlen, w);
+	txlen += 4;
+}
+
+static void do_close(const uint8_t* p, int len)
+{
+	struct file* fp = get_handle(p);
+
+	if (!fp)
+		return;
+
+	vfs_close(fp);
+	handles[p[0]] = NULL;
+}
+
+static void enum_cb(const char* path, int isdir, uint32_t length)
+{
+	int namelen = strlen(path) + 1;
+
+	if (enum_more)
+		return;
+
+	if (enum_index++ < enum_first)
+		return;
+
+	if (reply_room() < (namelen + 5))
+	{
+		enum_more = 1;
+		return;
+	}
+
+	txbuf[txlen] = isdir;
+	put32(txbuf+txlen+1, length);
+	memcpy(txbuf+txlen+5, path, namelen);
+	txlen += namelen + 5;
+}
+
+static void do_enum(const uint8_t* p, int len)
+{
+	enum_first = p[0] | (p[1]<<8);
+	enum_index = 0;
+	enum_more = 0;
+
+	txbuf[txlen++] = 0; /* placeholder for the 'more' flag */
+	vfs_enumerate((const char*) p+2, enum_cb);
+	txbuf[1] = enum_more;
+}
+
+/* rsync's weak checksum; the host rolls it along the new file looking for
+ * blocks we already have. */
+
+static uint32_t weak_checksum(const uint8_t* p, uint32_t len)
+{
+	uint32_t a = 0;
+	uint32_t b = 0;
+
+	while (len--)
+	{
+		a += *p++;
+		b += a;
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+static void do_signature(const uint8_t* p, int len)
+{
+	struct file* fp = get_handle(p);
+	uint32_t offset = get32(p+1);
+	uint32_t blocksize = get16(p+5);
+	uint32_t count = get16(p+7);
+	uint8_t* buffer;
+
+	if (!fp)
+		return;
+	if ((blocksize == 0) || ((count * 8) > reply_room()))
+	{
+		reply_error("bad signature request");
+		return;
+	}
+
+	buffer = scratch_alloc(blocksize);
+	if (!buffer)
+		return;
+	while (count--)
+	{
+		uint32_t r = vfs_read(fp, offset, buffer, blocksize);
+		if (r == 0)
+			break;
+
+		put32(txbuf+txlen, weak_checksum(buffer, r));
+		put32(txbuf+txlen+4, update_crc32(0, buffer, r));
+		txlen += 8;
+		offset += r;
+	}
+}
+
+#define COPY_CHUNK 4096
+
+static void do_copy(const uint8_t* p, int len)
+{
+	struct file* src = get_handle(p);
+	struct file* dest = get_handle(p+5);
+	uint32_t srcoffset = get32(p+1);
+	uint32_t destoffset = get32(p+6);
+	uint32_t count = get32(p+10);
+	uint32_t copied = 0;
+	uint8_t* buffer;
+
+	if (!src || !dest)
+		return;
+
+	/* Moving data up within a file has to be done back to front. */
+
+	buffer = scratch_alloc(COPY_CHUNK);
+	if (!buffer)
+		return;
+	if ((src == dest) && (srcoffset < destoffset))
+	{
+		while (copied < count)
+		{
+			uint32_t n = count - copied;
+			uint32_t o;
+
+			if (n > COPY_CHUNK)
+				n = COPY_CHUNK;
+			o = count - copied - n;
+
+			if ((vfs_read(src, srcoffset+o, buffer, n) != n) ||
+			    (vfs_write(dest, destoffset+o, buffer, n) != n))
+				break;
+			copied += n;
+		}
+	}
+	else
+	{
+		while (copied < count)
+		{
+			uint32_t n = count - copied;
+			if (n > COPY_CHUNK)
+				n = COPY_CHUNK;
+
+			n = vfs_read(src, srcoffset+copied, buffer, n);
+			if (n == 0)
+				break;
+			n = vfs_write(dest, destoffset+copied, buffer, n);
+			if (n == 0)
+				break;
+			copied += n;
+		}
+	}
+
+	put32(txbuf+txlen, copied);
+	txlen += 4;
+}
+
+static void do_crc32(const uint8_t* p, int len)
+{
+	struct file* fp = get_handle(p);
+	uint32_t offset = get32(p+1);
+	uint32_t count = get32(p+5);
+	uint32_t crc = get32(p+9);
+	uint8_t* buffer;
+
+	if (!fp)
+		return;
+
+	buffer = scratch_alloc(COPY_CHUNK);
+	if (!buffer)
+		return;
+	while (count)
+	{
+		uint32_t n = count;
+		if (n > COPY_CHUNK)
+			n = COPY_CHUNK;
+
+		n = vfs_read(fp, offset, buffer, n);
+		if (n == 0)
+		{
+			if (!error)
+				setError("end of file at offset %x", offset);
+			break;
+		}
+		crc = update_crc32(crc, buffer, n);
+		offset += n;
+		count -= n;
+	}
+
+	put32(txbuf+txlen, crc);
+	txlen += 4;
+}
+
+static void do_truncate(const uint8_t* p, int len)
+{
+	struct file* fp = get_handle(p);
+
+	if (fp)
+		vfs_truncate(fp, get32(p+1));
+}
+
+static void do_exec(uint8_t* p, int len)
+{
+	execute_rpc_command((char*) p);
+	fflush(stdout);
+}
+
+static void do_stats(const uint8_t* p, int len)
+{
+	char buffer[80];
+	int i;
+
+	for (i=0; i<NUM_STATS; i++)
+	{
+		sprintf(buffer, "%s=%u\n", stat_names[i], (unsigned) stats[i]);
+		reply_data(buffer, strlen(buffer));
+	}
+}
+
+/* Checks that a request payload is at least minlen bytes long and, if
+ * needstring is set, that it ends in a nul. */
+
+static int check_payload(int len, int minlen, int needstring)
+{
+	if ((len < minlen) || (needstring && rxbuf[len-1]))
+	{
+		reply_error("malformed request");
+		return 0;
+	}
+	return 1;
+}
+
+static void rpc_cb(int argc, const char* argv[])
+{
+	uint32_t mark;
+	int h;
+
+	if (argc != 1)
+	{
+		setError("syntax: rpc");
+		return;
+	}
+
+	rxbuf = scratch_alloc(RPC_MAX_PAYLOAD+1);
+	txbuf = scratch_alloc(RPC_MAX_PAYLOAD);
+	if (!rxbuf || !txbuf)
+		return;
+	mark = scratch_mark();
+	fflush(stdout);
+	newlines_off();
+
+	send_hello(0);
+	for (;;)
+	{
+		uint8_t seq, op;
+		int len = receive_packet(&seq, &op);
+
+		if (len == PACKET_NONE)
+			break;
+		if (len == PACKET_CORRUPT)
+		{
+			/* Corrupt packet; tell the host, which must retry. */
+			send_hello(seq);
+			continue;
+		}
+		rxbuf[len] = '\0';
+
+		reply_begin();
+		switch (op)
+		{
+			case RPC_HELLO:
+				send_hello(seq);
+				continue;
+
+			case RPC_PING:
+				reply_data(rxbuf, len);
+				break;
+
+			case RPC_MEMREAD:
+				do_memread(rxbuf, len);
+				break;
+
+			case RPC_MEMWRITE:
+				do_memwrite(rxbuf, len);
+				break;
+
+			case RPC_MEMFILL:
+				do_memfill(rxbuf, len);
+				break;
+
+			case RPC_OPEN:
+				if (check_payload(len, 2, 1))
+					do_open(rxbuf, len);
+				break;
+
+			case RPC_READ:
+				if (check_payload(len, 9, 0))
+					do_read(rxbuf, len);
+				break;
+
+			case RPC_WRITE:
+				if (check_payload(len, 5, 0))
+					do_write(rxbuf, len);
+				break;
+
+			case RPC_CLOSE:
+				if (check_payload(len, 1, 0))
+					do_close(rxbuf, len);
+				break;
+
+			case RPC_ENUM:
+				if (check_payload(len, 3, 1))
+					do_enum(rxbuf, len);
+				break;
+
+			case RPC_SIGNATURE:
+				if (check_payload(len, 9, 0))
+					do_signature(rxbuf, len);
+				break;
+
+			case RPC_COPY:
+				if (check_payload(len, 14, 0))
+					do_copy(rxbuf, len);
+				break;
+
+			case RPC_CRC32:
+				if (check_payload(len, 13, 0))
+					do_crc32(rxbuf, len);
+				break;
+
+			case RPC_TRUNCATE:
+				if (check_payload(len, 5, 0))
+					do_truncate(rxbuf, len);
+				break;
+
+			case RPC_EXEC:
+				if (check_payload(len, 1, 1))
+					do_exec(rxbuf, len);
+				break;
+
+			case RPC_STATS:
+				do_stats(rxbuf, len);
+				break;
+
+			case RPC_QUIT:
+				send_packet(seq, op | RPC_REPLY);
+				goto quit;
+
+			default:
+				reply_error("unknown request");
+				break;
+		}
+
+		if (error)
+		{
+			reply_error(error);
+			clearError();
+		}
+		send_packet(seq, op | RPC_REPLY);
+		scratch_release(mark);
+	}
+
+quit:
+	for (h=0; h<RPC_MAX_HANDLES; h++)
+	{
+		if (handles[h])
+		{
+			vfs_close(handles[h]);
+			handles[h] = NULL;
+		}
+	}
+
+	newlines_on();
+}
+
+const struct command rpc_cmd =
+{
+	"rpc",
+	"enters binary RPC mode",
+
+	"Syntax:\n"
+	"  rpc\n"
+	"Switches the console into a framed binary protocol intended for\n"
+	"driving piface from programs (see tools/piface-rpc.c). Sending the\n"
+	"byte a5 at an empty prompt does the same thing. ^C, or 30 seconds\n"
+	"without a request, goes back to the console. Commands which use the\n"
+	"console themselves (send, recv, rpc, source) can't be run over RPC.",
+
+	rpc_cb
+};
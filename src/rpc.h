@@ -0,0 +1,113 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#ifndef RPC_H
+#define RPC_H
+
+/* Wire format for the binary RPC channel. This file is shared between
+ * piface itself and the host-side client in tools/piface-rpc.c, so it must
+ * not depend on anything else.
+ *
+ * Every packet, in either direction, looks like this:
+ *
+ *   a5 5a <len:16> <seq:8> <op:8> <payload: len bytes> <crc:16>
+ *
+ * All multibyte values are little-endian. The CRC is CRC-16/CCITT over
+ * everything from <len> to the end of the payload. Replies carry the
+ * sequence number of the request and the op with bit 7 set; the first
+ * payload byte of a reply is a status code (RPC_OK or RPC_FAILED). Failed
+ * replies carry an error message as the rest of the payload.
+ *
+ * Requests are handled strictly in order, but the host may have several
+ * in flight at once. Anything on the line that isn't a valid packet (such
+ * as console output from a command run with RPC_EXEC) should be ignored or
+ * displayed by the host.
+ */
+
+#define RPC_SYNC0 0xa5
+#define RPC_SYNC1 0x5a
+
+#define RPC_HEADER_SIZE 6        /* sync, len, seq, op */
+#define RPC_TRAILER_SIZE 2       /* crc */
+#define RPC_MAX_PAYLOAD 4096
+#define RPC_MAX_HANDLES 8
+#define RPC_VERSION 1
+
+#define RPC_REPLY 0x80
+
+enum
+{
+	RPC_OK = 0,
+	RPC_FAILED = 1
+};
+
+enum
+{
+	/* Sent unsolicited by piface on entering RPC mode, and in reply to a
+	 * packet that fails its CRC (with the sequence number it received).
+	 * Payload: <status:8> <version:8> <max payload:16> */
+	RPC_HELLO = 0x00,
+
+	/* Payload is echoed back. */
+	RPC_PING = 0x01,
+
+	/* Batched memory operations. Request payload is a list of:
+	 *   MEMREAD:  <addr:32> <len:32>
+	 *   MEMWRITE: <addr:32> <len:32> <data: len bytes>
+	 *   MEMFILL:  <addr:32> <len:32> <pattern:32>
+	 * Addresses are physical. MEMREAD replies with all the data
+	 * concatenated. */
+	RPC_MEMREAD = 0x02,
+	RPC_MEMWRITE = 0x03,
+	RPC_MEMFILL = 0x04,
+
+	/* VFS access.
+	 *   OPEN:  <flags:8> <path, nul terminated>
+	 *          -> <handle:8> <base:32> <length:32>
+	 *          (flags 0 is read-only, 1 is write, 2 is update: read and
+	 *          write an existing file without truncating it)
+	 *   READ:  <handle:8> <offset:32> <len:32> -> <data>
+	 *   WRITE: <handle:8> <offset:32> <data> -> <written:32>
+	 *   CLOSE: <handle:8>
+	 *   ENUM:  <first:16> <path, nul terminated>
+	 *          -> <more:8> then a list of <isdir:8> <len:32> <name, nul terminated>
+	 *          (starting with the entry numbered <first>; if <more> is set,
+	 *          ask again for the rest) */
+	RPC_OPEN = 0x10,
+	RPC_READ = 0x11,
+	RPC_WRITE = 0x12,
+	RPC_CLOSE = 0x13,
+	RPC_ENUM = 0x14,
+
+	/* Block-delta updates, rsync style (see 'sync' in piface-rpc).
+	 *   SIGNATURE: <handle:8> <offset:32> <blocksize:16> <count:16>
+	 *          -> a list of <weak:32> <strong:32>, one for each block
+	 *          (fewer at the end of the file). weak is rsync's rolling
+	 *          checksum, strong is the block's CRC-32.
+	 *   COPY:  <src handle:8> <src offset:32> <dest handle:8>
+	 *          <dest offset:32> <len:32> -> <copied:32>
+	 *          (overlapping copies within one file work like memmove)
+	 *   CRC32: <handle:8> <offset:32> <len:32> <crc:32> -> <crc:32>
+	 *          (continues the given CRC-32 over the range)
+	 *   TRUNCATE: <handle:8> <length:32> */
+	RPC_SIGNATURE = 0x15,
+	RPC_COPY = 0x16,
+	RPC_CRC32 = 0x17,
+	RPC_TRUNCATE = 0x18,
+
+	/* Run a console command line (nul terminated). Any console output
+	 * appears on the line, unframed, before the reply. */
+	RPC_EXEC = 0x20,
+
+	/* Returns a list of name=value lines as text. */
+	RPC_STATS = 0x21,
+
+	/* Leaves RPC mode and returns to the command line. */
+	RPC_QUIT = 0x7f
+};
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+#include <setjmp.h>
+
+/* A cooperative scheduler, so that a command followed by & runs in the
+ * background while the console carries on.
+ *
+ * Jobs are stackful coroutines, but they all run on the one real stack:
+ * every job's frames start at stack_base (just below sched_run()), and
+ * switching jobs copies the outgoing job's stack out to the heap and the
+ * incoming job's back in, with setjmp()/longjmp() doing the rest. That
+ * needs no assembly and works with any compiler whose stack grows
+ * downwards. Nothing may keep a pointer into another job's stack.
+ *
+ * Jobs only switch in yield(), which the card's busy-wait loops call (a
+ * job gets at least QUANTUM us before yield() moves on), and in
+ * sched_idle(), which is called while waiting for the console or in
+ * millisleep(). The console itself is always runnable. Each job has its
+ * own error and a small scratch arena. Anything else that isn't safe to
+ * interleave needs a lock; the VFS layer takes one, so the card and FatFs
+ * only see one job at a time.
+ *
+ * Commands which talk over the console (send, recv, rpc) or run other
+ * command lines (source) can't run in the background. */
+
+#define MAX_JOBS 4
+#define QUANTUM 2000 /* us */
+#define JOB_SCRATCH_SIZE 2048 /* more spills to the heap (see mem.c) */
+#define RESTORE_PAD 256
+
+enum
+{
+	JOB_FREE,
+	JOB_NEW,
+	JOB_RUNNING,
+	JOB_DONE
+};
+
+struct job
+{
+	int state;
+	const struct command* cmd;
+	int argc;
+	char** argv; /* argv, its strings and the arena, in one block */
+	jmp_buf context;
+	uint8_t* stack;
+	uint32_t stacklen;
+	uint32_t stackalloc;
+	struct arena arena;
+	int failed;
+	char error[ERROR_SIZE];
+};
+
+static struct job console;
+static struct job jobs[MAX_JOBS];
+static struct job* current = &console;
+static int running; /* jobs which are new or running */
+static uint32_t slice_start;
+
+static void (*console_fn)(void);
+static uint8_t* stack_base;
+static jmp_buf spawn_point;
+
+/* Copies the stack, from just below the caller's frame up to stack_base,
+ * into the job. */
+
+static void save_stack(struct job* j)
+{
+	volatile uint8_t here;
+	uint8_t* low = (uint8_t*)(uintptr_t) &here;
+	uint32_t len = stack_base - low;
+
+	if (len > j->stackalloc)
+	{
+		j->stack = realloc(j->stack, len);
+		j->stackalloc = len;
+	}
+	memcpy(j->stack, low, len);
+	j->stacklen = len;
+}
+
+/* Puts the job's stack back and resumes it. The copy mustn't land on top
+ * of the frame doing it, so this and grow_stack() call each other until the
+ * frame is safely below the area being restored. */
+
+static void grow_stack(struct job* j);
+
+static void restore_stack(struct job* j)
+{
+	volatile uint8_t pad[RESTORE_PAD];
+
+	pad[0] = 0;
+	if ((uint8_t*)(uintptr_t) pad >= (stack_base - j->stacklen - 2*RESTORE_PAD))
+		grow_stack(j);
+
+	memcpy(stack_base - j->stacklen, j->stack, j->stacklen);
+	longjmp(j->context, 1);
+}
+
+static void grow_stack(struct job* j)
+{
+	restore_stack(j);
+}
+
+/* Called whenever a job starts running again. */
+
+static void switched_in(void)
+{
+	struct job* j = current;
+
+	scratch_switch((j == &console) ? NULL : &j->arena);
+	if (j->failed)
+		setError("%s", j->error);
+	else
+		clearError();
+	slice_start = read_timer();
+}
+
+static void switch_to(struct job* next)
+{
+	struct job* prev = current;
+
+	prev->failed = (error != NULL);
+	if (error)
+		strcpy(prev->error, error);
+
+	if (setjmp(prev->context))
+	{
+		switched_in();
+		return;
+	}
+
+	if (prev->state != JOB_DONE)
+		save_stack(prev);
+	current = next;
+	if (next->state == JOB_NEW)
+		longjmp(spawn_point, 1);
+	restore_stack(next);
+}
+
+/* Switches to the next job which can run, if there is one. */
+
+static void reschedule(void)
+{
+	int i = (current == &console) ? 0 : (current - jobs + 1);
+
+	for (; i<MAX_JOBS; i++)
+	{
+		if ((jobs[i].state == JOB_NEW) || (jobs[i].state == JOB_RUNNING))
+		{
+			switch_to(&jobs[i]);
+			return;
+		}
+	}
+	if (current != &console)
+		switch_to(&console);
+}
+
+void yield(void)
+{
+	if (running && timer_expired(slice_start, QUANTUM))
+		reschedule();
+}
+
+/* For callers with nothing to do until something else happens: lets every
+ * other job run first. */
+
+void sched_idle(void)
+{
+	if (running)
+		reschedule();
+}
+
+int sched_busy(void)
+{
+	return running;
+}
+
+/* Waits until the lock is free or already ours. Locks nest. */
+
+void sched_lock(struct lock* l)
+{
+	while (l->depth && (l->owner != current))
+		reschedule();
+	l->owner = current;
+	l->depth++;
+}
+
+void sched_unlock(struct lock* l)
+{
+	if (--l->depth == 0)
+		l->owner = NULL;
+}
+
+/* A new job starts here, on an empty stack. */
+
+static void run_job(void)
+{
+	struct job* j = current;
+
+	switched_in();
+	j->state = JOB_RUNNING;
+	j->cmd->callback(j->argc, (const char**) j->argv);
+	scratch_release(0);
+
+	j->failed = (error != NULL);
+	if (error)
+		strcpy(j->error, error);
+	j->state = JOB_DONE;
+	running--;
+	reschedule();
+}
+
+/* Runs the console, and everything else, from here; never returns. */
+
+void sched_run(void (*fn)(void))
+{
+	volatile uint8_t here;
+
+	console_fn = fn;
+	stack_base = (uint8_t*)(uintptr_t) &here;
+	console.state = JOB_RUNNING;
+
+	if (setjmp(spawn_point))
+		run_job();
+	else
+		console_fn();
+}
+
+void sched_spawn(const struct command* cmd, int argc, char* argv[])
+{
+	struct job* j = NULL;
+	const char* name = real_command(argv);
+	uint32_t len;
+	char* p;
+	int i;
+
+	/* wait uses the scheduler itself. */
+
+	if (console_command(name) || (strcmp(name, "wait") == 0))
+	{
+		setError("'%s' can't run in the background", name);
+		return;
+	}
+
+	for (i=0; i<MAX_JOBS; i++)
+	{
+		if (jobs[i].state == JOB_FREE)
+		{
+			j = &jobs[i];
+			break;
+		}
+	}
+	if (!j)
+	{
+		setError("too many jobs (the limit is %d)", MAX_JOBS);
+		return;
+	}
+
+	/* The parser's argv is overwritten by the next command, so take a
+	 * copy. */
+
+	len = (argc+1) * sizeof(char*);
+	for (i=0; i<argc; i++)
+		len += strlen(argv[i]) + 1;
+	len = (len + 3) & ~3;
+	j->argv = malloc(len + JOB_SCRATCH_SIZE);
+	if (!j->argv)
+	{
+		setError("not enough memory for a job");
+		return;
+	}
+
+	p = (char*) (j->argv + argc + 1);
+	for (i=0; i<argc; i++)
+	{
+		strcpy(p, argv[i]);
+		j->argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	j->argv[argc] = NULL;
+	j->argc = argc;
+	j->cmd = cmd;
+	memset(&j->arena, 0, sizeof(j->arena));
+	j->arena.base = (uint8_t*) j->argv + len;
+	j->arena.size = JOB_SCRATCH_SIZE;
+	j->failed = 0;
+	j->state = JOB_NEW;
+	running++;
+
+	printf("[%d]\n", (int) (j - jobs + 1));
+}
+
+static void print_job(struct job* j, const char* state)
+{
+	int i;
+
+	printf("[%d] %-8s", (int) (j - jobs + 1), state);
+	for (i=0; i<j->argc; i++)
+		printf(" %s", j->argv[i]);
+	printf("\n");
+	if (j->failed)
+		printf("    Error: %s\n", j->error);
+}
+
+/* Reports on jobs which have finished, and forgets them. */
+
+void sched_report(void)
+{
+	int i;
+
+	for (i=0; i<MAX_JOBS; i++)
+	{
+		struct job* j = &jobs[i];
+
+		if (j->state != JOB_DONE)
+			continue;
+
+		print_job(j, j->failed ? "failed" : "done");
+		free(j->argv);
+		free(j->stack);
+		j->argv = NULL;
+		j->stack = NULL;
+		j->stackalloc = 0;
+		j->state = JOB_FREE;
+	}
+}
+
+static void jobs_cb(int argc, const char* argv[])
+{
+	int i;
+
+	if (argc != 1)
+	{
+		setError("syntax: jobs");
+		return;
+	}
+
+	for (i=0; i<MAX_JOBS; i++)
+	{
+		struct job* j = &jobs[i];
+		if ((j->state == JOB_NEW) || (j->state == JOB_RUNNING))
+			print_job(j, "running");
+	}
+	sched_report();
+}
+
+const struct command jobs_cmd =
+{
+	"jobs",
+	"lists background jobs",
+
+	"Syntax:\n"
+	"  jobs\n"
+	"Lists the jobs started by ending a command line with &. Up to 4 can\n"
+	"run at once. Jobs take turns with the console whenever one of them\n"
+	"waits for the card, the serial line or a timer. Finished jobs are\n"
+	"reported (with their error, if any) at the next prompt.",
+
+	jobs_cb
+};
+
+static void wait_cb(int argc, const char* argv[])
+{
+	struct job* j = NULL;
+
+	if (argc > 2)
+	{
+		setError("syntax: wait [<job>]");
+		return;
+	}
+
+	if (argc == 2)
+	{
+		int n = strtoul(argv[1], NULL, 10);
+		if ((n < 1) || (n > MAX_JOBS) || (jobs[n-1].state == JOB_FREE))
+		{
+			setError("no such job");
+			return;
+		}
+		j = &jobs[n-1];
+	}
+
+	if (j)
+	{
+		while (j->state != JOB_DONE)
+			reschedule();
+	}
+	else
+	{
+		while (running)
+			reschedule();
+	}
+	sched_report();
+}
+
+const struct command wait_cmd =
+{
+	"wait",
+	"waits for background jobs to finish",
+
+	"Syntax:\n"
+	"  wait [<job>]\n"
+	"Waits for the given job (or all of them) to finish, then reports on\n"
+	"them.",
+
+	wait_cb
+};
@@ -0,0 +1,70 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+
+/* Performance counters. Each layer bumps its own entries with count_stat();
+ * the names here are what the stats command and the RPC interface report,
+ * in the same order as the enum in globals.h. */
+
+uint32_t stats[NUM_STATS];
+
+const char* stat_names[NUM_STATS] =
+{
+	"vfs.opens",
+	"vfs.reads",
+	"vfs.read_bytes",
+	"vfs.writes",
+	"vfs.write_bytes",
+	"fat.window_reads",
+	"fat.window_writes",
+	"fat.lookups",
+	"disk.sectors_read",
+	"disk.sectors_written",
+	"mmc.commands",
+	"mmc.retries",
+	"xmodem.blocks",
+	"xmodem.naks",
+	"xmodem.timeouts",
+	"rpc.packets_in",
+	"rpc.packets_out",
+	"rpc.crc_errors",
+};
+
+static void stats_cb(int argc, const char* argv[])
+{
+	int i;
+
+	if (argc == 1)
+	{
+		for (i=0; i<NUM_STATS; i++)
+			printf("%-22s %10u\n", stat_names[i], (unsigned) stats[i]);
+	}
+	else if ((argc == 2) && (strcmp(argv[1], "-m") == 0))
+	{
+		for (i=0; i<NUM_STATS; i++)
+			printf("%s=%u\n", stat_names[i], (unsigned) stats[i]);
+	}
+	else if ((argc == 2) && (strcmp(argv[1], "reset") == 0))
+		memset(stats, 0, sizeof(stats));
+	else
+		setError("syntax: stats [-m | reset]");
+}
+
+const struct command stats_cmd =
+{
+	"stats",
+	"shows or resets the performance counters",
+
+	"Syntax:\n"
+	"  stats [-m | reset]\n"
+	"Shows how many operations each layer (vfs, FAT, disk, mmc, xmodem, rpc)\n"
+	"has done since startup or the last reset. -m prints name=value lines\n"
+	"for programs to read; the same list is available over RPC.",
+
+	stats_cb
+};
@@ -0,0 +1,179 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+
+/* I/O event tracer. Events are stored in binary form in a fixed ring, so
+ * recording one is a handful of stores and a timer read; nothing is
+ * formatted until the ring is dumped. When the ring fills, the oldest
+ * events are overwritten. The ring is allocated by 'trace on', and kept
+ * (for dumping) until 'trace free'. */
+
+#define TRACE_SIZE 1024 /* must be a power of two */
+
+struct event
+{
+	uint32_t time;
+	uint32_t event;
+	uint32_t a;
+	uint32_t b;
+};
+
+static struct event* ring;
+static uint32_t head; /* total number of events ever recorded */
+
+int trace_enabled = 0;
+
+static const char* event_names[NUM_TRACE_EVENTS] =
+{
+	"vfs open",
+	"vfs close",
+	"vfs read",
+	"vfs write",
+	"fat move",
+	"fat sync",
+	"disk read",
+	"disk write",
+	"mmc cmd",
+	"mmc retry",
+};
+
+void trace_event(int event, uint32_t a, uint32_t b)
+{
+	struct event* e = &ring[head & (TRACE_SIZE-1)];
+
+	e->time = read_timer();
+	e->event = event;
+	e->a = a;
+	e->b = b;
+	head++;
+}
+
+static void print_event(const struct event* e)
+{
+	switch (e->event)
+	{
+		case TRACE_VFS_OPEN:
+			printf("flags %x", (unsigned) e->a);
+			break;
+
+		case TRACE_VFS_READ:
+		case TRACE_VFS_WRITE:
+			printf("offset %08x len %x", (unsigned) e->a, (unsigned) e->b);
+			break;
+
+		case TRACE_FAT_MOVE:
+			printf("sector %x (was %x)", (unsigned) e->a, (unsigned) e->b);
+			break;
+
+		case TRACE_FAT_SYNC:
+			printf("sector %x", (unsigned) e->a);
+			break;
+
+		case TRACE_DISK_READ:
+		case TRACE_DISK_WRITE:
+			printf("drive %u sector %x count %u", (unsigned) (e->b >> 8),
+				(unsigned) e->a, (unsigned) (e->b & 0xff));
+			break;
+
+		case TRACE_MMC_COMMAND:
+			printf("cmd %u flags %x arg %08x", (unsigned) (e->a & 0x3f),
+				(unsigned) (e->a & ~0x3f), (unsigned) e->b);
+			break;
+
+		case TRACE_MMC_RETRY:
+			printf("address %08x attempt %u", (unsigned) e->a,
+				(unsigned) e->b + 1);
+			break;
+	}
+}
+
+static void trace_dump(void)
+{
+	uint32_t first = 0;
+	uint32_t start, prev;
+	uint32_t i;
+
+	if (!ring)
+		return;
+	if (head > TRACE_SIZE)
+	{
+		first = head - TRACE_SIZE;
+		printf("(%u earlier events lost)\n", (unsigned) first);
+	}
+	if (head == first)
+		return;
+
+	/* Times are shown relative to the first event in the ring, followed
+	 * by the gap since the previous event. */
+
+	start = prev = ring[first & (TRACE_SIZE-1)].time;
+	for (i=first; i<head; i++)
+	{
+		const struct event* e = &ring[i & (TRACE_SIZE-1)];
+		const char* name = "?";
+
+		if (e->event < NUM_TRACE_EVENTS)
+			name = event_names[e->event];
+
+		printf("%10u +%-7u %-10s ", (unsigned) (e->time - start),
+			(unsigned) (e->time - prev), name);
+		print_event(e);
+		printf("\n");
+		prev = e->time;
+	}
+}
+
+static void trace_cb(int argc, const char* argv[])
+{
+	if (argc == 1)
+		printf("Tracing is %s; %u events recorded.\n",
+			trace_enabled ? "on" : "off", (unsigned) head);
+	else if ((argc == 2) && (strcmp(argv[1], "on") == 0))
+	{
+		if (!ring)
+			ring = malloc(TRACE_SIZE * sizeof(struct event));
+		if (!ring)
+		{
+			setError("not enough memory for the trace buffer");
+			return;
+		}
+		head = 0;
+		trace_enabled = 1;
+	}
+	else if ((argc == 2) && (strcmp(argv[1], "off") == 0))
+		trace_enabled = 0;
+	else if ((argc == 2) && (strcmp(argv[1], "dump") == 0))
+		trace_dump();
+	else if ((argc == 2) && (strcmp(argv[1], "free") == 0))
+	{
+		trace_enabled = 0;
+		free(ring);
+		ring = NULL;
+		head = 0;
+	}
+	else
+		setError("syntax: trace [on|off|dump|free]");
+}
+
+const struct command trace_cmd =
+{
+	"trace",
+	"records I/O events for later inspection",
+
+	"Syntax:\n"
+	"  trace [on|off|dump|free]\n"
+	"'trace on' clears the trace buffer and starts recording vfs calls,\n"
+	"FAT window moves, disk sector transfers and SD card commands; 'trace\n"
+	"off' stops. 'trace dump' decodes the buffer, which holds the most\n"
+	"recent 1024 events. Times are in us. Recording is cheap enough to\n"
+	"leave on during transfers, but the dump is best done afterwards.\n"
+	"The buffer takes 16kB from the time tracing is first turned on;\n"
+	"'trace free' gives it back.",
+
+	trace_cb
+};
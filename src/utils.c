@@ -8,6 +8,9 @@
 #ifdef __GNUC__
 #include <sys/time.h>
 #endif
+#if defined TARGET_TESTBED
+#include <time.h>
+#endif
 #include "globals.h"
 
 void millisleep(uint32_t s)
@@ -22,7 +25,431 @@ void millisleep(uint32_t s)
 	FD_ZERO(&exs);
 
 	fflush(stdout);
-	select(0, &rds, &wrs, &exs, &t);
+	if (!sched_busy())
+	{
+		select(0, &rds, &wrs, &exs, &t);
+		return;
+	}
+
+	/* Let background jobs use the time. */
+
+	{
+		uint32_t start = read_timer();
+		while (!timer_expired(start, s*1000))
+			sched_idle();
+	}
 }
 
+/* Returns a free-running microsecond count. It wraps every 71 minutes or
+ * so, so only differences between readings are meaningful. */
+
+#if defined TARGET_PI
+
+#define SYSTIMER_CLO 0x7e003004 /* low 32 bits of the 1MHz system timer */
+
+uint32_t read_timer(void)
+{
+	return *(volatile uint32_t*) pi_phys_to_user((void*) SYSTIMER_CLO);
+}
+
+#else
+
+uint32_t read_timer(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+#endif
+
+/* Returns nonzero once at least timeout us have passed since start (a value
+ * from read_timer()). */
+
+int timer_expired(uint32_t start, uint32_t timeout)
+{
+	return (read_timer() - start) >= timeout;
+}
+
+/* Waits up to the given time for console input; returns nonzero if there
+ * is some. */
+
+int poll_console(uint32_t ms)
+{
+	struct timeval t;
+	fd_set rds, wrs, exs;
+
+	t.tv_sec = ms/1000;
+	t.tv_usec = (ms%1000)*1000;
+	FD_ZERO(&rds);
+	FD_ZERO(&wrs);
+	FD_ZERO(&exs);
+	FD_SET(0, &rds);
+
+	fflush(stdout);
+	if (!sched_busy())
+		return select(1, &rds, &wrs, &exs, &t) > 0;
+
+	/* Background jobs are running, so poll instead of blocking, and let
+	 * them run in between. */
+
+	{
+		uint32_t start = read_timer();
+		for (;;)
+		{
+			t.tv_sec = t.tv_usec = 0;
+			FD_SET(0, &rds);
+			if (select(1, &rds, &wrs, &exs, &t) > 0)
+				return 1;
+			if (timer_expired(start, ms*1000))
+				return 0;
+			sched_idle();
+		}
+	}
+}
+
+/* Waits as long as it takes for a character from the console. Only
+ * needed while background jobs are running (so they can run); otherwise
+ * a blocking read does the same job. */
+
+void wait_for_console(void)
+{
+	while (sched_busy() && !poll_console(100))
+		;
+}
+
+/* Fills memory with a repeating 32-bit pattern (stored little-endian, so
+ * the byte at dest+i is byte i%4 of the pattern). The bulk of the work is
+ * done with aligned, unrolled word stores. */
+
+void fill_memory(void* dest, uint32_t pattern, uint32_t len)
+{
+	uint8_t* p = dest;
+	uint32_t* wp;
+	uint32_t word;
+	unsigned phase = 0;
+
+	while (len && ((uintptr_t)p & 3))
+	{
+		*p++ = pattern >> (phase*8);
+		phase = (phase+1) & 3;
+		len--;
+	}
+
+	/* Rotate the pattern so it lines up with the aligned words. */
+
+	word = phase ? ((pattern >> (phase*8)) | (pattern << (32 - phase*8))) : pattern;
+
+	wp = (uint32_t*) p;
+	while (len >= 32)
+	{
+		wp[0] = word;
+		wp[1] = word;
+		wp[2] = word;
+		wp[3] = word;
+		wp[4] = word;
+		wp[5] = word;
+		wp[6] = word;
+		wp[7] = word;
+		wp += 8;
+		len -= 32;
+	}
+	while (len >= 4)
+	{
+		*wp++ = word;
+		len -= 4;
+	}
+
+	p = (uint8_t*) wp;
+	while (len--)
+	{
+		*p++ = pattern >> (phase*8);
+		phase = (phase+1) & 3;
+	}
+}
+
+/* Returns the offset of the first byte which differs between a and b, or
+ * len if they're the same. Where the two have the same alignment, this
+ * compares four words per iteration. */
+
+uint32_t compare_memory(const void* a, const void* b, uint32_t len)
+{
+	const uint8_t* pa = a;
+	const uint8_t* pb = b;
+	uint32_t i = 0;
 
+	if ((((uintptr_t)pa ^ (uintptr_t)pb) & 3) == 0)
+	{
+		while ((i < len) && ((uintptr_t)(pa+i) & 3))
+		{
+			if (pa[i] != pb[i])
+				return i;
+			i++;
+		}
+
+		while ((len - i) >= 16)
+		{
+			const uint32_t* wa = (const uint32_t*) (pa+i);
+			const uint32_t* wb = (const uint32_t*) (pb+i);
+			if ((wa[0] ^ wb[0]) | (wa[1] ^ wb[1]) |
+			    (wa[2] ^ wb[2]) | (wa[3] ^ wb[3]))
+				break;
+			i += 16;
+		}
+	}
+
+	while (i < len)
+	{
+		if (pa[i] != pb[i])
+			return i;
+		i++;
+	}
+	return len;
+}
+
+/* Like memmove(), but uses unrolled word copies where the source and
+ * destination have the same alignment. */
+
+void move_memory(void* dest, const void* src, uint32_t len)
+{
+	uint8_t* d = dest;
+	const uint8_t* s = src;
+	int aligned = ((((uintptr_t)d ^ (uintptr_t)s) & 3) == 0);
+
+	if ((d <= s) || (d >= (s + len)))
+	{
+		/* Copy forwards. */
+
+		if (aligned)
+		{
+			uint32_t* wd;
+			const uint32_t* ws;
+
+			while (len && ((uintptr_t)d & 3))
+			{
+				*d++ = *s++;
+				len--;
+			}
+
+			wd = (uint32_t*) d;
+			ws = (const uint32_t*) s;
+			while (len >= 32)
+			{
+				wd[0] = ws[0];
+				wd[1] = ws[1];
+				wd[2] = ws[2];
+				wd[3] = ws[3];
+				wd[4] = ws[4];
+				wd[5] = ws[5];
+				wd[6] = ws[6];
+				wd[7] = ws[7];
+				wd += 8;
+				ws += 8;
+				len -= 32;
+			}
+			while (len >= 4)
+			{
+				*wd++ = *ws++;
+				len -= 4;
+			}
+			d = (uint8_t*) wd;
+			s = (const uint8_t*) ws;
+		}
+
+		while (len--)
+			*d++ = *s++;
+	}
+	else
+	{
+		/* Overlapping with the destination higher up; copy backwards. */
+
+		d += len;
+		s += len;
+		if (aligned)
+		{
+			uint32_t* wd;
+			const uint32_t* ws;
+
+			while (len && ((uintptr_t)d & 3))
+			{
+				*--d = *--s;
+				len--;
+			}
+
+			wd = (uint32_t*) d;
+			ws = (const uint32_t*) s;
+			while (len >= 32)
+			{
+				wd -= 8;
+				ws -= 8;
+				wd[7] = ws[7];
+				wd[6] = ws[6];
+				wd[5] = ws[5];
+				wd[4] = ws[4];
+				wd[3] = ws[3];
+				wd[2] = ws[2];
+				wd[1] = ws[1];
+				wd[0] = ws[0];
+				len -= 32;
+			}
+			while (len >= 4)
+			{
+				*--wd = *--ws;
+				len -= 4;
+			}
+			d = (uint8_t*) wd;
+			s = (const uint8_t*) ws;
+		}
+
+		while (len--)
+			*--d = *--s;
+	}
+}
+
+/* Table-driven CRC-16/CCITT (polynomial 0x1021, MSB first), as used by
+ * XMODEM and the RPC channel. The table is built on first use. */
+
+static uint16_t crc16_table[256];
+static int crc16_inited = 0;
+
+uint16_t update_crc16(uint16_t crc, const void* data, uint32_t len)
+{
+	const uint8_t* p = data;
+
+	if (!crc16_inited)
+	{
+		int i, j;
+
+		for (i=0; i<256; i++)
+		{
+			uint16_t c = i << 8;
+			for (j=0; j<8; j++)
+			{
+				if (c & 0x8000)
+					c = (c << 1) ^ 0x1021;
+				else
+					c = (c << 1);
+			}
+			crc16_table[i] = c;
+		}
+		crc16_inited = 1;
+	}
+
+	while (len--)
+		crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ *p++) & 0xff];
+	return crc;
+}
+
+/* Table-driven CRC-32 (polynomial 0xedb88320, LSB first), as used by
+ * zlib and gzip. Start with 0; the result can be passed back in to
+ * continue over more data. */
+
+static uint32_t crc32_table[256];
+static int crc32_inited = 0;
+
+uint32_t update_crc32(uint32_t crc, const void* data, uint32_t len)
+{
+	const uint8_t* p = data;
+
+	if (!crc32_inited)
+	{
+		int i, j;
+
+		for (i=0; i<256; i++)
+		{
+			uint32_t c = i;
+			for (j=0; j<8; j++)
+			{
+				if (c & 1)
+					c = (c >> 1) ^ 0xedb88320;
+				else
+					c = (c >> 1);
+			}
+			crc32_table[i] = c;
+		}
+		crc32_inited = 1;
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = (crc >> 8) ^ crc32_table[(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+/* Looks for the first FAT partition in a master boot record. Returns the
+ * partition number and sets *offset to its first sector; returns -1 if
+ * there's an MBR but no FAT partition, and -2 if there's no MBR at all
+ * (in which case the whole device is one filesystem). */
+
+int find_fat_partition(const uint8_t* mbr, uint32_t* offset)
+{
+	int i;
+
+	*offset = 0;
+	if ((mbr[510] != 0x55) || (mbr[511] != 0xaa))
+		return -2;
+
+	/* A FAT boot sector has the same signature; spot it by its file
+	 * system type string (FAT12/16 and FAT32 keep it in different
+	 * places). */
+
+	if ((memcmp(mbr+54, "FAT", 3) == 0) || (memcmp(mbr+82, "FAT", 3) == 0))
+		return -2;
+
+	for (i=0; i<4; i++)
+	{
+		const uint8_t* p = &mbr[0x1be + i*16];
+		switch (p[4])
+		{
+			case 0x01: /* FAT12 */
+			case 0x04: /* FAT16, <32MB */
+			case 0x06: /* FAT16, >32MB */
+			case 0x0b: /* FAT32 */
+			case 0x0c: /* FAT32X */
+			case 0x0e: /* FAT16X */
+				*offset = p[8] | (p[9]<<8) | (p[10]<<16) | ((uint32_t)p[11]<<24);
+				return i;
+		}
+	}
+	return -1;
+}
+
+/* Matches a name against a pattern, where * matches any run of characters
+ * and ? any one character. Case is ignored, as FAT short names are stored
+ * in upper case. */
+
+int match_glob(const char* pattern, const char* name)
+{
+	for (;;)
+	{
+		switch (*pattern)
+		{
+			case '\0':
+				return !*name;
+
+			case '*':
+				pattern++;
+				do
+				{
+					if (match_glob(pattern, name))
+						return 1;
+				}
+				while (*name++);
+				return 0;
+
+			case '?':
+				if (!*name)
+					return 0;
+				break;
+
+			default:
+				if (toupper(*pattern) != toupper(*name))
+					return 0;
+				break;
+		}
+
+		pattern++;
+		name++;
+	}
+}
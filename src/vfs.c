@@ -13,12 +13,20 @@ static const struct vfs* vfs[] =
 #if defined TARGET_TESTBED
 	&vfs_host,
 #endif
-#if defined TARGET_PI
 	&vfs_sd,
-#endif
+	&vfs_ram,
+	&vfs_blk,
+	&vfs_lz4,
+	&vfs_gz,
 };
 #define NUM_VFS sizeof(vfs)/sizeof(*vfs)
 
+/* The filesystems (and the card under them) aren't reentrant, so only one
+ * job may be inside one at a time. Commands which go to FatFs directly
+ * take this too. */
+
+struct lock vfs_lock;
+
 static const struct vfs* find_vfs(const char* name, int namelen)
 {
 	int i;
@@ -47,7 +55,7 @@ static int parse_vfs_path(const char* path, const struct vfs** fs,
 
 	len = e-path;
 	*fs = find_vfs(path, len);
-	if (!fs)
+	if (!*fs)
 	{
 		setError("unknown file system '%.*s'", len, path);
 		return 0;
@@ -66,10 +74,21 @@ struct file* vfs_open(const char* path, int flags)
 	if (!parse_vfs_path(path, &fs, &subpath))
 		return NULL;
 
+	count_stat(STAT_VFS_OPENS, 1);
+	trace(TRACE_VFS_OPEN, flags, 0);
+	sched_lock(&vfs_lock);
 	backend = fs->open(subpath, flags);
+	sched_unlock(&vfs_lock);
 	if (backend)
 	{
-		struct file* fp = malloc(sizeof(struct file));
+		struct file* fp = pool_alloc(&file_pool);
+		if (!fp)
+		{
+			sched_lock(&vfs_lock);
+			fs->callbacks->close(backend);
+			sched_unlock(&vfs_lock);
+			return NULL;
+		}
 		fp->backend = backend;
 		fp->cb = fs->callbacks;
 		return fp;
@@ -79,18 +98,37 @@ struct file* vfs_open(const char* path, int flags)
 
 void vfs_close(struct file* fp)
 {
+	trace(TRACE_VFS_CLOSE, 0, 0);
+	sched_lock(&vfs_lock);
 	fp->cb->close(fp->backend);
-	free(fp);
+	sched_unlock(&vfs_lock);
+	pool_free(&file_pool, fp);
 }
 
 uint32_t vfs_read(struct file* fp, uint32_t offset, void* buffer, uint32_t len)
 {
-	return fp->cb->read(fp->backend, offset, buffer, len);
+	uint32_t r;
+
+	trace(TRACE_VFS_READ, offset, len);
+	sched_lock(&vfs_lock);
+	r = fp->cb->read(fp->backend, offset, buffer, len);
+	sched_unlock(&vfs_lock);
+	count_stat(STAT_VFS_READS, 1);
+	count_stat(STAT_VFS_READ_BYTES, r);
+	return r;
 }
 
 uint32_t vfs_write(struct file* fp, uint32_t offset, void* buffer, uint32_t len)
 {
-	return fp->cb->write(fp->backend, offset, buffer, len);
+	uint32_t w;
+
+	trace(TRACE_VFS_WRITE, offset, len);
+	sched_lock(&vfs_lock);
+	w = fp->cb->write(fp->backend, offset, buffer, len);
+	sched_unlock(&vfs_lock);
+	count_stat(STAT_VFS_WRITES, 1);
+	count_stat(STAT_VFS_WRITE_BYTES, w);
+	return w;
 }
 
 void vfs_info(struct file* fp, uint32_t* base, uint32_t* length)
@@ -100,7 +138,21 @@ void vfs_info(struct file* fp, uint32_t* base, uint32_t* length)
 		base = &dummy;
 	if (!length)
 		length = &dummy;
+	sched_lock(&vfs_lock);
 	fp->cb->info(fp->backend, base, length);
+	sched_unlock(&vfs_lock);
+}
+
+void vfs_truncate(struct file* fp, uint32_t length)
+{
+	if (!fp->cb->truncate)
+	{
+		setError("filesystem does not support truncation");
+		return;
+	}
+	sched_lock(&vfs_lock);
+	fp->cb->truncate(fp->backend, length);
+	sched_unlock(&vfs_lock);
 }
 
 void vfs_enumerate(const char* path, vfs_enumerate_f* cb)
@@ -117,8 +169,226 @@ void vfs_enumerate(const char* path, vfs_enumerate_f* cb)
 		return;
 	}
 
+	sched_lock(&vfs_lock);
 	fs->enumerate(subpath, cb);
-	return;
+	sched_unlock(&vfs_lock);
+}
+
+/* Batched enumeration, for walking whole trees. Filesystems which can read
+ * a directory in bulk do it themselves; for the rest, the entries are
+ * gathered up here. */
+
+#define BATCH_SIZE 32
+#define BATCH_NAMES 1024
+
+static struct
+{
+	struct vfs_dirent entries[BATCH_SIZE];
+	char names[BATCH_NAMES];
+	int count;
+	int namelen;
+	vfs_batch_f* cb;
+	void* context;
+}
+batch;
+
+static void flush_batch(void)
+{
+	if (batch.count)
+		batch.cb(batch.entries, batch.count, batch.context);
+	batch.count = batch.namelen = 0;
+}
+
+static void batch_enumerate_cb(const char* name, int isdir, uint32_t length)
+{
+	int len = strlen(name) + 1;
+	struct vfs_dirent* de;
+
+	if (len > BATCH_NAMES)
+		return;
+	if ((batch.count == BATCH_SIZE) || ((batch.namelen + len) > BATCH_NAMES))
+		flush_batch();
+
+	de = &batch.entries[batch.count++];
+	de->name = batch.names + batch.namelen;
+	de->isdir = isdir;
+	de->length = length;
+	memcpy(batch.names + batch.namelen, name, len);
+	batch.namelen += len;
+}
+
+void vfs_enumerate_batch(const char* path, vfs_batch_f* cb, void* context)
+{
+	const struct vfs* fs;
+	const char* subpath;
+
+	if (!parse_vfs_path(path, &fs, &subpath))
+		return;
+
+	if (!fs->enumerate)
+	{
+		setError("filesystem does not support enumeration");
+		return;
+	}
+
+	sched_lock(&vfs_lock);
+	if (fs->enumerate_batch)
+		fs->enumerate_batch(subpath, cb, context);
+	else
+	{
+		batch.cb = cb;
+		batch.context = context;
+		batch.count = batch.namelen = 0;
+		fs->enumerate(subpath, batch_enumerate_cb);
+		flush_batch();
+	}
+	sched_unlock(&vfs_lock);
 }
 
+/* Wildcard expansion, for commands which take several files. A pattern may
+ * use * and ? in its last component; every pattern in the same directory
+ * is matched in a single pass over it, and the matches come back in
+ * directory order. Other arguments are passed through as they are (with
+ * isdir unknown). The list lives in the scratch arena, so it goes away
+ * when the command finishes. Returns NULL (and sets the error) if
+ * anything goes wrong, including a pattern which matches nothing. */
 
+#define MAX_PATTERNS 32
+
+static struct
+{
+	const char* dir; /* prefix of each match */
+	int dirlen;
+	const char* patterns[MAX_PATTERNS];
+	int matched[MAX_PATTERNS];
+	int count;
+	int dirs;
+	struct vfs_match** tail;
+}
+globbing;
+
+static const char* last_component(const char* path)
+{
+	const char* p = path + strlen(path);
+
+	while ((p > path) && (p[-1] != '/') && (p[-1] != ':'))
+		p--;
+	return p;
+}
+
+int vfs_is_glob(const char* path)
+{
+	return strpbrk(last_component(path), "*?") != NULL;
+}
+
+static void add_match(const char* dir, int dirlen, const char* name,
+	int isdir, uint32_t length)
+{
+	struct vfs_match* m = scratch_alloc(sizeof(struct vfs_match) +
+		dirlen + strlen(name));
+	if (!m)
+		return;
+
+	memcpy(m->path, dir, dirlen);
+	strcpy(m->path + dirlen, name);
+	m->name = last_component(m->path);
+	m->isdir = isdir;
+	m->length = length;
+	m->next = NULL;
+	*globbing.tail = m;
+	globbing.tail = &m->next;
+}
+
+static void glob_enumerate_cb(const char* name, int isdir, uint32_t length)
+{
+	int hit = 0;
+	int i;
+
+	if (error || (isdir && !globbing.dirs))
+		return;
+
+	for (i=0; i<globbing.count; i++)
+	{
+		if (match_glob(globbing.patterns[i], name))
+		{
+			globbing.matched[i] = 1;
+			hit = 1;
+		}
+	}
+	if (hit)
+		add_match(globbing.dir, globbing.dirlen, name, isdir, length);
+}
+
+struct vfs_match* vfs_glob(int argc, const char* argv[], int dirs)
+{
+	struct vfs_match* list = NULL;
+	uint8_t* done = scratch_alloc(argc);
+	int i, j;
+
+	if (!done)
+		return NULL;
+	memset(done, 0, argc);
+
+	/* The state above is shared, so hold the lock throughout. */
+
+	sched_lock(&vfs_lock);
+	globbing.tail = &list;
+	globbing.dirs = dirs;
+	for (i=0; (i<argc) && !error; i++)
+	{
+		const char* name = last_component(argv[i]);
+		int dirlen = name - argv[i];
+		char* dirpath;
+
+		if (done[i])
+			continue;
+		if (!strpbrk(name, "*?"))
+		{
+			add_match(argv[i], strlen(argv[i]), "", -1, 0);
+			continue;
+		}
+
+		/* Gather up every pattern in this directory. */
+
+		globbing.dir = argv[i];
+		globbing.dirlen = dirlen;
+		globbing.count = 0;
+		for (j=i; (j<argc) && (globbing.count < MAX_PATTERNS); j++)
+		{
+			const char* n = last_component(argv[j]);
+
+			if (!done[j] && ((n - argv[j]) == dirlen) &&
+			    (memcmp(argv[j], argv[i], dirlen) == 0) && strpbrk(n, "*?"))
+			{
+				globbing.patterns[globbing.count] = n;
+				globbing.matched[globbing.count] = 0;
+				globbing.count++;
+				done[j] = 1;
+			}
+		}
+
+		/* List the directory (without any trailing slash, except for the
+		 * root). */
+
+		dirpath = scratch_alloc(dirlen + 1);
+		if (!dirpath)
+			break;
+		memcpy(dirpath, argv[i], dirlen);
+		dirpath[dirlen] = '\0';
+		if ((dirlen >= 2) && (dirpath[dirlen-1] == '/') &&
+		    (dirpath[dirlen-2] != ':'))
+			dirpath[dirlen-1] = '\0';
+
+		vfs_enumerate(dirpath, glob_enumerate_cb);
+
+		for (j=0; (j<globbing.count) && !error; j++)
+		{
+			if (!globbing.matched[j])
+				setError("nothing matches '%.*s%s'", dirlen, argv[i],
+					globbing.patterns[j]);
+		}
+	}
+	sched_unlock(&vfs_lock);
+
+	return error ? NULL : list;
+}
@@ -0,0 +1,295 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+
+/* The blk: filesystem: raw access to the sectors of the SD card, with no
+ * filesystem in the way. Paths are:
+ *
+ *   blk:                  the whole card
+ *   blk:<n>               partition n (1-4) of the MBR
+ *   blk:<start>+<count>   a range of sectors (in hex)
+ *
+ * Offsets are in bytes, so only the first 4GB of any of these can be
+ * reached; use a sector range to get past that. Whole sectors are passed
+ * straight to the card as one multiple-block transfer; partial ones go
+ * through a bounce buffer.
+ *
+ * Writing changes the card behind FatFs's back, so sd: writes back what
+ * it has cached before the first write to a file, and forgets it when the
+ * file is closed. Files open on sd: stay open, but may have a sector of
+ * stale data buffered. */
+
+#define MAX_RUN 0x8000 /* sectors per card command */
+
+struct blkfile
+{
+	uint32_t start;
+	uint32_t sectors;
+	uint32_t length;
+	int written;
+};
+
+static void* open_cb(const char* path, int flags);
+static void close_cb(void* backend);
+static uint32_t read_cb(void* backend,
+		uint32_t offset, void* buffer, uint32_t length);
+static uint32_t write_cb(void* backend,
+		uint32_t offset, void* buffer, uint32_t length);
+static void info_cb(void* backend,
+		uint32_t* base, uint32_t* length);
+static void enumerate_cb(const char* path, vfs_enumerate_f* cb);
+
+const struct filecbs filecbs_blk =
+{
+	close_cb,
+	read_cb,
+	write_cb,
+	info_cb
+};
+
+const struct vfs vfs_blk =
+{
+	"blk",
+	&filecbs_blk,
+
+	open_cb,
+	enumerate_cb
+};
+
+static uint32_t bounce[128];
+
+static void malformed(void)
+{
+	setError("malformed blk: path (use nothing, <partition> or <start>+<count>)");
+}
+
+/* Reads the MBR and returns the given partition's extent (n is 1-4).
+ * Returns 0 if there's no such partition. */
+
+static int read_partition(int n, uint32_t* start, uint32_t* sectors)
+{
+	const uint8_t* mbr = (const uint8_t*) bounce;
+	const uint8_t* p;
+
+	if (!mmc_raw_read(0, bounce, 1))
+	{
+		setError("cannot read MBR");
+		return 0;
+	}
+	if (find_fat_partition(mbr, start) == -2)
+	{
+		setError("card has no partition table");
+		return 0;
+	}
+
+	p = &mbr[0x1be + (n-1)*16];
+	*start = p[8] | (p[9]<<8) | (p[10]<<16) | ((uint32_t)p[11]<<24);
+	*sectors = p[12] | (p[13]<<8) | (p[14]<<16) | ((uint32_t)p[15]<<24);
+	if (!p[4] || !*sectors)
+	{
+		setError("partition %d is not in use", n);
+		return 0;
+	}
+	return 1;
+}
+
+static void* open_cb(const char* path, int flags)
+{
+	uint32_t start, sectors, cardsize;
+	struct blkfile* fp;
+	char dummy;
+
+	vfs_sd_init();
+	cardsize = mmc_raw_sectors();
+	if (!cardsize)
+	{
+		setError("no card present");
+		return NULL;
+	}
+
+	if (!*path || (strcmp(path, "/") == 0))
+	{
+		start = 0;
+		sectors = cardsize;
+	}
+	else if (sscanf(path, "%x+%x%c", &start, &sectors, &dummy) == 2)
+		;
+	else if ((sscanf(path, "%u%c", &start, &dummy) == 1) &&
+	         (start >= 1) && (start <= 4))
+	{
+		if (!read_partition(start, &start, &sectors))
+			return NULL;
+	}
+	else
+	{
+		malformed();
+		return NULL;
+	}
+
+	if ((start >= cardsize) || (sectors > (cardsize - start)))
+	{
+		setError("sectors 0x%x+0x%x are beyond the end of the card (0x%x)",
+			start, sectors, cardsize);
+		return NULL;
+	}
+
+	fp = malloc(sizeof(struct blkfile));
+	fp->start = start;
+	fp->sectors = sectors;
+	fp->length = (sectors >= 0x800000) ? 0xfffffe00 : (sectors * 512);
+	fp->written = 0;
+	return fp;
+}
+
+static void close_cb(void* backend)
+{
+	struct blkfile* fp = backend;
+
+	if (fp->written)
+		vfs_sd_flush();
+	free(fp);
+}
+
+/* Shared by read and write: moves length bytes between the card and the
+ * buffer. Returns the number of bytes moved. */
+
+static uint32_t transfer(struct blkfile* fp, uint32_t offset, uint8_t* buffer,
+		uint32_t length, int writing)
+{
+	uint32_t done = 0;
+
+	if (offset >= fp->length)
+		return 0;
+	if (length > (fp->length - offset))
+		length = fp->length - offset;
+
+	while (done < length)
+	{
+		uint32_t sector = fp->start + (offset / 512);
+		uint32_t within = offset % 512;
+		uint32_t n = length - done;
+		int ok;
+
+		if (within || (n < 512) || ((uintptr_t)buffer & 3))
+		{
+			/* Partial or misaligned sector. */
+
+			if (n > (512 - within))
+				n = 512 - within;
+
+			ok = mmc_raw_read(sector, bounce, 1);
+			if (ok && writing)
+			{
+				memcpy((uint8_t*)bounce + within, buffer, n);
+				ok = mmc_raw_write(sector, bounce, 1);
+			}
+			else if (ok)
+				memcpy(buffer, (uint8_t*)bounce + within, n);
+			count_stat(STAT_DISK_SECTORS_READ, 1);
+			if (writing)
+				count_stat(STAT_DISK_SECTORS_WRITTEN, 1);
+		}
+		else
+		{
+			uint32_t count = n / 512;
+			if (count > MAX_RUN)
+				count = MAX_RUN;
+			n = count * 512;
+
+			if (writing)
+			{
+				ok = mmc_raw_write(sector, buffer, count);
+				count_stat(STAT_DISK_SECTORS_WRITTEN, count);
+			}
+			else
+			{
+				ok = mmc_raw_read(sector, buffer, count);
+				count_stat(STAT_DISK_SECTORS_READ, count);
+			}
+		}
+
+		if (!ok)
+		{
+			setError("card %s failed at sector 0x%x",
+				writing ? "write" : "read", sector);
+			break;
+		}
+
+		buffer += n;
+		offset += n;
+		done += n;
+	}
+
+	return done;
+}
+
+static uint32_t read_cb(void* backend,
+		uint32_t offset, void* buffer, uint32_t length)
+{
+	return transfer(backend, offset, buffer, length, 0);
+}
+
+static uint32_t write_cb(void* backend,
+		uint32_t offset, void* buffer, uint32_t length)
+{
+	struct blkfile* fp = backend;
+
+	if (!fp->written)
+	{
+		vfs_sd_flush();
+		if (error)
+			return 0;
+		fp->written = 1;
+	}
+	return transfer(fp, offset, buffer, length, 1);
+}
+
+static void info_cb(void* backend,
+		uint32_t* base, uint32_t* length)
+{
+	struct blkfile* fp = backend;
+
+	*base = 0;
+	*length = fp->length;
+}
+
+/* Lists the card's partitions. */
+
+static void enumerate_cb(const char* path, vfs_enumerate_f* cb)
+{
+	char name[2];
+	int i;
+
+	if (*path && (strcmp(path, "/") != 0))
+	{
+		setError("blk: has no directories");
+		return;
+	}
+
+	vfs_sd_init();
+	if (!mmc_raw_sectors())
+	{
+		setError("no card present");
+		return;
+	}
+
+	for (i=1; i<=4; i++)
+	{
+		uint32_t start, sectors;
+
+		if (!read_partition(i, &start, &sectors))
+		{
+			clearError();
+			continue;
+		}
+
+		name[0] = '0' + i;
+		name[1] = '\0';
+		cb(name, 0, (sectors >= 0x800000) ? 0xfffffe00 : (sectors * 512));
+	}
+}
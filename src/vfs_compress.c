@@ -0,0 +1,1228 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+
+/* Read-only filesystems which decompress another file on the fly:
+ * lz4:sd:/kernel.lz4 reads an LZ4 frame, gz:sd:/initrd.gz a gzip file.
+ * Any other path can be stacked underneath.
+ *
+ * The data is decoded as a stream. A read which carries on from where the
+ * last one stopped, and wants at least a window's worth, is decoded
+ * straight into the caller's buffer, and matches are copied from there;
+ * so reading a whole file into memory needs nothing but a small input
+ * buffer. Other reads go through a ring buffer holding the last window's
+ * worth of output (64kB for LZ4, 32kB for gzip), which is all the history
+ * either format can refer back to; it's only allocated when first needed,
+ * and kept up to date after direct reads. Reading backwards past the start
+ * of the window means starting again from the beginning of the file.
+ *
+ * Decoding always runs forwards from the start, so the checksums in the
+ * stream (gzip's CRC32 and length, LZ4's header, block and content
+ * checksums) are kept up as the data goes past, and checked when the end
+ * of the stream is reached. */
+
+#define INPUT_SIZE 4096
+
+struct zfile;
+
+struct codec
+{
+	const char* name;
+	int window_bits;
+	int (*start)(struct zfile* zf);
+	int (*step)(struct zfile* zf);
+	void (*checksum)(struct zfile* zf, const uint8_t* data, uint32_t len);
+};
+
+/* xxHash32 (with a seed of 0), as used by LZ4 frames. */
+
+struct xxh32
+{
+	uint32_t v[4];
+	uint32_t total;
+	int large;
+	uint8_t mem[16];
+	uint32_t memsize;
+};
+
+struct huffman
+{
+	uint16_t count[16];
+	uint16_t symbol[288];
+};
+
+struct zfile
+{
+	const struct codec* codec;
+	struct file* inner;
+	uint32_t inpos;
+	uint32_t inhead;
+	uint32_t intail;
+	int hashing; /* whether consumed input is being hashed (LZ4 blocks) */
+	uint32_t inmark; /* consumed input before here has been hashed */
+	uint8_t input[INPUT_SIZE];
+
+	uint8_t* window; /* NULL until a read needs it */
+	uint32_t mask;
+	uint8_t* direct; /* the caller's buffer, when decoding into it */
+	uint32_t direct_base; /* the output position of direct[0] */
+	uint32_t outpos;
+	uint32_t sumpos; /* output before here has been checksummed */
+	uint32_t length;
+	int length_known;
+
+	/* Output which has been decoded but not yet produced: literal bytes
+	 * to be copied from the input, then a match from the window. */
+	uint32_t lit_len;
+	uint32_t copy_len;
+	uint32_t copy_dist;
+
+	int finished;
+	int bad;
+
+	union
+	{
+		struct
+		{
+			int state;
+			int flags;
+			int match;
+			uint32_t block_left;
+			struct xxh32 content;
+			struct xxh32 block;
+		}
+		lz4;
+
+		struct
+		{
+			int mode;
+			int last;
+			uint32_t bitbuf;
+			int bitcnt;
+			uint32_t crc;
+			struct huffman lencode;
+			struct huffman distcode;
+		}
+		inflate;
+	}
+	u;
+};
+
+static void* lz4_open_cb(const char* path, int flags);
+static void* gz_open_cb(const char* path, int flags);
+static void close_cb(void* backend);
+static uint32_t read_cb(void* backend,
+		uint32_t offset, void* buffer, uint32_t length);
+static uint32_t write_cb(void* backend,
+		uint32_t offset, void* buffer, uint32_t length);
+static void info_cb(void* backend,
+		uint32_t* base, uint32_t* length);
+
+static const struct filecbs filecbs_compress =
+{
+	close_cb,
+	read_cb,
+	write_cb,
+	info_cb
+};
+
+const struct vfs vfs_lz4 =
+{
+	"lz4",
+	&filecbs_compress,
+
+	lz4_open_cb,
+	NULL
+};
+
+const struct vfs vfs_gz =
+{
+	"gz",
+	&filecbs_compress,
+
+	gz_open_cb,
+	NULL
+};
+
+static void corrupt(struct zfile* zf)
+{
+	if (!error)
+		setError("%s data is corrupt or truncated (near input offset %x)",
+			zf->codec->name, zf->inpos - (zf->intail - zf->inhead));
+	zf->bad = 1;
+}
+
+#define PRIME32_1 2654435761UL
+#define PRIME32_2 2246822519UL
+#define PRIME32_3 3266489917UL
+#define PRIME32_4 668265263UL
+#define PRIME32_5 374761393UL
+
+static uint32_t rotl32(uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t le32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | ((uint32_t) p[2] << 16) |
+		((uint32_t) p[3] << 24);
+}
+
+static void xxh32_init(struct xxh32* s)
+{
+	s->v[0] = PRIME32_1;
+	s->v[0] += PRIME32_2;
+	s->v[1] = PRIME32_2;
+	s->v[2] = 0;
+	s->v[3] = 0;
+	s->v[3] -= PRIME32_1;
+	s->total = 0;
+	s->large = 0;
+	s->memsize = 0;
+}
+
+static void xxh32_stripe(struct xxh32* s, const uint8_t* p)
+{
+	int i;
+
+	for (i=0; i<4; i++)
+	{
+		s->v[i] += le32(p + i*4) * PRIME32_2;
+		s->v[i] = rotl32(s->v[i], 13) * PRIME32_1;
+	}
+}
+
+static void xxh32_update(struct xxh32* s, const uint8_t* p, uint32_t len)
+{
+	s->total += len;
+	if ((len >= 16) || (s->total >= 16))
+		s->large = 1;
+
+	if ((s->memsize + len) < 16)
+	{
+		memcpy(s->mem + s->memsize, p, len);
+		s->memsize += len;
+		return;
+	}
+
+	if (s->memsize)
+	{
+		uint32_t n = 16 - s->memsize;
+
+		memcpy(s->mem + s->memsize, p, n);
+		xxh32_stripe(s, s->mem);
+		p += n;
+		len -= n;
+	}
+
+	while (len >= 16)
+	{
+		xxh32_stripe(s, p);
+		p += 16;
+		len -= 16;
+	}
+
+	memcpy(s->mem, p, len);
+	s->memsize = len;
+}
+
+static uint32_t xxh32_digest(const struct xxh32* s)
+{
+	const uint8_t* p = s->mem;
+	uint32_t n = s->memsize;
+	uint32_t h;
+
+	if (s->large)
+		h = rotl32(s->v[0], 1) + rotl32(s->v[1], 7) +
+			rotl32(s->v[2], 12) + rotl32(s->v[3], 18);
+	else
+		h = s->v[2] + PRIME32_5;
+	h += s->total;
+
+	while (n >= 4)
+	{
+		h += le32(p) * PRIME32_3;
+		h = rotl32(h, 17) * PRIME32_4;
+		p += 4;
+		n -= 4;
+	}
+	while (n--)
+	{
+		h += *p++ * PRIME32_5;
+		h = rotl32(h, 11) * PRIME32_1;
+	}
+
+	h ^= h >> 15;
+	h *= PRIME32_2;
+	h ^= h >> 13;
+	h *= PRIME32_3;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Input. */
+
+static void hash_input(struct zfile* zf)
+{
+	if (zf->hashing)
+		xxh32_update(&zf->u.lz4.block, zf->input + zf->inmark,
+			zf->inhead - zf->inmark);
+	zf->inmark = zf->inhead;
+}
+
+static int refill(struct zfile* zf)
+{
+	uint32_t r;
+
+	hash_input(zf);
+	r = vfs_read(zf->inner, zf->inpos, zf->input, INPUT_SIZE);
+	zf->inpos += r;
+	zf->inhead = zf->inmark = 0;
+	zf->intail = r;
+	return r;
+}
+
+static int get_byte(struct zfile* zf)
+{
+	if ((zf->inhead == zf->intail) && !refill(zf))
+	{
+		corrupt(zf);
+		return 0;
+	}
+	return zf->input[zf->inhead++];
+}
+
+static uint32_t get_le32(struct zfile* zf)
+{
+	uint32_t v = get_byte(zf);
+	v |= get_byte(zf) << 8;
+	v |= get_byte(zf) << 16;
+	v |= (uint32_t) get_byte(zf) << 24;
+	return v;
+}
+
+static void skip_bytes(struct zfile* zf, uint32_t count)
+{
+	while (count-- && !zf->bad)
+		get_byte(zf);
+}
+
+/* Output. */
+
+static uint8_t* output(struct zfile* zf, uint32_t pos)
+{
+	if (zf->direct && (pos >= zf->direct_base))
+		return zf->direct + (pos - zf->direct_base);
+	return zf->window + (pos & zf->mask);
+}
+
+static void put_byte(struct zfile* zf, uint8_t b)
+{
+	*output(zf, zf->outpos) = b;
+	zf->outpos++;
+}
+
+/* Feeds everything produced since last time to the codec's checksum. This
+ * has to happen before the window wraps round onto it. */
+
+static void checksum(struct zfile* zf)
+{
+	while (zf->sumpos != zf->outpos)
+	{
+		uint32_t n = zf->outpos - zf->sumpos;
+
+		if (!zf->direct || (zf->sumpos < zf->direct_base))
+		{
+			uint32_t o = zf->sumpos & zf->mask;
+			if (n > (zf->mask + 1 - o))
+				n = zf->mask + 1 - o;
+		}
+		zf->codec->checksum(zf, output(zf, zf->sumpos), n);
+		zf->sumpos += n;
+	}
+}
+
+/* Produces pending output, and decodes more, until at least limit bytes
+ * have been produced or the stream ends. */
+
+static void produce(struct zfile* zf, uint32_t limit)
+{
+	uint32_t half = (zf->mask + 1) / 2;
+
+	while (!zf->bad && (zf->outpos < limit))
+	{
+		uint32_t want = limit - zf->outpos;
+
+		if ((zf->outpos - zf->sumpos) >= half)
+			checksum(zf);
+
+		if (zf->lit_len)
+		{
+			uint32_t o = zf->outpos & zf->mask;
+			uint32_t n = zf->lit_len;
+
+			if ((zf->inhead == zf->intail) && !refill(zf))
+			{
+				corrupt(zf);
+				return;
+			}
+			if (n > (zf->intail - zf->inhead))
+				n = zf->intail - zf->inhead;
+			if (n > want)
+				n = want;
+			if (!zf->direct && (n > (zf->mask + 1 - o)))
+				n = zf->mask + 1 - o;
+
+			memcpy(output(zf, zf->outpos), zf->input + zf->inhead, n);
+			zf->inhead += n;
+			zf->outpos += n;
+			zf->lit_len -= n;
+		}
+		else if (zf->copy_len)
+		{
+			uint32_t n = zf->copy_len;
+			uint32_t from = zf->outpos - zf->copy_dist;
+
+			if (n > want)
+				n = want;
+			if (!zf->direct && (n > half))
+				n = half;
+			zf->copy_len -= n;
+			while (n--)
+				put_byte(zf, *output(zf, from++));
+		}
+		else if (zf->finished)
+			break;
+		else if (!zf->codec->step(zf))
+			zf->bad = 1;
+	}
+	checksum(zf);
+
+	/* Once all the data is out, read the rest of the stream so that its
+	 * checksums get checked. */
+
+	while (!zf->bad && !zf->finished && zf->length_known &&
+	       (zf->outpos == zf->length))
+	{
+		if (zf->lit_len || zf->copy_len)
+			corrupt(zf);
+		else if (!zf->codec->step(zf))
+			zf->bad = 1;
+	}
+}
+
+/* Called at the end of the stream to check that it has produced the right
+ * amount of data. */
+
+static void check_length(struct zfile* zf)
+{
+	if (zf->length_known && (zf->outpos != zf->length))
+	{
+		if (!error)
+			setError("%s data is %u bytes long, not the %u it claims",
+				zf->codec->name, (unsigned) zf->outpos,
+				(unsigned) zf->length);
+		zf->bad = 1;
+	}
+}
+
+static void check_sum(struct zfile* zf, const char* what,
+	uint32_t expected, uint32_t actual)
+{
+	if (expected != actual)
+	{
+		if (!error)
+			setError("%s %s is wrong (%08x, should be %08x)", zf->codec->name,
+				what, (unsigned) actual, (unsigned) expected);
+		zf->bad = 1;
+	}
+}
+
+static void set_match(struct zfile* zf, uint32_t len, uint32_t dist)
+{
+	if ((dist == 0) || (dist > zf->outpos) || (dist > (zf->mask + 1)))
+	{
+		corrupt(zf);
+		return;
+	}
+	zf->copy_len = len;
+	zf->copy_dist = dist;
+}
+
+/* LZ4 frame format. */
+
+enum
+{
+	LZ4_MAGIC = 0x184d2204,
+	LZ4_LEGACY_MAGIC = 0x184c2102,
+
+	LZ4_BLOCK_CHECKSUM = 1<<4,
+	LZ4_CONTENT_SIZE = 1<<3,
+	LZ4_CONTENT_CHECKSUM = 1<<2,
+	LZ4_DICTIONARY = 1<<0,
+
+	LZ4_BLOCK_HEADER = 0,
+	LZ4_TOKEN,
+	LZ4_MATCH
+};
+
+static int lz4_start(struct zfile* zf)
+{
+	uint32_t magic = get_le32(zf);
+	uint8_t desc[10]; /* the frame descriptor, for its checksum */
+	struct xxh32 h;
+	int flags;
+	int i, n;
+
+	if (magic == LZ4_LEGACY_MAGIC)
+	{
+		setError("legacy lz4 files are not supported (compress without -l)");
+		return 0;
+	}
+	if (magic != LZ4_MAGIC)
+		goto bad;
+
+	flags = desc[0] = get_byte(zf);
+	desc[1] = get_byte(zf); /* block maximum size; irrelevant here */
+	if ((flags >> 6) != 1)
+		goto bad;
+	if (flags & LZ4_DICTIONARY)
+	{
+		setError("lz4 files with dictionaries are not supported");
+		return 0;
+	}
+
+	n = 2;
+	if (flags & LZ4_CONTENT_SIZE)
+	{
+		for (i=0; i<8; i++)
+			desc[n++] = get_byte(zf);
+		zf->length = le32(desc+2);
+		if (le32(desc+6))
+		{
+			setError("lz4 file is too big");
+			return 0;
+		}
+		zf->length_known = 1;
+	}
+	if (zf->bad)
+		goto bad;
+
+	xxh32_init(&h);
+	xxh32_update(&h, desc, n);
+	check_sum(zf, "header checksum", get_byte(zf),
+		(xxh32_digest(&h) >> 8) & 0xff);
+	if (zf->bad)
+		return 0;
+
+	zf->u.lz4.flags = flags;
+	zf->u.lz4.state = LZ4_BLOCK_HEADER;
+	xxh32_init(&zf->u.lz4.content);
+	return 1;
+
+bad:
+	if (!error)
+		setError("not an lz4 file");
+	return 0;
+}
+
+static int lz4_byte(struct zfile* zf)
+{
+	if (!zf->u.lz4.block_left)
+	{
+		corrupt(zf);
+		return 0;
+	}
+	zf->u.lz4.block_left--;
+	return get_byte(zf);
+}
+
+static uint32_t lz4_length(struct zfile* zf, uint32_t len)
+{
+	if (len == 15)
+	{
+		int b;
+		do
+		{
+			b = lz4_byte(zf);
+			len += b;
+		}
+		while ((b == 255) && !zf->bad);
+	}
+	return len;
+}
+
+static int lz4_step(struct zfile* zf)
+{
+	uint32_t len;
+
+	switch (zf->u.lz4.state)
+	{
+		case LZ4_BLOCK_HEADER:
+			len = get_le32(zf);
+			if (len == 0)
+			{
+				check_length(zf);
+				if (zf->u.lz4.flags & LZ4_CONTENT_CHECKSUM)
+				{
+					uint32_t sum = get_le32(zf);
+
+					checksum(zf);
+					if (!zf->bad)
+						check_sum(zf, "content checksum", sum,
+							xxh32_digest(&zf->u.lz4.content));
+				}
+				zf->finished = 1;
+				break;
+			}
+
+			if (zf->u.lz4.flags & LZ4_BLOCK_CHECKSUM)
+			{
+				xxh32_init(&zf->u.lz4.block);
+				zf->inmark = zf->inhead;
+				zf->hashing = 1;
+			}
+
+			if (len & 0x80000000)
+			{
+				/* Uncompressed block. */
+				zf->lit_len = len & 0x7fffffff;
+				zf->u.lz4.block_left = 0;
+			}
+			else
+				zf->u.lz4.block_left = len;
+			zf->u.lz4.state = LZ4_TOKEN;
+			break;
+
+		case LZ4_TOKEN:
+			if (!zf->u.lz4.block_left)
+			{
+				if (zf->u.lz4.flags & LZ4_BLOCK_CHECKSUM)
+				{
+					hash_input(zf);
+					zf->hashing = 0;
+					check_sum(zf, "block checksum", get_le32(zf),
+						xxh32_digest(&zf->u.lz4.block));
+				}
+				zf->u.lz4.state = LZ4_BLOCK_HEADER;
+				break;
+			}
+
+			len = lz4_byte(zf);
+			zf->u.lz4.match = len & 15;
+			len = lz4_length(zf, len >> 4);
+			if (len > zf->u.lz4.block_left)
+			{
+				corrupt(zf);
+				break;
+			}
+			zf->lit_len = len;
+			zf->u.lz4.block_left -= len;
+
+			/* The last sequence of a block has no match. */
+			if (zf->u.lz4.block_left)
+				zf->u.lz4.state = LZ4_MATCH;
+			break;
+
+		case LZ4_MATCH:
+		{
+			uint32_t dist = lz4_byte(zf);
+			dist |= lz4_byte(zf) << 8;
+			len = lz4_length(zf, zf->u.lz4.match) + 4;
+			if (!zf->bad)
+				set_match(zf, len, dist);
+			zf->u.lz4.state = LZ4_TOKEN;
+			break;
+		}
+	}
+
+	return !zf->bad;
+}
+
+static void lz4_checksum(struct zfile* zf, const uint8_t* data, uint32_t len)
+{
+	if (zf->u.lz4.flags & LZ4_CONTENT_CHECKSUM)
+		xxh32_update(&zf->u.lz4.content, data, len);
+}
+
+/* Deflate, wrapped in gzip. The Huffman decoder is the simple canonical
+ * one from zlib's puff.c, which needs no lookup tables. */
+
+enum
+{
+	INFLATE_HEADER = 0,
+	INFLATE_HUFFMAN,
+
+	GZ_FHCRC = 1<<1,
+	GZ_FEXTRA = 1<<2,
+	GZ_FNAME = 1<<3,
+	GZ_FCOMMENT = 1<<4
+};
+
+static const uint16_t length_base[29] =
+{
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t length_extra[29] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] =
+{
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] =
+{
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const uint8_t codelength_order[19] =
+{
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static uint32_t get_bits(struct zfile* zf, int need)
+{
+	uint32_t v;
+
+	while (zf->u.inflate.bitcnt < need)
+	{
+		zf->u.inflate.bitbuf |= (uint32_t) get_byte(zf) << zf->u.inflate.bitcnt;
+		zf->u.inflate.bitcnt += 8;
+	}
+
+	v = zf->u.inflate.bitbuf & ((1UL << need) - 1);
+	zf->u.inflate.bitbuf >>= need;
+	zf->u.inflate.bitcnt -= need;
+	return v;
+}
+
+/* Builds a decoding table from a list of code lengths. Incomplete codes
+ * are allowed (a lone distance code is legal); oversubscribed ones
+ * aren't. */
+
+static int construct(struct huffman* h, const uint8_t* lengths, int n)
+{
+	uint16_t offs[16];
+	int left = 1;
+	int i;
+
+	memset(h->count, 0, sizeof(h->count));
+	for (i=0; i<n; i++)
+		h->count[lengths[i]]++;
+
+	for (i=1; i<16; i++)
+	{
+		left = (left << 1) - h->count[i];
+		if (left < 0)
+			return 0;
+	}
+
+	offs[1] = 0;
+	for (i=1; i<15; i++)
+		offs[i+1] = offs[i] + h->count[i];
+	for (i=0; i<n; i++)
+		if (lengths[i])
+			h->symbol[offs[lengths[i]]++] = i;
+	return 1;
+}
+
+static int decode(struct zfile* zf, const struct huffman* h)
+{
+	int code = 0;
+	int first = 0;
+	int index = 0;
+	int len;
+
+	for (len=1; len<16; len++)
+	{
+		int count = h->count[len];
+
+		code |= get_bits(zf, 1);
+		if ((code - count) < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	corrupt(zf);
+	return 0;
+}
+
+static int fixed_tables(struct zfile* zf)
+{
+	uint8_t lengths[288];
+	int i;
+
+	for (i=0; i<144; i++)
+		lengths[i] = 8;
+	for (; i<256; i++)
+		lengths[i] = 9;
+	for (; i<280; i++)
+		lengths[i] = 7;
+	for (; i<288; i++)
+		lengths[i] = 8;
+	construct(&zf->u.inflate.lencode, lengths, 288);
+
+	for (i=0; i<30; i++)
+		lengths[i] = 5;
+	construct(&zf->u.inflate.distcode, lengths, 30);
+	return 1;
+}
+
+static int dynamic_tables(struct zfile* zf)
+{
+	uint8_t lengths[288+32];
+	int nlen = get_bits(zf, 5) + 257;
+	int ndist = get_bits(zf, 5) + 1;
+	int ncode = get_bits(zf, 4) + 4;
+	int i;
+
+	if ((nlen > 286) || (ndist > 30))
+		return 0;
+
+	memset(lengths, 0, 19);
+	for (i=0; i<ncode; i++)
+		lengths[codelength_order[i]] = get_bits(zf, 3);
+	if (!construct(&zf->u.inflate.lencode, lengths, 19))
+		return 0;
+
+	i = 0;
+	while ((i < (nlen + ndist)) && !zf->bad)
+	{
+		int sym = decode(zf, &zf->u.inflate.lencode);
+		int len = 0;
+		int repeat;
+
+		if (sym < 16)
+		{
+			lengths[i++] = sym;
+			continue;
+		}
+
+		if (sym == 16)
+		{
+			if (i == 0)
+				return 0;
+			len = lengths[i-1];
+			repeat = 3 + get_bits(zf, 2);
+		}
+		else if (sym == 17)
+			repeat = 3 + get_bits(zf, 3);
+		else
+			repeat = 11 + get_bits(zf, 7);
+
+		if ((i + repeat) > (nlen + ndist))
+			return 0;
+		while (repeat--)
+			lengths[i++] = len;
+	}
+
+	return construct(&zf->u.inflate.lencode, lengths, nlen) &&
+		construct(&zf->u.inflate.distcode, lengths + nlen, ndist);
+}
+
+static int gz_start(struct zfile* zf)
+{
+	uint8_t trailer[4];
+	uint32_t innerlen;
+	int flags;
+
+	if ((get_byte(zf) != 0x1f) || (get_byte(zf) != 0x8b) ||
+	    (get_byte(zf) != 8))
+		goto bad;
+
+	flags = get_byte(zf);
+	skip_bytes(zf, 6); /* mtime, xfl, os */
+	if (flags & GZ_FEXTRA)
+	{
+		uint32_t xlen = get_byte(zf);
+		xlen |= get_byte(zf) << 8;
+		skip_bytes(zf, xlen);
+	}
+	if (flags & GZ_FNAME)
+		while (get_byte(zf) && !zf->bad)
+			;
+	if (flags & GZ_FCOMMENT)
+		while (get_byte(zf) && !zf->bad)
+			;
+	if (flags & GZ_FHCRC)
+		skip_bytes(zf, 2);
+	if (zf->bad)
+		goto bad;
+
+	/* The uncompressed size (modulo 2^32) is in the last four bytes. */
+
+	vfs_info(zf->inner, NULL, &innerlen);
+	if ((innerlen < 4) ||
+	    (vfs_read(zf->inner, innerlen-4, trailer, 4) != 4))
+		goto bad;
+	zf->length = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+		((uint32_t) trailer[3] << 24);
+	zf->length_known = 1;
+
+	zf->u.inflate.mode = INFLATE_HEADER;
+	zf->u.inflate.last = 0;
+	zf->u.inflate.bitbuf = 0;
+	zf->u.inflate.bitcnt = 0;
+	zf->u.inflate.crc = 0;
+	return 1;
+
+bad:
+	if (!error)
+		setError("not a gzip file");
+	return 0;
+}
+
+static int inflate_step(struct zfile* zf)
+{
+	int sym;
+
+	if (zf->u.inflate.mode == INFLATE_HEADER)
+	{
+		if (zf->u.inflate.last)
+		{
+			/* The trailer (CRC32 and length) starts on a byte boundary. */
+			uint32_t crc, size;
+
+			zf->u.inflate.bitbuf = 0;
+			zf->u.inflate.bitcnt = 0;
+			crc = get_le32(zf);
+			size = get_le32(zf);
+			if (zf->bad)
+				return 0;
+
+			checksum(zf);
+			check_length(zf);
+			check_sum(zf, "CRC", crc, zf->u.inflate.crc);
+			if (!zf->bad && (size != zf->outpos))
+				check_sum(zf, "length", size, zf->outpos);
+			zf->finished = 1;
+			return !zf->bad;
+		}
+
+		zf->u.inflate.last = get_bits(zf, 1);
+		switch (get_bits(zf, 2))
+		{
+			case 0: /* stored */
+			{
+				uint32_t len, nlen;
+
+				zf->u.inflate.bitbuf = 0;
+				zf->u.inflate.bitcnt = 0;
+				len = get_byte(zf);
+				len |= get_byte(zf) << 8;
+				nlen = get_byte(zf);
+				nlen |= get_byte(zf) << 8;
+				if (len != (~nlen & 0xffff))
+					corrupt(zf);
+				zf->lit_len = len;
+				break;
+			}
+
+			case 1:
+				fixed_tables(zf);
+				zf->u.inflate.mode = INFLATE_HUFFMAN;
+				break;
+
+			case 2:
+				if (!dynamic_tables(zf))
+					corrupt(zf);
+				zf->u.inflate.mode = INFLATE_HUFFMAN;
+				break;
+
+			default:
+				corrupt(zf);
+		}
+		return !zf->bad;
+	}
+
+	sym = decode(zf, &zf->u.inflate.lencode);
+	if (sym < 256)
+	{
+		/* (Nothing is wanted past the stated length.) */
+		if (zf->outpos == zf->length)
+		{
+			corrupt(zf);
+			return 0;
+		}
+		put_byte(zf, sym);
+	}
+	else if (sym == 256)
+		zf->u.inflate.mode = INFLATE_HEADER;
+	else
+	{
+		uint32_t len, dist;
+
+		sym -= 257;
+		if (sym >= 29)
+		{
+			corrupt(zf);
+			return 0;
+		}
+		len = length_base[sym] + get_bits(zf, length_extra[sym]);
+
+		sym = decode(zf, &zf->u.inflate.distcode);
+		if (sym >= 30)
+		{
+			corrupt(zf);
+			return 0;
+		}
+		dist = dist_base[sym] + get_bits(zf, dist_extra[sym]);
+
+		if (!zf->bad)
+			set_match(zf, len, dist);
+	}
+	return !zf->bad;
+}
+
+static void inflate_checksum(struct zfile* zf, const uint8_t* data,
+	uint32_t len)
+{
+	zf->u.inflate.crc = update_crc32(zf->u.inflate.crc, data, len);
+}
+
+static const struct codec lz4_codec =
+	{ "lz4", 16, lz4_start, lz4_step, lz4_checksum };
+static const struct codec gz_codec =
+	{ "gzip", 15, gz_start, inflate_step, inflate_checksum };
+
+/* The VFS interface. */
+
+static int restart(struct zfile* zf)
+{
+	zf->inpos = 0;
+	zf->inhead = zf->intail = 0;
+	zf->hashing = 0;
+	zf->inmark = 0;
+	zf->outpos = zf->sumpos = 0;
+	zf->lit_len = zf->copy_len = 0;
+	zf->finished = 0;
+	zf->bad = 0;
+	return zf->codec->start(zf) && !zf->bad;
+}
+
+static int alloc_window(struct zfile* zf)
+{
+	zf->window = malloc(zf->mask + 1);
+	if (!zf->window)
+	{
+		setError("not enough memory for the %s window (%u bytes)",
+			zf->codec->name, (unsigned) (zf->mask + 1));
+		return 0;
+	}
+	return 1;
+}
+
+/* Copies output which was decoded straight into the caller's buffer into
+ * the window, as if it had been decoded there; only the last window's
+ * worth matters. */
+
+static void fill_window(struct zfile* zf, const uint8_t* data, uint32_t len)
+{
+	uint32_t pos = zf->outpos - len;
+
+	if (len > (zf->mask + 1))
+	{
+		data += len - (zf->mask + 1);
+		pos += len - (zf->mask + 1);
+		len = zf->mask + 1;
+	}
+
+	while (len)
+	{
+		uint32_t o = pos & zf->mask;
+		uint32_t n = zf->mask + 1 - o;
+
+		if (n > len)
+			n = len;
+		memcpy(zf->window + o, data, n);
+		data += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+static void* open_cb(const struct codec* codec, const char* path, int flags)
+{
+	struct zfile* zf;
+
+	if (flags != O_RDONLY)
+	{
+		setError("%s: files can only be read", codec->name);
+		return NULL;
+	}
+
+	zf = calloc(1, sizeof(struct zfile));
+	if (!zf)
+	{
+		setError("out of memory");
+		return NULL;
+	}
+	zf->codec = codec;
+	zf->mask = (1UL << codec->window_bits) - 1;
+	zf->inner = vfs_open(path, O_RDONLY);
+	if (!zf->inner)
+		goto error;
+
+	if (!restart(zf))
+		goto error;
+
+	/* Without a stored length, the only way to find it out is to
+	 * decompress the whole thing. */
+	if (!zf->length_known)
+	{
+		if (!alloc_window(zf))
+			goto error;
+		produce(zf, 0xffffffff);
+		if (zf->bad)
+			goto error;
+		zf->length = zf->outpos;
+		zf->length_known = 1;
+		if (!restart(zf))
+			goto error;
+	}
+	return zf;
+
+error:
+	close_cb(zf);
+	return NULL;
+}
+
+static void* lz4_open_cb(const char* path, int flags)
+{
+	return open_cb(&lz4_codec, path, flags);
+}
+
+static void* gz_open_cb(const char* path, int flags)
+{
+	return open_cb(&gz_codec, path, flags);
+}
+
+static void close_cb(void* backend)
+{
+	struct zfile* zf = backend;
+
+	if (zf->inner)
+		vfs_close(zf->inner);
+	free(zf->window);
+	free(zf);
+}
+
+static uint32_t read_cb(void* backend,
+		uint32_t offset, void* buffer, uint32_t length)
+{
+	struct zfile* zf = backend;
+	uint8_t* dest = buffer;
+	uint32_t window = zf->mask + 1;
+	uint32_t done = 0;
+
+	if (offset >= zf->length)
+		return 0;
+	if (length > (zf->length - offset))
+		length = zf->length - offset;
+
+	/* Only a read of the whole file in one go can do without a window;
+	 * anything after that has to start again with one. */
+
+	if (!zf->window && (offset || (length < zf->length) || zf->outpos))
+	{
+		if (!alloc_window(zf))
+			return 0;
+		if (zf->outpos && !restart(zf))
+			return 0;
+	}
+
+	if (((zf->outpos > window) && (offset < (zf->outpos - window))) ||
+	    zf->bad)
+	{
+		if (!restart(zf))
+			return 0;
+	}
+
+	while (done < length)
+	{
+		uint32_t pos = offset + done;
+
+		if (pos < zf->outpos)
+		{
+			/* Copy out of the window, in up to two pieces. */
+			uint32_t n = zf->outpos - pos;
+			uint32_t o = pos & zf->mask;
+
+			if (n > (length - done))
+				n = length - done;
+			if (n > (window - o))
+				n = window - o;
+			memcpy(dest + done, zf->window + o, n);
+			done += n;
+		}
+		else if ((pos == zf->outpos) &&
+		         (!zf->window || ((length - done) >= window)))
+		{
+			/* Decode straight into the caller's buffer. */
+			uint32_t n;
+
+			zf->direct = dest + done;
+			zf->direct_base = pos;
+			produce(zf, offset + length);
+			zf->direct = NULL;
+
+			n = zf->outpos - pos;
+			if (zf->window)
+				fill_window(zf, dest + done, n);
+			done += n;
+			if (!n)
+				break;
+		}
+		else
+		{
+			/* Decode at most half a window ahead, so that nothing
+			 * wanted gets overwritten before it's copied. */
+			uint32_t limit = pos + window/2;
+
+			if ((limit < pos) || (limit > (offset + length)))
+				limit = offset + length;
+			produce(zf, limit);
+			if (zf->outpos <= pos)
+				break;
+		}
+	}
+
+	if (!done && !error)
+		corrupt(zf);
+	return done;
+}
+
+static uint32_t write_cb(void* backend,
+		uint32_t offset, void* buffer, uint32_t length)
+{
+	struct zfile* zf = backend;
+
+	setError("%s: files can only be read", zf->codec->name);
+	return 0;
+}
+
+static void info_cb(void* backend,
+		uint32_t* base, uint32_t* length)
+{
+	struct zfile* zf = backend;
+
+	*base = 0;
+	*length = zf->length;
+}
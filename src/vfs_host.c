@@ -17,13 +17,15 @@ static uint32_t write_cb(void* backend,
 		uint32_t offset, void* buffer, uint32_t length);
 static void info_cb(void* backend,
 		uint32_t* base, uint32_t* length);
+static void truncate_cb(void* backend, uint32_t length);
 
 const struct filecbs filecbs_host =
 {
 	close_cb,
 	read_cb,
 	write_cb,
-	info_cb
+	info_cb,
+	truncate_cb
 };
 
 const struct vfs vfs_host =
@@ -37,7 +39,14 @@ const struct vfs vfs_host =
 
 static void* open_cb(const char* path, int flags)
 {
-	FILE* fp = fopen(path, (flags==O_RDONLY) ? "r" : "w+");
+	const char* mode = "w+";
+	FILE* fp;
+
+	if (flags == O_RDONLY)
+		mode = "r";
+	else if (flags == O_RDWR)
+		mode = "r+";
+	fp = fopen(path, mode);
 	if (!fp)
 		setError("host error %d", errno);
 	return fp;
@@ -74,5 +83,13 @@ static void info_cb(void* backend,
 	*length = ftell(fp);
 }
 
+static void truncate_cb(void* backend, uint32_t length)
+{
+	FILE* fp = backend;
+	fflush(fp);
+	if (ftruncate(fileno(fp), length) != 0)
+		setError("host error %d", errno);
+}
+
 #endif
 
@@ -67,7 +67,7 @@ static void* open_cb(const char* path, int flags)
 			return NULL;
 		}
 
-		if (flags == O_RDONLY)
+		if (flags != O_WRONLY)
 		{
 			setError("mem: paths with no length cannot be used for reading");
 			return NULL;
@@ -125,3 +125,17 @@ static void info_cb(void* backend,
 	*length = fp->length;
 }
 
+/* If fp is a mem: file, returns where it is (and sets *length), so that it
+ * can be read into directly; otherwise returns NULL. */
+
+uint8_t* vfs_mem_address(struct file* fp, uint32_t* length)
+{
+	struct memfile* mf;
+
+	if (fp->cb != &filecbs_mem)
+		return NULL;
+	mf = fp->backend;
+	*length = mf->length;
+	return (uint8_t*)(uintptr_t) mf->start;
+}
+
@@ -11,7 +11,8 @@
 static FATFS fatfs;
 static int inited = 0;
 
-static void* open_cb(const char* path, int flags);
+static void* sd_open_cb(const char* path, int flags);
+static void* ram_open_cb(const char* path, int flags);
 static void close_cb(void* backend);
 static uint32_t read_cb(void* backend,
 		uint32_t offset, void* buffer, uint32_t length);
@@ -19,23 +20,45 @@ static uint32_t write_cb(void* backend,
 		uint32_t offset, void* buffer, uint32_t length);
 static void info_cb(void* backend,
 		uint32_t* base, uint32_t* length);
-static void enumerate_cb(const char* path, vfs_enumerate_f* cb);
-
-const struct filecbs filecbs_sd =
+static void truncate_cb(void* backend, uint32_t length);
+static void sd_enumerate_cb(const char* path, vfs_enumerate_f* cb);
+static void ram_enumerate_cb(const char* path, vfs_enumerate_f* cb);
+static void sd_enumerate_batch_cb(const char* path, vfs_batch_f* cb,
+		void* context);
+static void ram_enumerate_batch_cb(const char* path, vfs_batch_f* cb,
+		void* context);
+
+/* Both FatFs volumes share the same file callbacks; only the way a path is
+ * resolved differs. The SD card is drive 0, FatFs's default, and the RAM
+ * disk is drive 1. */
+
+const struct filecbs filecbs_fat =
 {
 	close_cb,
 	read_cb,
 	write_cb,
-	info_cb
+	info_cb,
+	truncate_cb
 };
 
 const struct vfs vfs_sd =
 {
 	"sd",
-	&filecbs_sd,
+	&filecbs_fat,
+
+	sd_open_cb,
+	sd_enumerate_cb,
+	sd_enumerate_batch_cb
+};
 
-	open_cb,
-	enumerate_cb
+const struct vfs vfs_ram =
+{
+	"ram",
+	&filecbs_fat,
+
+	ram_open_cb,
+	ram_enumerate_cb,
+	ram_enumerate_batch_cb
 };
 
 static const char* error_strings[] =
@@ -62,7 +85,7 @@ static const char* error_strings[] =
 	"invalid parameter"
 };
 
-static void init(void)
+void vfs_sd_init(void)
 {
 	if (!inited)
 	{
@@ -81,39 +104,123 @@ void vfs_sd_deinit(void)
 	{
 		printf("[unmounting SD card]\n");
 		f_mount(0, NULL);
+		mmc_deinit();
 		inited = 0;
 	}
 }
 
+/* Writes back whatever FatFs has cached for the card, and makes it read
+ * the card again when next used; for when the card is written to behind
+ * its back (see vfs_blk.c). Open files stay open. */
+
+void vfs_sd_flush(void)
+{
+	FRESULT r;
+
+	if (!inited)
+		return;
+	r = f_flushvol(0);
+	if (r != FR_OK)
+		set_fat_error(r);
+}
+
+void set_fat_error(int r)
+{
+	setError("file system error %d: %s", r, error_strings[r]);
+}
+
 static void malformed(void)
 {
 	setError("malformed mem: path (use forward slashes)");
 }
 
+/* Returns a FatFs path for the RAM disk, which must be freed, or NULL if
+ * there's no RAM disk. */
+
+static char* ram_path(const char* path)
+{
+	char* p;
+
+	if (!ramdisk_present())
+	{
+		setError("there is no RAM disk (see 'help ramdisk')");
+		return NULL;
+	}
+
+	p = malloc(strlen(path) + 3);
+	strcpy(p, "1:");
+	strcat(p, path);
+	return p;
+}
+
+/* Turns an sd: or ram: path into a FatFs one, which must be freed, for
+ * commands which work on the FAT volumes directly. Returns NULL (and sets
+ * the error) for any other filesystem. */
+
+char* fat_path(const char* path)
+{
+	if (strncmp(path, "sd:", 3) == 0)
+	{
+		vfs_sd_init();
+		return strdup(path+3);
+	}
+	if (strncmp(path, "ram:", 4) == 0)
+		return ram_path(path+4);
+
+	setError("'%s' is not on a FAT filesystem (use sd: or ram:)", path);
+	return NULL;
+}
+
 static void* open_cb(const char* path, int flags)
 {
-	FIL* fp = calloc(1, sizeof(FIL));
+	FIL* fp = pool_alloc(&fat_pool);
+	BYTE mode;
     FRESULT r;
 
-    init();
-    r = f_open(fp, path,
-        (flags == O_RDONLY) ? (FA_READ|FA_OPEN_EXISTING) : (FA_WRITE|FA_CREATE_ALWAYS));
+	if (!fp)
+		return NULL;
+	memset(fp, 0, sizeof(FIL));
+	if (flags == O_RDONLY)
+		mode = FA_READ|FA_OPEN_EXISTING;
+	else if (flags == O_RDWR)
+		mode = FA_READ|FA_WRITE|FA_OPEN_EXISTING;
+	else
+		mode = FA_WRITE|FA_CREATE_ALWAYS;
+    r = f_open(fp, path, mode);
 
 	if (r == FR_OK)
 		return fp;
 
-	setError("file system error %d: %s", r, error_strings[r]);
-	free(fp);
+	set_fat_error(r);
+	pool_free(&fat_pool, fp);
 	return NULL;
 }
 
+static void* sd_open_cb(const char* path, int flags)
+{
+	vfs_sd_init();
+	return open_cb(path, flags);
+}
+
+static void* ram_open_cb(const char* path, int flags)
+{
+	char* p = ram_path(path);
+	void* fp;
+
+	if (!p)
+		return NULL;
+	fp = open_cb(p, flags);
+	free(p);
+	return fp;
+}
+
 static void close_cb(void* backend)
 {
 	FIL* fp = backend;
     FRESULT r = f_close(fp);
-    free(fp);
+    pool_free(&fat_pool, fp);
     if (r != FR_OK)
-		setError("file system error %d: %s", r, error_strings[r]);
+		set_fat_error(r);
 }
 
 static uint32_t read_cb(void* backend,
@@ -124,14 +231,14 @@ static uint32_t read_cb(void* backend,
 	FRESULT r = f_lseek(fp, offset);
 	if (r != FR_OK)
 	{
-		setError("file system error %d: %s", r, error_strings[r]);
+		set_fat_error(r);
 		return 0;
 	}
 
 	r = f_read(fp, buffer, length, &br);
     if (r != FR_OK)
     {
-		setError("file system error %d: %s", r, error_strings[r]);
+		set_fat_error(r);
         return 0;
     }
 
@@ -146,14 +253,14 @@ static uint32_t write_cb(void* backend,
 	FRESULT r = f_lseek(fp, offset);
 	if (r != FR_OK)
 	{
-		setError("file system error %d: %s", r, error_strings[r]);
+		set_fat_error(r);
 		return 0;
 	}
 
 	r = f_write(fp, buffer, length, &br);
     if (r != FR_OK)
     {
-		setError("file system error %d: %s", r, error_strings[r]);
+		set_fat_error(r);
         return 0;
     }
 
@@ -169,32 +276,128 @@ static void info_cb(void* backend,
 	*length = f_size(fp);
 }
 
-static void enumerate_cb(const char* path, vfs_enumerate_f* cb)
+/* Directories are read a run of sectors at a time (see f_readdir_batch()),
+ * and handed back DIR_BATCH entries at a time. The buffers are borrowed
+ * from the scratch arena, as the callback may want to scratch_alloc(). */
+
+#define DIR_BATCH 16
+#define DIR_SECTORS 16
+
+struct dirbuf
 {
-	FRESULT r;
-	DIR dir;
-	FILINFO fno;
+	FILINFO info[DIR_BATCH];
+	struct vfs_dirent ents[DIR_BATCH];
+};
 
-	init();
-	r = f_opendir(&dir, path);
-	if (r != FR_OK)
-		goto error;
+static void read_dir(const char* path, vfs_batch_f* cb, void* context)
+{
+	DIR* dir;
+	struct dirbuf* b;
+	void* work;
+	uint32_t bsize, worksize;
+	FILINFO* dirinfo;
+	struct vfs_dirent* dirents;
+	FRESULT r;
+	UINT count, i;
 
-	for (;;)
+	b = scratch_borrow(sizeof(struct dirbuf), sizeof(struct dirbuf), &bsize);
+	if (!b)
+		return;
+	work = scratch_borrow(512, DIR_SECTORS*512, &worksize);
+	if (!work)
 	{
-		memset(&fno, 0, sizeof(fno));
-		r = f_readdir(&dir, &fno);
-		if (r != FR_OK)
-			goto error;
+		scratch_return(b, bsize);
+		return;
+	}
+	dirinfo = b->info;
+	dirents = b->ents;
 
-		if (!fno.fname[0])
+	dir = pool_alloc(&fat_pool);
+	if (!dir)
+	{
+		scratch_return(work, worksize);
+		scratch_return(b, bsize);
+		return;
+	}
+	r = f_opendir(dir, path);
+	while (r == FR_OK)
+	{
+		r = f_readdir_batch(dir, dirinfo, DIR_BATCH, &count,
+			work, worksize);
+		if ((r != FR_OK) || !count)
 			break;
 
-		cb(fno.fname, !!(fno.fattrib & AM_DIR), fno.fsize);
+		for (i=0; i<count; i++)
+		{
+			dirents[i].name = dirinfo[i].fname;
+			dirents[i].isdir = !!(dirinfo[i].fattrib & AM_DIR);
+			dirents[i].length = dirinfo[i].fsize;
+		}
+		cb(dirents, count, context);
 	}
 
-	return;
-error:
-	setError("file system error %d: %s", r, error_strings[r]);
+	pool_free(&fat_pool, dir);
+	scratch_return(work, worksize);
+	scratch_return(b, bsize);
+	if (r != FR_OK)
+		set_fat_error(r);
+}
+
+static void each_entry_cb(const struct vfs_dirent* entries, int count,
+		void* context)
+{
+	vfs_enumerate_f* cb = *(vfs_enumerate_f**) context;
+	int i;
+
+	for (i=0; i<count; i++)
+		cb(entries[i].name, entries[i].isdir, entries[i].length);
+}
+
+static void enumerate_cb(const char* path, vfs_enumerate_f* cb)
+{
+	read_dir(path, each_entry_cb, &cb);
+}
+
+static void sd_enumerate_cb(const char* path, vfs_enumerate_f* cb)
+{
+	vfs_sd_init();
+	enumerate_cb(path, cb);
+}
+
+static void ram_enumerate_cb(const char* path, vfs_enumerate_f* cb)
+{
+	char* p = ram_path(path);
+
+	if (!p)
+		return;
+	enumerate_cb(p, cb);
+	free(p);
+}
+
+static void sd_enumerate_batch_cb(const char* path, vfs_batch_f* cb,
+		void* context)
+{
+	vfs_sd_init();
+	read_dir(path, cb, context);
+}
+
+static void ram_enumerate_batch_cb(const char* path, vfs_batch_f* cb,
+		void* context)
+{
+	char* p = ram_path(path);
+
+	if (!p)
+		return;
+	read_dir(p, cb, context);
+	free(p);
 }
 
+static void truncate_cb(void* backend, uint32_t length)
+{
+	FIL* fp = backend;
+	FRESULT r = f_lseek(fp, length);
+	if (r == FR_OK)
+		r = f_truncate(fp);
+	if (r != FR_OK)
+		set_fat_error(r);
+}
@@ -0,0 +1,250 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+#include "globals.h"
+
+/* Walks a directory tree, for ls -R, du and findfile. Each directory is read
+ * in batches (see vfs_enumerate_batch()) into a list in the scratch arena;
+ * the walker is told about every entry in it, then goes down into the
+ * subdirectories, then is told the directory's total size. Each level's
+ * list is released on the way back up, so only the current path through
+ * the tree is held in memory. */
+
+#define MAX_DEPTH 16
+
+struct node
+{
+	struct node* next;
+	struct vfs_dirent de;
+	char path[1];
+};
+
+struct collection
+{
+	const char* dir;
+	int dirlen;
+	int slash;
+	struct node** tail;
+};
+
+static void collect_cb(const struct vfs_dirent* entries, int count,
+		void* context)
+{
+	struct collection* c = context;
+	int i;
+
+	for (i=0; (i<count) && !error; i++)
+	{
+		const struct vfs_dirent* de = &entries[i];
+		struct node* n;
+
+		if ((strcmp(de->name, ".") == 0) || (strcmp(de->name, "..") == 0))
+			continue;
+
+		n = scratch_alloc(sizeof(struct node) + c->dirlen +
+			strlen(de->name) + 1);
+		if (!n)
+			return;
+
+		memcpy(n->path, c->dir, c->dirlen);
+		if (c->slash)
+			n->path[c->dirlen] = '/';
+		strcpy(n->path + c->dirlen + c->slash, de->name);
+		n->de.name = n->path + c->dirlen + c->slash;
+		n->de.isdir = de->isdir;
+		n->de.length = de->length;
+		n->next = NULL;
+		*c->tail = n;
+		c->tail = &n->next;
+	}
+}
+
+/* Returns the size of everything under path, in kB. */
+
+static uint32_t walk_dir(struct walker* w, const char* path, int depth)
+{
+	uint32_t mark = scratch_mark();
+	struct node* list = NULL;
+	struct node* n;
+	struct collection c;
+	uint32_t kb = 0;
+
+	c.dir = path;
+	c.dirlen = strlen(path);
+	c.slash = c.dirlen &&
+		(path[c.dirlen-1] != '/') && (path[c.dirlen-1] != ':');
+	c.tail = &list;
+
+	if (w->enter)
+		w->enter(w, path);
+	vfs_enumerate_batch(path, collect_cb, &c);
+	w->dirs++;
+
+	for (n = list; n && !error; n = n->next)
+	{
+		if (!n->de.isdir)
+		{
+			w->files++;
+			kb += (n->de.length / 1024) + !!(n->de.length % 1024);
+		}
+		if (w->entry)
+			w->entry(w, n->path, &n->de);
+	}
+
+	for (n = list; n && !error; n = n->next)
+	{
+		if (!n->de.isdir)
+			continue;
+		if (depth == MAX_DEPTH)
+		{
+			setError("%s is nested too deeply (the limit is %d)", n->path,
+				MAX_DEPTH);
+			break;
+		}
+		kb += walk_dir(w, n->path, depth+1);
+	}
+
+	if (!error && w->leave)
+		w->leave(w, path, kb);
+	scratch_release(mark);
+	yield();
+	return kb;
+}
+
+/* The root is walked as "ram:/" rather than "ram:", so that everything
+ * under it gets a separator, and without any other trailing slash. */
+
+uint32_t walk_tree(struct walker* w, const char* path)
+{
+	uint32_t mark = scratch_mark();
+	int len = strlen(path);
+	char* root = scratch_alloc(len + 2);
+	uint32_t kb = 0;
+
+	w->dirs = w->files = 0;
+	if (!root)
+		return 0;
+	strcpy(root, path);
+	if (len && (path[len-1] == ':'))
+		strcat(root, "/");
+	else if ((len >= 2) && (path[len-1] == '/') && (path[len-2] != ':'))
+		root[len-1] = '\0';
+
+	kb = walk_dir(w, root, 0);
+	scratch_release(mark);
+	return kb;
+}
+
+static void du_leave(struct walker* w, const char* path, uint32_t kb)
+{
+	printf("%10u kB  %s\n", (unsigned) kb, path);
+}
+
+static void du_cb(int argc, const char* argv[])
+{
+	struct walker w;
+	int summary = 0;
+	int i;
+
+	if ((argc > 1) && (strcmp(argv[1], "-s") == 0))
+	{
+		summary = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2)
+	{
+		setError("syntax: du [-s] <dir...>");
+		return;
+	}
+
+	memset(&w, 0, sizeof(w));
+	if (!summary)
+		w.leave = du_leave;
+	for (i=1; (i<argc) && !error; i++)
+	{
+		uint32_t kb = walk_tree(&w, argv[i]);
+		if (!error && summary)
+			printf("%10u kB  %s (%u files)\n", (unsigned) kb, argv[i],
+				(unsigned) w.files);
+	}
+}
+
+const struct command du_cmd =
+{
+	"du",
+	"shows how much space directory trees use",
+
+	"Syntax:\n"
+	"  du [-s] <dir...>\n"
+	"Adds up the sizes of the files under each directory, and shows the\n"
+	"total for every directory in the tree (or, with -s, just the total and\n"
+	"the number of files). Sizes are in kB, rounded up per file.",
+
+	du_cb
+};
+
+/* Lists the files in a tree whose names match a pattern. */
+
+struct search
+{
+	const char* pattern;
+	uint32_t found;
+};
+
+static void find_entry(struct walker* w, const char* path,
+		const struct vfs_dirent* de)
+{
+	struct search* s = w->context;
+
+	if (match_glob(s->pattern, de->name))
+	{
+		printf("%s%s\n", path, de->isdir ? "/" : "");
+		s->found++;
+	}
+}
+
+static void findfile_cb(int argc, const char* argv[])
+{
+	struct walker w;
+	struct search s;
+	uint32_t start, ms;
+
+	if ((argc < 2) || (argc > 3))
+	{
+		setError("syntax: findfile <dir> [<pattern>]");
+		return;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.entry = find_entry;
+	w.context = &s;
+	s.pattern = (argc == 3) ? argv[2] : "*";
+	s.found = 0;
+
+	start = read_timer();
+	walk_tree(&w, argv[1]);
+	ms = (read_timer() - start) / 1000;
+	if (!error)
+		printf("%u matches (searched %u files in %u directories in "
+			"%u.%03u s)\n", (unsigned) s.found, (unsigned) w.files,
+			(unsigned) w.dirs, (unsigned) (ms / 1000), (unsigned) (ms % 1000));
+}
+
+const struct command findfile_cmd =
+{
+	"findfile",
+	"searches a directory tree for files",
+
+	"Syntax:\n"
+	"  findfile <dir> [<pattern>]\n"
+	"Lists every file and directory under <dir> whose name matches the\n"
+	"pattern (which may contain * and ? wildcards; the default matches\n"
+	"everything).",
+
+	findfile_cb
+};
@@ -6,9 +6,7 @@
  */
 
 #include "globals.h"
-#ifdef __GNUC__
-#include <sys/time.h>
-#endif
+#include "pack.h"
 #include <termios.h>
 
 static int crc16;
@@ -16,102 +14,251 @@ static uint16_t crc;
 
 static void update_crc(const uint8_t* data, unsigned len)
 {
-	unsigned i;
+	if (crc16)
+		crc = update_crc16(crc, data, len);
+	else
+	{
+		unsigned i;
+
+		for (i=0; i<len; i++)
+			crc += data[i];
+	}
+}
 
-	for (i=0; i<len; i++)
+/* Timeouts, in us. The first one gives the user time to start their
+ * terminal program; after that, the other end is expected to keep up. */
+
+#define START_TIMEOUT 60000000
+#define RESPONSE_TIMEOUT 10000000
+#define BYTE_TIMEOUT 1000000
+
+/* Waits for a byte from the other end; returns -1 on timeout. */
+
+static int read_byte(uint32_t timeout)
+{
+	uint32_t start = read_timer();
+
+	while (!poll_console(10))
 	{
-		uint8_t c = data[i];
+		if (timer_expired(start, timeout))
+			return -1;
+	}
+	return getchar();
+}
 
-		if (crc16)
-		{
-			int j;
+/* Tells the other end we're giving up. */
 
-			crc ^= c<<8;
-			for (j=0; j<8; j++)
-			{
-				if (crc & 0x8000)
-                    crc = (crc << 1) ^ 0x1021;
-                else
-                    crc = (crc << 1);
-			}
-		}
-		else
-			crc += c;
+static void send_cancel(void)
+{
+	putchar(24); /* CAN */
+	putchar(24);
+	fflush(stdout);
+}
+
+static void cancel(void)
+{
+	count_stat(STAT_XMODEM_TIMEOUTS, 1);
+	send_cancel();
+	setError("transfer timed out");
+}
+
+/* Transfers can optionally be packed (see pack.h). When we send, the
+ * receiver asks for a packed transfer by starting with 'Z' instead of 'C';
+ * the user can also ask for one with 'send -z', for use with ordinary
+ * terminal programs, and unpack the result on the host. Those only know
+ * 'C', so when we receive, the user says the stream is packed with
+ * 'recv -z'; it must then start with the magic number. Nothing is ever
+ * unpacked unless asked for. */
+
+static struct
+{
+	int packed;
+	uint32_t offset;
+	uint32_t len;
+	uint8_t* pending;
+	uint32_t pending_len;
+	int finished;
+	uint8_t* chunk;
+}
+source;
+
+/* Packs more of the file onto the end of the pending buffer. */
+
+static void pack_more(struct file* fp)
+{
+	uint8_t* p = source.pending + source.pending_len;
+	uint32_t n = source.len - source.offset;
+
+	if (n == 0)
+	{
+		/* End marker and length. */
+		p[0] = p[1] = 0;
+		p[2] = source.len;
+		p[3] = source.len >> 8;
+		p[4] = source.len >> 16;
+		p[5] = source.len >> 24;
+		source.pending_len += 6;
+		source.finished = 1;
+		return;
+	}
+
+	if (n > PACK_CHUNK_SIZE)
+		n = PACK_CHUNK_SIZE;
+	n = vfs_read(fp, source.offset, source.chunk, n);
+	if (n == 0)
+	{
+		/* The file has got shorter; stop here. */
+		source.len = source.offset;
+		return;
 	}
+	source.offset += n;
+	source.pending_len += pack_chunk(source.chunk, n, p);
 }
 
-static int poll_stdin(void)
+/* Fills the buffer with the next block to send. Returns the block size,
+ * or 0 at the end of the data. */
+
+static uint32_t next_block(struct file* fp, uint8_t* buffer)
 {
-	struct timeval t = {1, 0};
-	fd_set rds, wrs, exs;
-	FD_ZERO(&rds);
-	FD_ZERO(&wrs);
-	FD_ZERO(&exs);
-	FD_SET(0, &rds);
+	uint32_t thisblocklen;
+	uint32_t n;
 
-	fflush(stdout);
-	return select(1, &rds, &wrs, &exs, &t);
+	if (!source.packed)
+	{
+		if (source.offset >= source.len)
+			return 0;
+		n = source.len - source.offset;
+		if (n >= 1024)
+			thisblocklen = 1024;
+		else
+			thisblocklen = 128;
+
+		n = vfs_read(fp, source.offset, buffer, thisblocklen);
+		source.offset += thisblocklen;
+	}
+	else
+	{
+		while ((source.pending_len < 1024) && !source.finished)
+			pack_more(fp);
+		if (source.pending_len == 0)
+			return 0;
+
+		n = source.pending_len;
+		if (n > 1024)
+			n = 1024;
+		thisblocklen = (n > 128) ? 1024 : 128;
+		memcpy(buffer, source.pending, n);
+		source.pending_len -= n;
+		memmove(source.pending, source.pending + n, source.pending_len);
+	}
+
+	if (n < thisblocklen)
+		memset(buffer+n, 26, thisblocklen-n); /* SUB */
+	return thisblocklen;
+}
+
+/* Prints a summary of a transfer: the effective rate and how much the
+ * data shrank on the way. */
+
+static void report(const char* verb, uint32_t bytes, uint32_t wire,
+	uint32_t us)
+{
+	uint32_t ms = us / 1000;
+	uint32_t rate = 0;
+	uint32_t ratio = 0;
+
+	if (ms)
+		rate = (bytes / ms * 1000) + ((bytes % ms) * 1000 / ms);
+	if (wire >= 0x1000000)
+		ratio = bytes / (wire / 100);
+	else if (wire)
+		ratio = (bytes / wire * 100) + ((bytes % wire) * 100 / wire);
+
+	printf("%s %u bytes in %u.%03u s (%u bytes/s); %u bytes on the wire, "
+		"ratio %u.%02u\n",
+		verb, (unsigned) bytes, (unsigned) (ms / 1000), (unsigned) (ms % 1000),
+		(unsigned) rate, (unsigned) wire,
+		(unsigned) (ratio / 100), (unsigned) (ratio % 100));
 }
 
-static void xmodem_send(struct file* fp, int len)
+static void xmodem_send(struct file* fp, uint32_t len, int packed)
 {
 	uint8_t block;
-	uint32_t offset;
 	uint32_t thisblocklen;
 	uint8_t* buffer;
-	uint8_t c;
+	uint32_t timeout;
+	uint32_t start = 0;
+	uint32_t elapsed = 0;
+	uint32_t wire = 0;
+	int c;
+
+	buffer = scratch_alloc(1024);
+	source.pending = scratch_alloc(1024 + PACK_MAX_CHUNK + 6);
+	source.chunk = scratch_alloc(PACK_CHUNK_SIZE);
+	if (!buffer || !source.pending || !source.chunk)
+		return;
 
 	printf("Give your local XMODEM receive command now.\n");
 	fflush(stdout);
 	newlines_off();
 
-	buffer = malloc(1024);
+	source.packed = packed;
+	source.offset = 0;
+	source.len = len;
+	memcpy(source.pending, PACK_MAGIC, PACK_MAGIC_SIZE);
+	source.pending_len = PACK_MAGIC_SIZE;
+	source.finished = 0;
 
 	block = 1;
-	offset = 0;
 	crc16 = 0;
-	if (len >= 1024)
-		thisblocklen = 1024;
-	else
-		thisblocklen = 128;
+	thisblocklen = 0; /* no block read yet */
+	timeout = START_TIMEOUT;
 	for (;;)
 	{
-		int i;
 		fflush(stdout);
-		c = getchar();
+		c = read_byte(timeout);
+		if (c == -1)
+		{
+			cancel();
+			goto exit;
+		}
+		timeout = RESPONSE_TIMEOUT;
 
         switch (c)
         {
+			case 'Z': /* enable CRC-16 mode and packing */
+				if (block == 1)
+					source.packed = 1;
+				/* fall through */
             case 'C': /* enable CRC-16 mode */
                 crc16 = 1;
-                /* fall through */
+                break;
+
 			case 21: /* NAK; repeat current block */
+				count_stat(STAT_XMODEM_NAKS, 1);
                 break;
 
 			case 6: /* ACK; advance to next block */
+				count_stat(STAT_XMODEM_BLOCKS, 1);
 				block++;
-				offset += thisblocklen;
-				if (offset >= len)
-					goto eof;
-
-				thisblocklen = len - offset;
-				if (thisblocklen >= 1024)
-					thisblocklen = 1024;
-				else
-					thisblocklen = 128;
+				wire += thisblocklen;
+				thisblocklen = 0;
 				break;
 
 			default: /* ignore everything else */
 				continue;
         }
 
-		/* Read the block from the file. */
+		/* Read the next block from the file, if we need one. */
 
-		i = vfs_read(fp, offset, buffer, thisblocklen);
-		if (i < thisblocklen)
-			memset(buffer+i, 26, thisblocklen-i); /* SUB */
-
-		/* Calculate CRC. */
+		if (!thisblocklen)
+		{
+			if (block == 1)
+				start = read_timer();
+			thisblocklen = next_block(fp, buffer);
+			if (!thisblocklen)
+				goto eof;
+		}
 
 		crc = 0;
 		update_crc(buffer, thisblocklen);
@@ -137,44 +284,166 @@ eof:
 
 	/* Wait for ACK (we have to block here or the receiver will barf). */
 	fflush(stdout);
-	c = getchar();
+	read_byte(RESPONSE_TIMEOUT);
+	elapsed = read_timer() - start;
 
-	free(buffer);
+exit:
 	fflush(stdout);
 	newlines_on();
 	millisleep(1000);
-	printf("File transmission complete.\n");
+	if (!error)
+	{
+		printf("File transmission complete.\n");
+		report(source.packed ? "Sent (packed)" : "Sent", source.len, wire,
+			elapsed);
+	}
+}
+
+/* Received data is not written to the file as soon as it arrives; instead
+ * each good block is ACKed immediately and appended to a write-behind
+ * queue. The queue is written out in one go when it fills up (which stalls
+ * the sender, giving us back-pressure), when the line goes idle, or at the
+ * end of the transfer. This keeps slow storage from sitting in the
+ * critical path of every block and lets the backend see big, aligned
+ * writes instead of 1kB dribbles. */
+
+#define QUEUE_SIZE (8*1024) /* must be a multiple of 1024 */
+
+static uint8_t* queue;
+static uint32_t queue_offset; /* file offset of the first queued byte */
+static uint32_t queue_len;
+
+/* Returns 0 (and sets the error) if the queue couldn't all be written. */
+
+static int flush_queue(struct file* fp)
+{
+	uint32_t w = 0;
+
+	while (w < queue_len)
+	{
+		uint32_t i = vfs_write(fp, queue_offset, queue+w, queue_len-w);
+		if (i == 0)
+		{
+			if (!error)
+				setError("destination is full");
+			queue_len = 0;
+			return 0;
+		}
+		w += i;
+		queue_offset += i;
+	}
+	queue_len = 0;
+	return 1;
+}
+
+/* Appends unpacked data to the queue (for packed transfers, where one
+ * block can unpack to far more than the queue holds). */
+
+static void queue_append(void* context, const uint8_t* data, uint32_t len)
+{
+	struct file* fp = context;
+
+	while (len && !error)
+	{
+		uint32_t n = QUEUE_SIZE - queue_len;
+		if (n > len)
+			n = len;
+
+		memcpy(queue+queue_len, data, n);
+		queue_len += n;
+		data += n;
+		len -= n;
+		if (queue_len == QUEUE_SIZE)
+			flush_queue(fp);
+	}
+}
+
+/* Reads the rest of a packet; returns 0 if the line goes quiet first. */
+
+static int read_bytes(uint8_t* buffer, int len)
+{
+	uint32_t start = read_timer();
+
+	while (len > 0)
+	{
+		int i;
+
+		if (!poll_console(10))
+		{
+			if (timer_expired(start, BYTE_TIMEOUT))
+				return 0;
+			continue;
+		}
+
+		i = read(0, buffer, len);
+		if (i > 0)
+		{
+			buffer += i;
+			len -= i;
+			start = read_timer();
+		}
+	}
+	return 1;
 }
 
-static void xmodem_recv(struct file* fp)
+static void xmodem_recv(struct file* fp, int unpack)
 {
 	uint8_t block, nextblock;
-	uint32_t offset;
-	uint32_t nextoffset;
-	uint8_t* buffer;
+	uint8_t header[2];
+	uint8_t trailer[2];
 	uint8_t c;
 	uint32_t thisblocksize;
 	uint16_t blockcrc;
 	int command;
+	int started;
+	uint32_t lastgood;
+	uint8_t* payload;
+	uint8_t* packet;
+	struct unpacker* unpacker;
+	int packed = 0;
+	uint32_t start = 0;
+	uint32_t elapsed = 0;
+	uint32_t wire = 0;
+
+	queue = scratch_alloc(QUEUE_SIZE);
+	packet = scratch_alloc(1024);
+	unpacker = scratch_alloc(sizeof(struct unpacker));
+	if (!queue || !packet || !unpacker)
+		return;
 
 	printf("Give your local XMODEM send command now.\n");
 	fflush(stdout);
 	newlines_off();
 
-	offset = nextoffset = 0;
-	block = 1;
+	block = 0;
+	started = 0;
 	command = 'C';
+	queue_offset = queue_len = 0;
 
-	buffer = malloc(1024+4); /* maximum size for a packet */
-
+	lastgood = read_timer();
 	for (;;)
 	{
+		/* Give up if nothing useful has arrived for too long. */
+
+		if (timer_expired(lastgood, started ? RESPONSE_TIMEOUT : START_TIMEOUT))
+		{
+			cancel();
+			goto exit;
+		}
+
 		/* Send command and wait for response. */
 
 		putchar(command);
-		if (!poll_stdin())
+		if (!poll_console(1000))
 		{
-			/* Timeout. Go round and send the command again. */
+			/* Timeout. The line is idle, so this is a good time to write
+			 * out anything pending; then go round and send the command
+			 * again. */
+			if (!flush_queue(fp))
+			{
+				send_cancel();
+				goto exit;
+			}
 			continue;
 		}
 
@@ -199,10 +468,10 @@ static void xmodem_recv(struct file* fp)
 				/* Mangled packet! There's not really much we can do here.
 				 * Wait for data to stop and send a NAK. */
 
-				while (poll_stdin())
+				while (poll_console(1000))
 					getchar();
 
-				if (offset == 0)
+				if (!started)
 					command = 'C';
 				else
 					command = 21; /* NAK */
@@ -211,50 +480,95 @@ static void xmodem_recv(struct file* fp)
 		}
 
 		/* Okay, we are about to receive a hopefully valid packet of length
-		 * thisblocksize. */
-
+		 * thisblocksize. The payload goes straight onto the end of the
+		 * queue, which always has room for a full block; it only becomes
+		 * part of the queue if it checks out. (Packed payloads go into a
+		 * separate buffer, as they're unpacked into the queue.) */
+
+		payload = packed ? packet : (queue+queue_len);
+		if (!read_bytes(header, 2) ||
+		    !read_bytes(payload, thisblocksize) ||
+		    !read_bytes(trailer, 2))
 		{
-			int len = thisblocksize + 4;
-			int count = 0;
-
-			while (count < len)
-			{
-				int i = fread(buffer+count, 1, len, stdin);
-				len -= i;
-				count += i;
-			}
+			/* Truncated packet. */
+			command = started ? 21 : 'C'; /* NAK */
+			continue;
 		}
 
 		/* Check the block number. */
 
 		crc16 = 1;
 		crc = 0;
-		update_crc(buffer+2, thisblocksize);
+		update_crc(payload, thisblocksize);
 
 		nextblock = block + 1; /* ensure wrapping occurs */
-		blockcrc = (buffer[2+thisblocksize+0]<<8) | buffer[2+thisblocksize+1];
-		if ((buffer[0] == (~buffer[1] & 0xff))
-		    && ((buffer[0] == block) || (buffer[0] == nextblock))
+		blockcrc = (trailer[0]<<8) | trailer[1];
+		if ((header[0] == (~header[1] & 0xff))
+		    && ((header[0] == block) || (header[0] == nextblock))
 		    && (blockcrc == crc)
 		    )
 		{
-			/* Valid packet! Write it to disk, first checking to see whether
-			 * this is a new block or not. */
+			/* Valid packet! If it's a new block, commit it to the queue;
+			 * if it's a repeat of the last one (because our ACK got lost)
+			 * we already have it. */
 
-			if (buffer[0] == nextblock)
+			lastgood = read_timer();
+			if (header[0] == nextblock)
 			{
-				offset = nextoffset;
+				count_stat(STAT_XMODEM_BLOCKS, 1);
 				block = nextblock;
+				wire += thisblocksize;
+
+				/* A packed stream must start with the magic number. */
+
+				if (!started)
+				{
+					start = read_timer();
+					if (unpack)
+					{
+						if (memcmp(payload, PACK_MAGIC, PACK_MAGIC_SIZE) != 0)
+						{
+							send_cancel();
+							setError("data is not packed (see 'piface-pack')");
+							goto exit;
+						}
+						unpack_init(unpacker);
+						memcpy(packet, payload, thisblocksize);
+						payload = packet;
+						packed = 1;
+					}
+				}
+				started = 1;
+
+				if (!packed)
+					queue_len += thisblocksize;
+				else if (unpack_feed(unpacker, payload, thisblocksize,
+				            queue_append, fp) == PACK_CORRUPT)
+				{
+					send_cancel();
+					setError("packed data is corrupt");
+					goto exit;
+				}
+
+				/* If there isn't room for another full block, write the
+				 * queue out now, before ACKing; the sender waits. */
+
+				if ((QUEUE_SIZE - queue_len) < 1024)
+					flush_queue(fp);
+				if (error)
+				{
+					/* The file couldn't be written. */
+					send_cancel();
+					goto exit;
+				}
 			}
 
-			vfs_write(fp, offset, buffer+2, thisblocksize);
-			nextoffset = offset + thisblocksize;
-
 			command = 6; /* ACK */
 		}
 		else
 		{
 			/* Invalid packet --- request resend. */
+			count_stat(STAT_XMODEM_NAKS, 1);
 			command = 21; /* NAK */
 		}
 	}
@@ -262,22 +576,38 @@ static void xmodem_recv(struct file* fp)
 eot:
 	putchar(6); /* ACK */
 	fflush(stdout);
+	elapsed = read_timer() - start;
+	if (packed && (unpack_feed(unpacker, NULL, 0, NULL, NULL) != PACK_DONE))
+		setError("packed data ended early");
 
-	free(buffer);
+exit:
+	flush_queue(fp);
 
 	newlines_on();
 	millisleep(1000);
-	printf("File reception complete.\n");
+	if (!error)
+	{
+		printf("File reception complete.\n");
+		report(packed ? "Received (packed)" : "Received", queue_offset,
+			wire, elapsed);
+	}
 }
 
 static void send_cb(int argc, const char* argv[])
 {
 	struct file* fp;
 	uint32_t len;
+	int packed = 0;
 
+	if ((argc == 3) && (strcmp(argv[1], "-z") == 0))
+	{
+		packed = 1;
+		argc--;
+		argv++;
+	}
 	if (argc != 2)
 	{
-		setError("syntax: send <filename>");
+		setError("syntax: send [-z] <filename>");
 		return;
 	}
 
@@ -286,19 +616,26 @@ static void send_cb(int argc, const char* argv[])
 		return;
 
 	vfs_info(fp, NULL, &len);
-	if (len & 0x7f)
+	if (!packed && (len & 0x7f))
 		printf("Warning: file is not a multiple of 128 bytes, padding will be added\n");
-	xmodem_send(fp, len);
+	xmodem_send(fp, len, packed);
 	vfs_close(fp);
 }
 
 static void recv_cb(int argc, const char* argv[])
 {
 	struct file* fp;
+	int unpack = 0;
 
+	if ((argc == 3) && (strcmp(argv[1], "-z") == 0))
+	{
+		unpack = 1;
+		argc--;
+		argv++;
+	}
 	if (argc != 2)
 	{
-		setError("syntax: recv <filename>");
+		setError("syntax: recv [-z] <filename>");
 		return;
 	}
 
@@ -306,7 +643,7 @@ static void recv_cb(int argc, const char* argv[])
 	if (!fp)
 		return;
 
-	xmodem_recv(fp);
+	xmodem_recv(fp, unpack);
 	vfs_close(fp);
 }
 
@@ -316,8 +653,11 @@ const struct command send_cmd =
 	"sends a file by XMODEM",
 
 	"Syntax:\n"
-	"  send <filename>\n"
-	"Attempts to transmit the file via the console by XMODEM.",
+	"  send [-z] <filename>\n"
+	"Attempts to transmit the file via the console by XMODEM. With -z, or if\n"
+	"the receiver starts the transfer with 'Z' rather than 'C', the data is\n"
+	"packed on the way; unpack it with 'piface-pack -d'. The padding XMODEM\n"
+	"adds to the end of the file is then removed as well.",
 
 	send_cb
 };
@@ -328,8 +668,9 @@ const struct command recv_cmd =
 	"receives a file by XMODEM",
 
 	"Syntax:\n"
-	"  recv <filename>\n"
-	"Attempts to receive a file via the console by XMODEM.",
+	"  recv [-z] <filename>\n"
+	"Attempts to receive a file via the console by XMODEM. With -z, the file\n"
+	"must have been packed with 'piface-pack', and is unpacked as it arrives.",
 
 	recv_cb
 };
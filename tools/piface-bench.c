@@ -0,0 +1,540 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+/* Host benchmark runner. This is linked against the testbed build of
+ * piface (everything except main.c) and drives its modules directly.
+ *
+ *   piface-bench [-c <baseline>] [-w <baseline>]
+ *
+ * Each benchmark prints its wall-clock time and throughput, which vary
+ * from machine to machine, and the I/O counters from the stats registry
+ * (vfs, FAT and disk activity), which don't: they only change when the
+ * code does. -w writes the counters to a baseline file; -c compares
+ * against one and fails if any counter has got worse. */
+
+#include "../src/globals.h"
+#include "ff.h"
+#include <sys/wait.h>
+#include <signal.h>
+
+#define IMAGE_SIZE (32*1024*1024)
+#define FILE_SIZE (2*1024*1024)
+#define COPY_SIZE (1024*1024)
+#define XMODEM_SIZE (256*1024)
+#define XMODEM_SETTLE 1000000 /* us */
+#define CHUNK 4096
+#define SEEKS 1000
+#define DIR_ENTRIES 256
+#define CRC_SIZE (1024*1024)
+#define CRC_PASSES 8
+#define PARSES 10000
+
+#define MAX_RESULTS 256
+
+struct result
+{
+	char name[64];
+	uint32_t value;
+};
+
+static FILE* report;
+static char tmpdir[64];
+static char image[80];
+static FATFS fatfs;
+static uint8_t buffer[CHUNK];
+static uint32_t start;
+
+static struct result results[MAX_RESULTS];
+static int numresults;
+
+static void fatal(const char* msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	fprintf(report, "piface-bench: ");
+	vfprintf(report, msg, ap);
+	fprintf(report, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static void check(FRESULT r, const char* what)
+{
+	if (r != FR_OK)
+		fatal("%s failed: FatFs error %d", what, r);
+}
+
+static void command(const char* fmt, ...)
+{
+	char line[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	execute_command(line);
+	fflush(stdout);
+	if (error)
+		fatal("'%s' failed: %s", line, error);
+}
+
+static void fill_pattern(uint8_t* p, uint32_t offset, uint32_t len)
+{
+	while (len--)
+	{
+		*p++ = (offset * 7) ^ (offset >> 9);
+		offset++;
+	}
+}
+
+/* Timing and recording. */
+
+static void begin(void)
+{
+	memset(stats, 0, sizeof(stats));
+	start = read_timer();
+}
+
+static void end(const char* name, uint32_t bytes)
+{
+	uint32_t us = read_timer() - start;
+	int i;
+
+	if (us == 0)
+		us = 1;
+	fprintf(report, "%-12s %10u us", name, (unsigned) us);
+	if (bytes)
+		fprintf(report, " %8.2f MB/s", (double)bytes / us);
+	fprintf(report, "\n");
+
+	/* Only the vfs, FAT and disk counters are deterministic. */
+
+	for (i=STAT_VFS_OPENS; i<=STAT_DISK_SECTORS_WRITTEN; i++)
+	{
+		struct result* r;
+
+		if (!stats[i])
+			continue;
+		if (numresults == MAX_RESULTS)
+			fatal("too many results");
+
+		r = &results[numresults++];
+		snprintf(r->name, sizeof(r->name), "%s.%s", name, stat_names[i]);
+		r->value = stats[i];
+	}
+}
+
+/* FatFs benchmarks; these use FatFs directly, with our own mount. */
+
+static void bench_mkfs(void)
+{
+	int fd = open(image, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if ((fd == -1) || (ftruncate(fd, IMAGE_SIZE) == -1))
+		fatal("cannot create %s: %s", image, strerror(errno));
+	close(fd);
+
+	mmc_init();
+	begin();
+	check(f_mount(0, &fatfs), "f_mount");
+	check(f_mkfs(0, 1, 0), "f_mkfs");
+	end("mkfs", 0);
+}
+
+static void bench_fat_write(void)
+{
+	FIL fp;
+	uint32_t offset;
+	UINT w;
+
+	begin();
+	check(f_open(&fp, "/seq.bin", FA_WRITE|FA_CREATE_ALWAYS), "f_open");
+	for (offset=0; offset<FILE_SIZE; offset+=CHUNK)
+	{
+		fill_pattern(buffer, offset, CHUNK);
+		check(f_write(&fp, buffer, CHUNK, &w), "f_write");
+	}
+	check(f_close(&fp), "f_close");
+	end("fat_write", FILE_SIZE);
+}
+
+static void bench_fat_read(void)
+{
+	uint8_t expected[CHUNK];
+	FIL fp;
+	uint32_t offset;
+	UINT r;
+
+	begin();
+	check(f_open(&fp, "/seq.bin", FA_READ|FA_OPEN_EXISTING), "f_open");
+	for (offset=0; offset<FILE_SIZE; offset+=CHUNK)
+	{
+		check(f_read(&fp, buffer, CHUNK, &r), "f_read");
+		fill_pattern(expected, offset, CHUNK);
+		if ((r != CHUNK) || memcmp(buffer, expected, CHUNK))
+			fatal("read back wrong data at %x", offset);
+	}
+	check(f_close(&fp), "f_close");
+	end("fat_read", FILE_SIZE);
+}
+
+static void bench_fat_seek(void)
+{
+	FIL fp;
+	uint32_t seed = 1;
+	int i;
+	UINT r;
+
+	begin();
+	check(f_open(&fp, "/seq.bin", FA_READ|FA_OPEN_EXISTING), "f_open");
+	for (i=0; i<SEEKS; i++)
+	{
+		seed = seed*1103515245 + 12345;
+		check(f_lseek(&fp, ((seed >> 8) % (FILE_SIZE/512)) * 512), "f_lseek");
+		check(f_read(&fp, buffer, 512, &r), "f_read");
+	}
+	check(f_close(&fp), "f_close");
+	end("fat_seek", SEEKS*512);
+}
+
+static void bench_dir_create(void)
+{
+	char path[32];
+	FIL fp;
+	int i;
+
+	begin();
+	check(f_mkdir("/big"), "f_mkdir");
+	for (i=0; i<DIR_ENTRIES; i++)
+	{
+		sprintf(path, "/big/f%d.txt", i);
+		check(f_open(&fp, path, FA_WRITE|FA_CREATE_NEW), "f_open");
+		check(f_close(&fp), "f_close");
+	}
+	end("dir_create", 0);
+}
+
+static void bench_dir_lookup(void)
+{
+	char path[32];
+	FILINFO fi;
+	int i;
+
+	/* Backwards, so most lookups scan most of the directory. */
+
+	begin();
+	for (i=DIR_ENTRIES-1; i>=0; i--)
+	{
+		sprintf(path, "/big/f%d.txt", i);
+		check(f_stat(path, &fi), "f_stat");
+	}
+	end("dir_lookup", 0);
+
+	check(f_mount(0, NULL), "f_mount");
+}
+
+/* vfs benchmarks; these go through piface commands and the sd: mount. */
+
+static void bench_cp(void)
+{
+	char path[96];
+	uint32_t offset;
+	FILE* fp;
+
+	sprintf(path, "%s/in.bin", tmpdir);
+	fp = fopen(path, "w");
+	for (offset=0; offset<COPY_SIZE; offset+=CHUNK)
+	{
+		fill_pattern(buffer, offset, CHUNK);
+		fwrite(buffer, 1, CHUNK, fp);
+	}
+	fclose(fp);
+
+	begin();
+	command("cp host:%s/in.bin sd:/cp.bin", tmpdir);
+	vfs_sd_deinit();
+	end("cp_to_sd", COPY_SIZE);
+
+	begin();
+	command("cp sd:/cp.bin host:%s/out.bin", tmpdir);
+	vfs_sd_deinit();
+	end("cp_from_sd", COPY_SIZE);
+
+	sprintf(path, "%s/out.bin", tmpdir);
+	fp = fopen(path, "r");
+	for (offset=0; offset<COPY_SIZE; offset+=CHUNK)
+	{
+		uint8_t expected[CHUNK];
+
+		fill_pattern(expected, offset, CHUNK);
+		if ((fread(buffer, 1, CHUNK, fp) != CHUNK) ||
+		    memcmp(buffer, expected, CHUNK))
+			fatal("copied wrong data at %x", offset);
+	}
+	fclose(fp);
+}
+
+static void bench_crc(void)
+{
+	uint8_t* data = malloc(CRC_SIZE);
+	uint16_t crc = 0;
+	int i;
+
+	fill_pattern(data, 0, CRC_SIZE);
+	begin();
+	for (i=0; i<CRC_PASSES; i++)
+		crc = update_crc16(crc, data, CRC_SIZE);
+	end("crc16", CRC_SIZE*CRC_PASSES);
+	free(data);
+}
+
+static void bench_parser(void)
+{
+	int i;
+
+	begin();
+	for (i=0; i<PARSES; i++)
+		command("set BENCH=%d", i);
+	end("parser", 0);
+}
+
+/* XMODEM loopback: a child process plays the sending terminal program,
+ * talking to the 'recv' command over a pair of pipes. */
+
+static int read_peer(int fd)
+{
+	uint8_t c;
+
+	if (read(fd, &c, 1) != 1)
+		_exit(1);
+	return c;
+}
+
+static void xmodem_peer(int in, int out)
+{
+	uint8_t packet[3 + 1024 + 2];
+	uint32_t offset = 0;
+	uint8_t block = 1;
+	uint16_t crc;
+	int c;
+
+	/* Skip the banner; wait for the receiver to ask for CRC mode. */
+
+	while (read_peer(in) != 'C')
+		;
+
+	for (;;)
+	{
+		packet[0] = 2; /* STX */
+		packet[1] = block;
+		packet[2] = ~block;
+		fill_pattern(packet+3, offset, 1024);
+		crc = update_crc16(0, packet+3, 1024);
+		packet[3+1024] = crc >> 8;
+		packet[3+1025] = crc;
+		if (write(out, packet, sizeof(packet)) != sizeof(packet))
+			_exit(1);
+
+		c = read_peer(in);
+		if (c == 6) /* ACK */
+		{
+			block++;
+			offset += 1024;
+			if (offset == XMODEM_SIZE)
+				break;
+		}
+	}
+
+	do
+	{
+		c = 4; /* EOT */
+		if (write(out, &c, 1) != 1)
+			_exit(1);
+	}
+	while (read_peer(in) != 6);
+
+	_exit(0);
+}
+
+static void bench_xmodem(void)
+{
+	char recv[] = "recv sd:/xm.bin"; /* execute_command() modifies it */
+	int topeer[2], frompeer[2];
+	int savedin, savedout;
+	int status;
+	uint8_t expected[1024];
+	struct file* fp;
+	uint32_t offset;
+	pid_t pid;
+
+	if ((pipe(topeer) == -1) || (pipe(frompeer) == -1))
+		fatal("cannot create pipes");
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0)
+	{
+		close(topeer[1]);
+		close(frompeer[0]);
+		xmodem_peer(topeer[0], frompeer[1]);
+	}
+	close(topeer[0]);
+	close(frompeer[1]);
+
+	savedin = dup(0);
+	savedout = dup(1);
+	dup2(frompeer[0], 0);
+	dup2(topeer[1], 1);
+	close(frompeer[0]);
+	close(topeer[1]);
+
+	begin();
+	execute_command(recv);
+	fflush(stdout);
+	vfs_sd_deinit();
+	start += XMODEM_SETTLE; /* recv always pauses before returning */
+	end("xmodem_recv", XMODEM_SIZE);
+
+	dup2(savedin, 0);
+	dup2(savedout, 1);
+	close(savedin);
+	close(savedout);
+	waitpid(pid, &status, 0);
+	if (error)
+		fatal("recv failed: %s", error);
+
+	fp = vfs_open("sd:/xm.bin", O_RDONLY);
+	if (!fp)
+		fatal("cannot open received file: %s", error);
+	for (offset=0; offset<XMODEM_SIZE; offset+=1024)
+	{
+		fill_pattern(expected, offset, 1024);
+		if ((vfs_read(fp, offset, buffer, 1024) != 1024) ||
+		    memcmp(buffer, expected, 1024))
+			fatal("received wrong data at %x", offset);
+	}
+	vfs_close(fp);
+	vfs_sd_deinit();
+}
+
+/* Baselines. */
+
+static void write_baseline(const char* path)
+{
+	FILE* fp = fopen(path, "w");
+	int i;
+
+	if (!fp)
+		fatal("cannot write %s: %s", path, strerror(errno));
+	for (i=0; i<numresults; i++)
+		fprintf(fp, "%s=%u\n", results[i].name, (unsigned) results[i].value);
+	fclose(fp);
+	fprintf(report, "baseline written to %s\n", path);
+}
+
+static int compare_baseline(const char* path)
+{
+	FILE* fp = fopen(path, "r");
+	char line[128];
+	int worse = 0;
+	int i;
+
+	if (!fp)
+		fatal("cannot read %s: %s", path, strerror(errno));
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		char* p = strchr(line, '=');
+		uint32_t old, new = 0;
+
+		if (!p)
+			continue;
+		*p++ = '\0';
+		old = strtoul(p, NULL, 10);
+
+		for (i=0; i<numresults; i++)
+			if (strcmp(results[i].name, line) == 0)
+				break;
+		if (i < numresults)
+			new = results[i].value;
+
+		if (new != old)
+		{
+			fprintf(report, "%-36s %10u -> %10u  %s\n", line,
+				(unsigned) old, (unsigned) new,
+				(new > old) ? "WORSE" : "better");
+			if (new > old)
+				worse = 1;
+		}
+	}
+	fclose(fp);
+
+	if (worse)
+		fprintf(report, "I/O counters have regressed against %s\n", path);
+	else
+		fprintf(report, "no regressions against %s\n", path);
+	return worse;
+}
+
+int main(int argc, char* const argv[])
+{
+	const char* compare = NULL;
+	const char* write = NULL;
+	int opt;
+
+	report = fdopen(dup(1), "w");
+	setvbuf(report, NULL, _IOLBF, 0);
+
+	while ((opt = getopt(argc, argv, "c:w:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c': compare = optarg; break;
+			case 'w': write = optarg; break;
+			default:
+				fatal("syntax: piface-bench [-c <baseline>] [-w <baseline>]");
+		}
+	}
+
+	/* piface's own chatter (mount messages, progress) is discarded. */
+
+	if (!freopen("/dev/null", "w", stdout))
+		fatal("cannot open /dev/null");
+	setvbuf(stdin, NULL, _IONBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	strcpy(tmpdir, "/tmp/piface-bench.XXXXXX");
+	if (!mkdtemp(tmpdir))
+		fatal("cannot create temporary directory");
+	sprintf(image, "%s/sd.img", tmpdir);
+	setenv("SDIMAGE", image, 1);
+
+	bench_mkfs();
+	bench_fat_write();
+	bench_fat_read();
+	bench_fat_seek();
+	bench_dir_create();
+	bench_dir_lookup();
+	bench_cp();
+	bench_crc();
+	bench_parser();
+	bench_xmodem();
+
+	unlink(image);
+	sprintf(image, "%s/in.bin", tmpdir);
+	unlink(image);
+	sprintf(image, "%s/out.bin", tmpdir);
+	unlink(image);
+	rmdir(tmpdir);
+
+	if (write)
+		write_baseline(write);
+	if (compare)
+		return compare_baseline(compare);
+	return 0;
+}
@@ -0,0 +1,776 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+/* Serial link simulator. Runs the testbed build of piface on a pty and
+ * talks to it through a model of a serial line, playing the terminal
+ * program's side of a file transfer itself.
+ *
+ *   piface-link [options] send|recv <size>
+ *
+ * 'send' has piface send a file of <size> bytes to us; 'recv' has us send
+ * one to piface. Both use XMODEM-1K/CRC. The line model paces bytes at
+ * the baud rate and adds latency; while the transfer is running (but not
+ * while commands are being typed) it can also corrupt bits, drop bytes
+ * and inject bursts of noise. Afterwards the data is checked and we report
+ * throughput, retransmissions and how long it took to recover from each
+ * fault.
+ *
+ * With -z the transfer is packed (see src/pack.h): for 'send' we ask for
+ * it by starting with 'Z', and for 'recv' we send piface a packed stream
+ * (and tell it so with 'recv -z').
+ *
+ * Options:
+ *   -x <program>        piface testbed binary (default ./piface)
+ *   -b <baud>           line speed (default 115200)
+ *   -l <us>             one-way latency (default 0)
+ *   -e <n>              flip a bit in one byte in n, on average
+ *   -d <n>              drop one byte in n, on average
+ *   -n <period>:<len>   every <period> ms, garble everything for <len> ms
+ *   -s <seed>           random seed (default 1)
+ *   -z                  pack the data on the wire
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <pty.h>
+#include <sys/wait.h>
+#include "../src/pack.h"
+
+#define QUEUE_SIZE 65536 /* must be a power of two */
+#define COMMAND_TIMEOUT 10000000 /* us */
+#define START_TIMEOUT 10000000 /* us */
+#define RESPONSE_TIMEOUT 3000000 /* us */
+#define BYTE_TIMEOUT 1000000 /* us */
+#define MAX_RETRIES 20
+#define MAX_SAMPLES 4096
+
+/* One direction of the line. Bytes are queued with the time at which they
+ * finish arriving at the far end. */
+
+struct channel
+{
+	uint8_t data[QUEUE_SIZE];
+	uint64_t when[QUEUE_SIZE];
+	uint32_t head, tail;
+	uint64_t free_at; /* when the transmitter is next idle */
+};
+
+static int fd;
+static pid_t child;
+static char tmpdir[64];
+
+static struct channel to_piface;
+static struct channel to_peer;
+static uint64_t byte_time; /* ns */
+static uint64_t latency; /* ns */
+static uint32_t error_rate;
+static uint32_t drop_rate;
+static uint64_t burst_period; /* ns */
+static uint64_t burst_length; /* ns */
+static uint32_t seed = 1;
+
+static int packed;
+static uint32_t wire_bytes;
+
+static int faults_enabled;
+static uint64_t faults_start;
+
+/* Statistics. */
+
+static uint32_t bit_errors;
+static uint32_t drops;
+static uint32_t burst_bytes;
+static uint32_t blocks;
+static uint32_t retransmissions;
+static uint32_t timeouts;
+static int fault_pending;
+static uint64_t fault_time;
+static uint32_t recoveries[MAX_SAMPLES]; /* us */
+static int numrecoveries;
+
+static void fatal(const char* msg, ...)
+{
+	va_list ap;
+	va_start(ap, msg);
+	fprintf(stderr, "piface-link: ");
+	vfprintf(stderr, msg, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	if (child)
+		kill(child, SIGKILL);
+	exit(1);
+}
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static uint32_t random_number(void)
+{
+	seed = seed*1103515245 + 12345;
+	return seed >> 8;
+}
+
+static uint16_t update_crc16(uint16_t crc, const void* data, uint32_t len)
+{
+	const uint8_t* p = data;
+	int j;
+
+	while (len--)
+	{
+		crc ^= *p++ << 8;
+		for (j=0; j<8; j++)
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+	}
+	return crc;
+}
+
+static void fill_pattern(uint8_t* p, uint32_t offset, uint32_t len)
+{
+	while (len--)
+	{
+		*p++ = (offset * 7) ^ (offset >> 9);
+		offset++;
+	}
+}
+
+/* Fault bookkeeping: the recovery time is from the first fault after a
+ * good block to the next good block. */
+
+static void note_fault(uint64_t t)
+{
+	if (!fault_pending)
+	{
+		fault_pending = 1;
+		fault_time = t;
+	}
+}
+
+static void note_progress(void)
+{
+	blocks++;
+	if (fault_pending)
+	{
+		if (numrecoveries < MAX_SAMPLES)
+			recoveries[numrecoveries++] = (now() - fault_time) / 1000;
+		fault_pending = 0;
+	}
+}
+
+/* The line model. */
+
+static void line_send(struct channel* ch, uint8_t c)
+{
+	uint64_t t = now();
+	uint32_t i;
+
+	if (ch->free_at > t)
+		t = ch->free_at;
+	ch->free_at = t + byte_time;
+
+	if (faults_enabled)
+	{
+		if (burst_period && (((t - faults_start) % burst_period) < burst_length))
+		{
+			c = random_number();
+			burst_bytes++;
+			note_fault(t);
+		}
+		else if (drop_rate && ((random_number() % drop_rate) == 0))
+		{
+			drops++;
+			note_fault(t);
+			return;
+		}
+		else if (error_rate && ((random_number() % error_rate) == 0))
+		{
+			c ^= 1 << (random_number() & 7);
+			bit_errors++;
+			note_fault(t);
+		}
+	}
+
+	if ((ch->head - ch->tail) == QUEUE_SIZE)
+		fatal("line queue overflow");
+	i = ch->head++ & (QUEUE_SIZE-1);
+	ch->data[i] = c;
+	ch->when[i] = ch->free_at + latency;
+}
+
+static int line_ready(struct channel* ch, uint64_t t)
+{
+	return (ch->head != ch->tail) && (ch->when[ch->tail & (QUEUE_SIZE-1)] <= t);
+}
+
+static uint8_t line_receive(struct channel* ch)
+{
+	return ch->data[ch->tail++ & (QUEUE_SIZE-1)];
+}
+
+/* Moves bytes along the line: anything piface has written goes onto the
+ * line towards us, and anything which has arrived at piface's end is
+ * written to the pty. Waits no later than the deadline. */
+
+static void pump(uint64_t deadline)
+{
+	uint8_t buffer[256];
+	struct pollfd pfd;
+	uint64_t t = now();
+	int timeout;
+	int i;
+
+	while (line_ready(&to_piface, t))
+	{
+		uint8_t c = line_receive(&to_piface);
+		if (write(fd, &c, 1) != 1)
+			fatal("write error: %s", strerror(errno));
+	}
+
+	if ((to_piface.head != to_piface.tail) &&
+	    (to_piface.when[to_piface.tail & (QUEUE_SIZE-1)] < deadline))
+		deadline = to_piface.when[to_piface.tail & (QUEUE_SIZE-1)];
+	if ((to_peer.head != to_peer.tail) &&
+	    (to_peer.when[to_peer.tail & (QUEUE_SIZE-1)] < deadline))
+		deadline = to_peer.when[to_peer.tail & (QUEUE_SIZE-1)];
+
+	timeout = (deadline > t) ? ((deadline - t + 999999) / 1000000) : 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	i = poll(&pfd, 1, timeout);
+	if ((i < 0) && (errno != EINTR))
+		fatal("poll error: %s", strerror(errno));
+	if (i > 0)
+	{
+		int n = read(fd, buffer, sizeof(buffer));
+		if (n <= 0)
+			fatal("piface has gone away");
+		for (i=0; i<n; i++)
+			line_send(&to_peer, buffer[i]);
+	}
+}
+
+/* The peer's side: byte I/O with timeouts, in us. */
+
+static int peer_getc(uint32_t timeout)
+{
+	uint64_t deadline = now() + (uint64_t)timeout*1000;
+
+	for (;;)
+	{
+		uint64_t t = now();
+
+		if (line_ready(&to_peer, t))
+			return line_receive(&to_peer);
+		if (t >= deadline)
+			return -1;
+		pump(deadline);
+	}
+}
+
+static void peer_putc(uint8_t c)
+{
+	line_send(&to_piface, c);
+}
+
+static void peer_write(const void* data, int len)
+{
+	const uint8_t* p = data;
+
+	while (len--)
+		peer_putc(*p++);
+	pump(0);
+}
+
+/* Reads console output from piface, answering any cursor position
+ * queries on the way (readline asks for one to find the screen width). */
+
+static int console_getc(uint32_t timeout)
+{
+	static const char query[] = "\033[6n";
+	static int qmatched = 0;
+	int c = peer_getc(timeout);
+
+	if (c == -1)
+		return -1;
+	qmatched = (c == query[qmatched]) ? (qmatched+1) : (c == query[0]);
+	if (qmatched == 4)
+	{
+		peer_write("\033[24;80R", 8);
+		qmatched = 0;
+	}
+	return c;
+}
+
+/* Waits for piface to print the given text; everything else is
+ * discarded. */
+
+static void wait_for(const char* text)
+{
+	int matched = 0;
+	int len = strlen(text);
+
+	while (matched < len)
+	{
+		int c = console_getc(COMMAND_TIMEOUT);
+		if (c == -1)
+			fatal("timed out waiting for '%s'", text);
+		matched = (c == text[matched]) ? (matched+1) : (c == text[0]);
+	}
+}
+
+/* Types a command at the prompt, once piface has finished talking. */
+
+static void command(const char* fmt, ...)
+{
+	char line[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line)-1, fmt, ap);
+	va_end(ap);
+	strcat(line, "\r");
+
+	wait_for("> ");
+	while (console_getc(200000) != -1)
+		;
+	peer_write(line, strlen(line));
+}
+
+static void start_faults(void)
+{
+	faults_enabled = 1;
+	faults_start = now();
+}
+
+/* Waits for the line to go quiet, so that the other end sees a clean
+ * response after a mangled packet. */
+
+static void purge(void)
+{
+	while (peer_getc(100000) != -1)
+		;
+}
+
+/* Packing and unpacking whole buffers. */
+
+static uint8_t* pack_data(const uint8_t* data, uint32_t size, uint32_t* packedsize)
+{
+	uint8_t* p = malloc(PACK_MAGIC_SIZE + (size/PACK_CHUNK_SIZE + 1)*PACK_MAX_CHUNK + 6);
+	uint32_t len = PACK_MAGIC_SIZE;
+	uint32_t offset;
+
+	memcpy(p, PACK_MAGIC, PACK_MAGIC_SIZE);
+	for (offset=0; offset<size; offset+=PACK_CHUNK_SIZE)
+	{
+		uint32_t n = size - offset;
+		if (n > PACK_CHUNK_SIZE)
+			n = PACK_CHUNK_SIZE;
+		len += pack_chunk(data+offset, n, p+len);
+	}
+
+	p[len++] = 0;
+	p[len++] = 0;
+	p[len++] = size;
+	p[len++] = size >> 8;
+	p[len++] = size >> 16;
+	p[len++] = size >> 24;
+	*packedsize = len;
+	return p;
+}
+
+struct sink
+{
+	uint8_t* data;
+	uint32_t len;
+	uint32_t size;
+};
+
+static void sink_cb(void* context, const uint8_t* data, uint32_t len)
+{
+	struct sink* sink = context;
+
+	if ((sink->len + len) > sink->size)
+		fatal("unpacked data is too long");
+	memcpy(sink->data + sink->len, data, len);
+	sink->len += len;
+}
+
+static uint8_t* unpack_data(const uint8_t* data, uint32_t len, uint32_t size)
+{
+	static struct unpacker u;
+	struct sink sink;
+
+	sink.data = malloc(size);
+	sink.len = 0;
+	sink.size = size;
+	unpack_init(&u);
+	if (unpack_feed(&u, data, len, sink_cb, &sink) != PACK_DONE)
+		fatal("packed data is corrupt or incomplete");
+	if (sink.len != size)
+		fatal("unpacked %u bytes, expected %u", sink.len, size);
+	return sink.data;
+}
+
+/* XMODEM sender (for piface's recv command). */
+
+static void xmodem_send(const uint8_t* data, uint32_t size)
+{
+	uint8_t packet[3 + 1024 + 2];
+	uint32_t offset = 0;
+	uint8_t block = 1;
+	int tries = 0;
+	int c;
+
+	/* Wait for the receiver to ask for CRC mode. */
+
+	do
+	{
+		c = peer_getc(START_TIMEOUT);
+		if (c == -1)
+			fatal("receiver never started");
+	}
+	while (c != 'C');
+
+	while (offset < size)
+	{
+		uint32_t n = size - offset;
+		uint16_t crc;
+
+		if (n > 1024)
+			n = 1024;
+		packet[0] = 2; /* STX */
+		packet[1] = block;
+		packet[2] = ~block;
+		memcpy(packet+3, data+offset, n);
+		memset(packet+3+n, 26, 1024-n); /* SUB */
+		crc = update_crc16(0, packet+3, 1024);
+		packet[3+1024] = crc >> 8;
+		packet[3+1025] = crc;
+		peer_write(packet, sizeof(packet));
+
+		c = peer_getc(RESPONSE_TIMEOUT);
+		if (c == 6) /* ACK */
+		{
+			note_progress();
+			block++;
+			offset += 1024;
+			tries = 0;
+			continue;
+		}
+
+		/* NAK, timeout or garbage; send it again. */
+
+		if (c == -1)
+			timeouts++;
+		note_fault(now());
+		retransmissions++;
+		if (++tries == MAX_RETRIES)
+			fatal("too many retries on block %d", block);
+		purge();
+	}
+
+	for (tries=0; tries<MAX_RETRIES; tries++)
+	{
+		peer_putc(4); /* EOT */
+		pump(0);
+		if (peer_getc(RESPONSE_TIMEOUT) == 6)
+			return;
+	}
+	fatal("EOT never acknowledged");
+}
+
+/* XMODEM receiver (for piface's send command). Returns the data. */
+
+static int read_bytes(uint8_t* p, int len)
+{
+	while (len--)
+	{
+		int c = peer_getc(BYTE_TIMEOUT);
+		if (c == -1)
+			return 0;
+		*p++ = c;
+	}
+	return 1;
+}
+
+static uint8_t* xmodem_receive(uint32_t size)
+{
+	uint8_t* data = malloc(size*2 + 1024);
+	uint8_t packet[2 + 1024 + 2];
+	uint32_t offset = 0;
+	uint8_t block = 1;
+	int command = packed ? 'Z' : 'C';
+	int tries = 0;
+
+	for (;;)
+	{
+		int c, len;
+
+		peer_putc(command);
+		pump(0);
+
+		c = peer_getc(BYTE_TIMEOUT);
+		if (c == 4) /* EOT */
+			break;
+		if (c == 24) /* CAN */
+			fatal("sender cancelled the transfer");
+		if ((c != 1) && (c != 2))
+		{
+			if (c == -1)
+				timeouts++;
+			else
+				purge();
+			if (++tries == MAX_RETRIES)
+				fatal("too many retries on block %d", block);
+			continue;
+		}
+
+		len = (c == 1) ? 128 : 1024;
+		if (read_bytes(packet, len+4)
+		    && (packet[0] == (uint8_t)~packet[1])
+		    && (update_crc16(0, packet+2, len) ==
+		        ((packet[2+len]<<8) | packet[3+len])))
+		{
+			if (packet[0] == block)
+			{
+				if ((offset + len) > (size*2 + 1024))
+					fatal("received too much data");
+				memcpy(data+offset, packet+2, len);
+				offset += len;
+				block++;
+				note_progress();
+			}
+			command = 6; /* ACK; also for a repeat of the last block */
+			tries = 0;
+			continue;
+		}
+
+		/* Mangled or truncated packet. */
+
+		note_fault(now());
+		retransmissions++;
+		if (++tries == MAX_RETRIES)
+			fatal("too many retries on block %d", block);
+		purge();
+		if (block != 1)
+			command = 21; /* NAK */
+	}
+
+	peer_putc(6); /* ACK */
+	pump(0);
+	wire_bytes = offset;
+	if (packed)
+		return unpack_data(data, offset, size);
+	if (offset < size)
+		fatal("received only %u bytes", offset);
+	return data;
+}
+
+static void spawn(const char* program)
+{
+	struct termios t;
+
+	cfmakeraw(&t);
+	child = forkpty(&fd, NULL, &t, NULL);
+	if (child < 0)
+		fatal("cannot fork: %s", strerror(errno));
+	if (child == 0)
+	{
+		execl(program, program, NULL);
+		_exit(1);
+	}
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+	uint32_t ua = *(const uint32_t*) a;
+	uint32_t ub = *(const uint32_t*) b;
+	return (ua > ub) - (ua < ub);
+}
+
+static void report(const char* direction, uint32_t size, uint64_t ns,
+	uint32_t baud)
+{
+	uint32_t ms = ns / 1000000;
+	uint32_t rate = (uint64_t)size * 1000000000 / ns;
+
+	printf("%s %u bytes at %u baud: %u.%03u s, %u bytes/s (%u%% of line rate)\n",
+		direction, size, baud, ms/1000, ms%1000, rate,
+		(unsigned)((uint64_t)rate * 1000 / baud));
+	if (packed)
+		printf("packed to %u bytes on the wire, ratio %.2f\n",
+			wire_bytes, (double)size / wire_bytes);
+	printf("blocks %u, retransmissions %u, timeouts %u\n",
+		blocks, retransmissions, timeouts);
+	printf("faults: %u bit errors, %u dropped bytes, %u noise bytes\n",
+		bit_errors, drops, burst_bytes);
+
+	if (numrecoveries)
+	{
+		uint64_t total = 0;
+		int i;
+
+		qsort(recoveries, numrecoveries, sizeof(*recoveries), compare_samples);
+		for (i=0; i<numrecoveries; i++)
+			total += recoveries[i];
+		printf("recovered %d times: mean %u ms, p50 %u ms, max %u ms\n",
+			numrecoveries,
+			(unsigned)(total / numrecoveries / 1000),
+			recoveries[numrecoveries/2] / 1000,
+			recoveries[numrecoveries-1] / 1000);
+	}
+}
+
+static void syntax(void)
+{
+	fatal("syntax: piface-link [-x <program>] [-b <baud>] [-l <us>] [-e <n>]\n"
+	      "  [-d <n>] [-n <period>:<len>] [-s <seed>] [-z] send|recv <size>");
+}
+
+int main(int argc, char* argv[])
+{
+	const char* program = "./piface";
+	uint32_t baud = 115200;
+	uint32_t size;
+	char path[96];
+	uint64_t start;
+	int sending;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "x:b:l:e:d:n:s:z")) != -1)
+	{
+		switch (opt)
+		{
+			case 'x': program = optarg; break;
+			case 'b': baud = strtoul(optarg, NULL, 0); break;
+			case 'l': latency = strtoull(optarg, NULL, 0) * 1000; break;
+			case 'e': error_rate = strtoul(optarg, NULL, 0); break;
+			case 'd': drop_rate = strtoul(optarg, NULL, 0); break;
+			case 's': seed = strtoul(optarg, NULL, 0); break;
+			case 'z': packed = 1; break;
+
+			case 'n':
+			{
+				char* p;
+				burst_period = strtoull(optarg, &p, 0) * 1000000;
+				if (*p != ':')
+					syntax();
+				burst_length = strtoull(p+1, NULL, 0) * 1000000;
+				break;
+			}
+
+			default:
+				syntax();
+		}
+	}
+
+	if ((argc - optind) != 2)
+		syntax();
+	if (strcmp(argv[optind], "send") == 0)
+		sending = 1;
+	else if (strcmp(argv[optind], "recv") == 0)
+		sending = 0;
+	else
+		syntax();
+	size = strtoul(argv[optind+1], NULL, 0);
+	if ((baud == 0) || (size == 0))
+		syntax();
+	byte_time = 10000000000ULL / baud; /* 8N1 is ten bits per byte */
+
+	strcpy(tmpdir, "/tmp/piface-link.XXXXXX");
+	if (!mkdtemp(tmpdir))
+		fatal("cannot create temporary directory");
+	sprintf(path, "%s/data", tmpdir);
+
+	signal(SIGPIPE, SIG_IGN);
+	spawn(program);
+
+	if (sending)
+	{
+		/* piface sends a file we've made; check what arrives. */
+
+		uint8_t* expected = malloc(size);
+		uint8_t* data;
+		FILE* fp = fopen(path, "w");
+
+		fill_pattern(expected, 0, size);
+		fwrite(expected, 1, size, fp);
+		fclose(fp);
+
+		command("send host:%s", path);
+		wait_for("XMODEM receive command now.");
+		start_faults();
+		start = now();
+		data = xmodem_receive(size);
+		faults_enabled = 0;
+		report("send", size, now() - start, baud);
+
+		if (memcmp(data, expected, size))
+			fatal("received data is wrong");
+	}
+	else
+	{
+		/* We send piface a file; check what it wrote. */
+
+		uint8_t* expected;
+		uint8_t* data;
+		uint8_t* stream;
+		uint32_t streamsize;
+		FILE* fp;
+
+		if (!packed)
+			size = (size + 1023) & ~1023;
+		expected = malloc(size);
+		fill_pattern(expected, 0, size);
+		if (packed)
+			stream = pack_data(expected, size, &streamsize);
+		else
+		{
+			stream = expected;
+			streamsize = size;
+		}
+		wire_bytes = streamsize;
+
+		command("recv %shost:%s", packed ? "-z " : "", path);
+		wait_for("XMODEM send command now.");
+		start_faults();
+		start = now();
+		xmodem_send(stream, streamsize);
+		faults_enabled = 0;
+		report("recv", size, now() - start, baud);
+
+		wait_for("File reception complete.");
+		data = malloc(size + 1);
+		fp = fopen(path, "r");
+		if (!fp || (fread(data, 1, size + 1, fp) != size) || memcmp(data, expected, size))
+			fatal("file written by piface is wrong");
+		fclose(fp);
+	}
+	printf("data verified\n");
+
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+	unlink(path);
+	rmdir(tmpdir);
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+/* Host side of packed XMODEM transfers (see src/pack.h).
+ *
+ *   piface-pack <infile> <outfile>      pack a file to send with 'recv'
+ *   piface-pack -d <infile> <outfile>   unpack a file from 'send -z'
+ *
+ * Either file may be - for stdin or stdout.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "../src/pack.h"
+
+static void fatal(const char* msg, ...)
+{
+	va_list ap;
+	va_start(ap, msg);
+	fprintf(stderr, "piface-pack: ");
+	vfprintf(stderr, msg, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static FILE* open_file(const char* name, const char* mode)
+{
+	FILE* fp;
+
+	if (strcmp(name, "-") == 0)
+		return (mode[0] == 'r') ? stdin : stdout;
+	fp = fopen(name, mode);
+	if (!fp)
+		fatal("cannot open %s: %s", name, strerror(errno));
+	return fp;
+}
+
+static void pack(FILE* in, FILE* out, uint32_t* inlen, uint32_t* outlen)
+{
+	uint8_t chunk[PACK_CHUNK_SIZE];
+	uint8_t packed[PACK_MAX_CHUNK];
+	uint8_t trailer[6];
+	size_t n;
+
+	fwrite(PACK_MAGIC, 1, PACK_MAGIC_SIZE, out);
+	*outlen = PACK_MAGIC_SIZE;
+	*inlen = 0;
+
+	while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+	{
+		uint32_t len = pack_chunk(chunk, n, packed);
+		fwrite(packed, 1, len, out);
+		*inlen += n;
+		*outlen += len;
+	}
+
+	trailer[0] = trailer[1] = 0;
+	trailer[2] = *inlen;
+	trailer[3] = *inlen >> 8;
+	trailer[4] = *inlen >> 16;
+	trailer[5] = *inlen >> 24;
+	fwrite(trailer, 1, sizeof(trailer), out);
+	*outlen += sizeof(trailer);
+}
+
+static void emit_cb(void* context, const uint8_t* data, uint32_t len)
+{
+	fwrite(data, 1, len, context);
+}
+
+static void unpack(FILE* in, FILE* out, uint32_t* inlen, uint32_t* outlen)
+{
+	static struct unpacker u;
+	uint8_t buffer[4096];
+	size_t n;
+	int r = PACK_MORE;
+
+	unpack_init(&u);
+	*inlen = 0;
+	while ((r == PACK_MORE) && ((n = fread(buffer, 1, sizeof(buffer), in)) > 0))
+	{
+		r = unpack_feed(&u, buffer, n, emit_cb, out);
+		*inlen += n;
+	}
+
+	if (r == PACK_CORRUPT)
+		fatal("packed data is corrupt");
+	if (r != PACK_DONE)
+		fatal("packed data ends early");
+	*outlen = u.total;
+}
+
+int main(int argc, char* argv[])
+{
+	int unpacking = 0;
+	uint32_t inlen, outlen;
+	FILE* in;
+	FILE* out;
+
+	if ((argc > 1) && (strcmp(argv[1], "-d") == 0))
+	{
+		unpacking = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 3)
+		fatal("syntax: piface-pack [-d] <infile> <outfile>");
+
+	in = open_file(argv[1], "rb");
+	out = open_file(argv[2], "wb");
+	if (unpacking)
+		unpack(in, out, &inlen, &outlen);
+	else
+		pack(in, out, &inlen, &outlen);
+	if (fclose(out) != 0)
+		fatal("cannot write %s: %s", argv[2], strerror(errno));
+
+	fprintf(stderr, "%u bytes -> %u bytes\n", inlen, outlen);
+	return 0;
+}
@@ -0,0 +1,1180 @@
+/*
+ * PiFace
+ * © 2013 David Given
+ * This file is redistributable under the terms of the 3-clause BSD license.
+ * See the file 'Copying' in the root of the distribution for the full text.
+ */
+
+/* Host-side client for piface's binary RPC channel (see src/rpc.h). This
+ * runs on the development machine, not on the Pi.
+ *
+ *   piface-rpc [-b baud] [-w window] <tty> <command> [; <command>...]
+ *   piface-rpc [-w window] -x <program> <command> [; <command>...]
+ *
+ * -x runs the given program (usually the testbed build of piface) on a pty
+ * instead of opening a serial port. Commands are separated by a ';'
+ * argument and are run in order over a single session.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <pty.h>
+#include <time.h>
+#include "../src/rpc.h"
+
+#define TIMEOUT_MS 5000
+#define MAX_WINDOW 32
+#define CHUNK (RPC_MAX_PAYLOAD - 16)
+
+struct packet
+{
+	uint8_t seq;
+	uint8_t op;
+	int len;
+	uint8_t data[RPC_MAX_PAYLOAD];
+};
+
+struct request
+{
+	int inuse;
+	uint8_t frame[RPC_HEADER_SIZE + RPC_MAX_PAYLOAD + RPC_TRAILER_SIZE];
+	int framelen;
+};
+
+static int fd;
+static int window = 8;
+static uint8_t nextseq = 1;
+static struct request requests[256];
+static int outstanding;
+static uint32_t bytes_out;
+static uint32_t bytes_in;
+
+static void fatal(const char* msg, ...)
+{
+	va_list ap;
+	va_start(ap, msg);
+	fprintf(stderr, "piface-rpc: ");
+	vfprintf(stderr, msg, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static uint16_t update_crc16(uint16_t crc, const void* data, uint32_t len)
+{
+	const uint8_t* p = data;
+	int j;
+
+	while (len--)
+	{
+		crc ^= *p++ << 8;
+		for (j=0; j<8; j++)
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+	}
+	return crc;
+}
+
+static uint32_t update_crc32(uint32_t crc, const void* data, uint32_t len)
+{
+	const uint8_t* p = data;
+	int j;
+
+	crc = ~crc;
+	while (len--)
+	{
+		crc ^= *p++;
+		for (j=0; j<8; j++)
+			crc = (crc & 1) ? ((crc >> 1) ^ 0xedb88320) : (crc >> 1);
+	}
+	return ~crc;
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static void put16(uint8_t* p, uint16_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static void write_all(const void* data, int len)
+{
+	const uint8_t* p = data;
+	while (len > 0)
+	{
+		int i = write(fd, p, len);
+		if (i < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fatal("write error: %s", strerror(errno));
+		}
+		p += i;
+		len -= i;
+		bytes_out += i;
+	}
+}
+
+/* Reads one byte; returns -1 on timeout. */
+
+static int read_byte(int timeout)
+{
+	static uint8_t buffer[4096];
+	static int pos, len;
+
+	while (pos == len)
+	{
+		struct pollfd pfd;
+		int i;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		i = poll(&pfd, 1, timeout);
+		if (i == 0)
+			return -1;
+		if ((i < 0) && (errno != EINTR))
+			fatal("poll error: %s", strerror(errno));
+
+		i = read(fd, buffer, sizeof(buffer));
+		if (i <= 0)
+		{
+			if ((i < 0) && (errno == EINTR))
+				continue;
+			fatal("connection lost");
+		}
+		pos = 0;
+		len = i;
+		bytes_in += i;
+	}
+
+	return buffer[pos++];
+}
+
+static int read_block(uint8_t* p, int len)
+{
+	while (len--)
+	{
+		int c = read_byte(TIMEOUT_MS);
+		if (c == -1)
+			return 0;
+		*p++ = c;
+	}
+	return 1;
+}
+
+/* Receives the next valid packet, passing anything else through to stdout
+ * (this is console output from commands). Returns 0 on timeout. */
+
+static int receive(struct packet* pkt, int timeout)
+{
+	uint8_t header[RPC_HEADER_SIZE];
+	uint8_t trailer[RPC_TRAILER_SIZE];
+	uint16_t crc;
+	int c;
+
+	for (;;)
+	{
+		c = read_byte(timeout);
+		if (c == -1)
+			return 0;
+		if (c != RPC_SYNC0)
+		{
+			putchar(c);
+			continue;
+		}
+
+		c = read_byte(TIMEOUT_MS);
+		if (c != RPC_SYNC1)
+		{
+			putchar(RPC_SYNC0);
+			if (c != -1)
+				putchar(c);
+			continue;
+		}
+		fflush(stdout);
+
+		if (!read_block(header+2, RPC_HEADER_SIZE-2))
+			return 0;
+		pkt->len = header[2] | (header[3]<<8);
+		pkt->seq = header[4];
+		pkt->op = header[5];
+		if (pkt->len > RPC_MAX_PAYLOAD)
+			continue;
+		if (!read_block(pkt->data, pkt->len) ||
+		    !read_block(trailer, RPC_TRAILER_SIZE))
+			return 0;
+
+		crc = update_crc16(0, header+2, RPC_HEADER_SIZE-2);
+		crc = update_crc16(crc, pkt->data, pkt->len);
+		if (crc == (trailer[0] | (trailer[1]<<8)))
+			return 1;
+	}
+}
+
+/* Sends a request and returns its sequence number. The request is kept
+ * until its reply arrives, so it can be resent if it got corrupted. */
+
+static uint8_t send_request(uint8_t op, const void* payload, int len)
+{
+	struct request* r;
+	uint8_t seq;
+	uint16_t crc;
+
+	while (requests[nextseq].inuse || (nextseq == 0))
+		nextseq++;
+	seq = nextseq++;
+	r = &requests[seq];
+
+	r->frame[0] = RPC_SYNC0;
+	r->frame[1] = RPC_SYNC1;
+	r->frame[2] = len;
+	r->frame[3] = len >> 8;
+	r->frame[4] = seq;
+	r->frame[5] = op;
+	memcpy(r->frame+RPC_HEADER_SIZE, payload, len);
+	crc = update_crc16(0, r->frame+2, RPC_HEADER_SIZE-2+len);
+	r->frame[RPC_HEADER_SIZE+len+0] = crc;
+	r->frame[RPC_HEADER_SIZE+len+1] = crc >> 8;
+	r->framelen = RPC_HEADER_SIZE + len + RPC_TRAILER_SIZE;
+	r->inuse = 1;
+	outstanding++;
+
+	write_all(r->frame, r->framelen);
+	return seq;
+}
+
+/* Waits for the reply to any outstanding request. Corrupted requests are
+ * retransmitted transparently. */
+
+static void receive_reply(struct packet* pkt)
+{
+	for (;;)
+	{
+		if (!receive(pkt, TIMEOUT_MS))
+			fatal("timed out waiting for reply");
+
+		if (!requests[pkt->seq].inuse)
+			continue;
+
+		if (pkt->op == (RPC_HELLO | RPC_REPLY))
+		{
+			/* piface saw a corrupt packet with this sequence number. */
+			write_all(requests[pkt->seq].frame, requests[pkt->seq].framelen);
+			continue;
+		}
+
+		requests[pkt->seq].inuse = 0;
+		outstanding--;
+		if (pkt->data[0] != RPC_OK)
+			fatal("remote error: %.*s", pkt->len-1, pkt->data+1);
+		return;
+	}
+}
+
+/* Sends one request and waits for its reply. */
+
+static void transact(uint8_t op, const void* payload, int len,
+		struct packet* pkt)
+{
+	send_request(op, payload, len);
+	receive_reply(pkt);
+}
+
+static void connect_rpc(void)
+{
+	struct packet pkt;
+	int tries;
+
+	for (tries=0; tries<5; tries++)
+	{
+		/* ^U to clear any partial line, then the magic byte. */
+		static const uint8_t magic[] = { 21, RPC_SYNC0 };
+		write_all(magic, sizeof(magic));
+
+		while (receive(&pkt, 1000))
+		{
+			if ((pkt.op == (RPC_HELLO | RPC_REPLY)) && (pkt.len >= 4))
+			{
+				if (pkt.data[1] != RPC_VERSION)
+					fatal("protocol version mismatch");
+				return;
+			}
+		}
+	}
+	fatal("piface is not responding");
+}
+
+static void open_tty(const char* path, speed_t speed)
+{
+	struct termios t;
+
+	fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd == -1)
+		fatal("cannot open %s: %s", path, strerror(errno));
+
+	tcgetattr(fd, &t);
+	cfmakeraw(&t);
+	cfsetispeed(&t, speed);
+	cfsetospeed(&t, speed);
+	t.c_cflag |= CLOCAL | CREAD;
+	tcsetattr(fd, TCSANOW, &t);
+}
+
+static void spawn(const char* program)
+{
+	struct termios t;
+	pid_t pid;
+
+	pid = forkpty(&fd, NULL, NULL, NULL);
+	if (pid == -1)
+		fatal("cannot create pty: %s", strerror(errno));
+	if (pid == 0)
+	{
+		execl("/bin/sh", "sh", "-c", program, (char*) NULL);
+		_exit(127);
+	}
+
+	tcgetattr(fd, &t);
+	cfmakeraw(&t);
+	tcsetattr(fd, TCSANOW, &t);
+}
+
+static speed_t parse_baud(const char* s)
+{
+	switch (atoi(s))
+	{
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+	}
+	fatal("unsupported baud rate %s", s);
+	return 0;
+}
+
+/* Commands. */
+
+static void cmd_ping(int argc, char* argv[])
+{
+	struct packet pkt;
+	transact(RPC_PING, "ping", 4, &pkt);
+	printf("pong\n");
+}
+
+static void cmd_peek(int argc, char* argv[])
+{
+	uint8_t req[8];
+	struct packet pkt;
+	uint32_t addr, len;
+
+	if (argc != 3)
+		fatal("syntax: peek <addr> <len>");
+	addr = strtoul(argv[1], NULL, 16);
+	len = strtoul(argv[2], NULL, 16);
+
+	while (len)
+	{
+		uint32_t i, n = (len > CHUNK) ? CHUNK : len;
+
+		put32(req, addr);
+		put32(req+4, n);
+		transact(RPC_MEMREAD, req, 8, &pkt);
+
+		for (i=0; i<n; i++)
+		{
+			if (!(i & 15))
+				printf("%s%08x :", i ? "\n" : "", addr+i);
+			printf(" %02x", pkt.data[1+i]);
+		}
+		printf("\n");
+		addr += n;
+		len -= n;
+	}
+}
+
+static void cmd_poke(int argc, char* argv[])
+{
+	uint8_t req[RPC_MAX_PAYLOAD];
+	struct packet pkt;
+	int i;
+
+	if (argc < 3)
+		fatal("syntax: poke <addr> <bytes...>");
+	if ((argc-2) > (RPC_MAX_PAYLOAD-8))
+		fatal("too many bytes");
+
+	put32(req, strtoul(argv[1], NULL, 16));
+	put32(req+4, argc-2);
+	for (i=2; i<argc; i++)
+		req[8+i-2] = strtoul(argv[i], NULL, 16);
+	transact(RPC_MEMWRITE, req, 8+argc-2, &pkt);
+}
+
+static void cmd_fill(int argc, char* argv[])
+{
+	uint8_t req[12];
+	struct packet pkt;
+
+	if (argc != 4)
+		fatal("syntax: fill <addr> <len> <pattern>");
+	put32(req, strtoul(argv[1], NULL, 16));
+	put32(req+4, strtoul(argv[2], NULL, 16));
+	put32(req+8, strtoul(argv[3], NULL, 16));
+	transact(RPC_MEMFILL, req, 12, &pkt);
+}
+
+static int open_remote(const char* path, int writing, uint32_t* length)
+{
+	uint8_t req[RPC_MAX_PAYLOAD];
+	struct packet pkt;
+	int len = strlen(path) + 1;
+
+	if (len > (RPC_MAX_PAYLOAD-1))
+		fatal("path too long");
+	req[0] = writing;
+	memcpy(req+1, path, len);
+	transact(RPC_OPEN, req, len+1, &pkt);
+
+	if (length)
+		*length = get32(pkt.data+6);
+	return pkt.data[1];
+}
+
+static void close_remote(int handle)
+{
+	uint8_t req[1];
+	struct packet pkt;
+
+	req[0] = handle;
+	transact(RPC_CLOSE, req, 1, &pkt);
+}
+
+/* Reads a remote file with up to 'window' READ requests in flight. */
+
+static void cmd_get(int argc, char* argv[])
+{
+	uint32_t length, sent, received;
+	uint32_t offsets[256];
+	struct packet pkt;
+	int handle;
+	FILE* fp;
+
+	if (argc != 3)
+		fatal("syntax: get <remote> <local>");
+
+	handle = open_remote(argv[1], 0, &length);
+	fp = fopen(argv[2], "wb");
+	if (!fp)
+		fatal("cannot open %s: %s", argv[2], strerror(errno));
+
+	sent = received = 0;
+	while (received < length)
+	{
+		while ((sent < length) && (outstanding < window))
+		{
+			uint8_t req[9];
+			uint32_t n = length - sent;
+			uint8_t seq;
+
+			if (n > CHUNK)
+				n = CHUNK;
+			req[0] = handle;
+			put32(req+1, sent);
+			put32(req+5, n);
+			seq = send_request(RPC_READ, req, 9);
+			offsets[seq] = sent;
+			sent += n;
+		}
+
+		receive_reply(&pkt);
+		if (pkt.len <= 1)
+			fatal("short read");
+		fseek(fp, offsets[pkt.seq], SEEK_SET);
+		fwrite(pkt.data+1, 1, pkt.len-1, fp);
+		received += pkt.len-1;
+	}
+
+	fclose(fp);
+	close_remote(handle);
+}
+
+/* Writes a remote file with up to 'window' WRITE requests in flight. */
+
+static void cmd_put(int argc, char* argv[])
+{
+	uint8_t req[RPC_MAX_PAYLOAD];
+	struct packet pkt;
+	uint32_t offset;
+	int handle;
+	FILE* fp;
+
+	if (argc != 3)
+		fatal("syntax: put <local> <remote>");
+
+	fp = fopen(argv[1], "rb");
+	if (!fp)
+		fatal("cannot open %s: %s", argv[1], strerror(errno));
+	handle = open_remote(argv[2], 1, NULL);
+
+	offset = 0;
+	for (;;)
+	{
+		int n = fread(req+5, 1, CHUNK, fp);
+		if (n <= 0)
+			break;
+
+		while (outstanding >= window)
+			receive_reply(&pkt);
+
+		req[0] = handle;
+		put32(req+1, offset);
+		send_request(RPC_WRITE, req, n+5);
+		offset += n;
+	}
+	while (outstanding)
+		receive_reply(&pkt);
+
+	fclose(fp);
+	close_remote(handle);
+}
+
+/* Block-delta update, rsync style. piface sends us the checksums of each
+ * block of the file it already has; we look for those blocks anywhere in
+ * the new file using the rolling checksum, and send back only the data
+ * that isn't there plus instructions to copy the blocks that are.
+ *
+ * With a base file, the result is written to a fresh file. Otherwise the
+ * remote file is updated in place, which needs more care: blocks which
+ * haven't moved are left alone; copies which move data down the file are
+ * done first, front to back, then copies which move it up, back to front,
+ * and the new data last. Any copy whose source has already been
+ * overwritten by then is sent as data instead.
+ *
+ * Either way the result is checked with a CRC-32 of the whole file. */
+
+#define SYNC_BLOCKSIZE 1024
+#define SYNC_MAX_REQUEST (1024*1024) /* bytes processed per request */
+#define HASH_SIZE 65536
+
+struct op
+{
+	uint32_t src; /* or -1 for new data */
+	uint32_t dest;
+	uint32_t len;
+};
+
+struct delta
+{
+	int src;
+	int dest;
+	const uint8_t* data;
+	struct op* ops;
+	int numops;
+	uint32_t unchanged_bytes;
+	uint32_t literal_bytes;
+	uint32_t copied_bytes;
+};
+
+#define LITERAL 0xffffffff
+
+static uint32_t weak_checksum(const uint8_t* p, uint32_t len)
+{
+	uint32_t a = 0;
+	uint32_t b = 0;
+
+	while (len--)
+	{
+		a += *p++;
+		b += a;
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+static uint32_t hash_weak(uint32_t weak)
+{
+	return (weak ^ (weak >> 16)) & (HASH_SIZE-1);
+}
+
+/* Appends an operation, merging it with the previous one if possible. */
+
+static void add_op(struct delta* d, uint32_t src, uint32_t dest, uint32_t len)
+{
+	struct op* last = d->numops ? &d->ops[d->numops-1] : NULL;
+
+	if (last && ((last->dest + last->len) == dest) &&
+	    (last->len + len) <= SYNC_MAX_REQUEST)
+	{
+		if ((src == LITERAL) && (last->src == LITERAL))
+		{
+			last->len += len;
+			return;
+		}
+		if ((src != LITERAL) && (last->src != LITERAL) &&
+		    ((last->src + last->len) == src))
+		{
+			last->len += len;
+			return;
+		}
+	}
+
+	d->ops = realloc(d->ops, (d->numops+1) * sizeof(struct op));
+	d->ops[d->numops].src = src;
+	d->ops[d->numops].dest = dest;
+	d->ops[d->numops].len = len;
+	d->numops++;
+}
+
+static void wait_for_window(void)
+{
+	struct packet pkt;
+
+	while (outstanding >= window)
+		receive_reply(&pkt);
+}
+
+static void send_literal(struct delta* d, uint32_t offset, uint32_t len)
+{
+	uint8_t req[RPC_MAX_PAYLOAD];
+
+	d->literal_bytes += len;
+	while (len)
+	{
+		uint32_t n = (len > CHUNK) ? CHUNK : len;
+
+		wait_for_window();
+		req[0] = d->dest;
+		put32(req+1, offset);
+		memcpy(req+5, d->data+offset, n);
+		send_request(RPC_WRITE, req, n+5);
+		offset += n;
+		len -= n;
+	}
+}
+
+static void send_copy(struct delta* d, const struct op* op)
+{
+	uint8_t req[14];
+
+	wait_for_window();
+	req[0] = d->src;
+	put32(req+1, op->src);
+	req[5] = d->dest;
+	put32(req+6, op->dest);
+	put32(req+10, op->len);
+	send_request(RPC_COPY, req, 14);
+	d->copied_bytes += op->len;
+}
+
+/* Finds the operations which turn the old file into the new one. */
+
+static void make_delta(struct delta* d, uint32_t newlength, uint32_t blocksize,
+	uint32_t nblocks, const uint32_t* weak, const uint32_t* strong)
+{
+	const uint8_t* data = d->data;
+	int32_t* heads = malloc(HASH_SIZE * sizeof(int32_t));
+	int32_t* next = malloc((nblocks+1) * sizeof(int32_t));
+	uint32_t i, lit;
+
+	for (i=0; i<HASH_SIZE; i++)
+		heads[i] = -1;
+	for (i=nblocks; i-- > 0; )
+	{
+		uint32_t h = hash_weak(weak[i]);
+		next[i] = heads[h];
+		heads[h] = i;
+	}
+
+	i = lit = 0;
+	if (nblocks && (newlength >= blocksize))
+	{
+		uint32_t w = weak_checksum(data, blocksize);
+		uint32_t a = w & 0xffff;
+		uint32_t b = w >> 16;
+
+		for (;;)
+		{
+			int32_t found = -1;
+			int havecrc = 0;
+			uint32_t crc = 0;
+			int32_t j;
+
+			/* Look for a block with this checksum, preferring one which
+			 * is already in the right place. */
+
+			for (j=heads[hash_weak(w)]; j != -1; j=next[j])
+			{
+				if (weak[j] != w)
+					continue;
+				if (!havecrc)
+				{
+					crc = update_crc32(0, data+i, blocksize);
+					havecrc = 1;
+				}
+				if (strong[j] != crc)
+					continue;
+
+				found = j;
+				if ((j * blocksize) == i)
+					break;
+			}
+
+			if (found != -1)
+			{
+				if (lit < i)
+					add_op(d, LITERAL, lit, i - lit);
+				add_op(d, found * blocksize, i, blocksize);
+
+				i += blocksize;
+				lit = i;
+				if ((i + blocksize) > newlength)
+					break;
+				w = weak_checksum(data+i, blocksize);
+				a = w & 0xffff;
+				b = w >> 16;
+				continue;
+			}
+
+			/* Roll the checksum on by one byte. */
+
+			if ((i + blocksize) >= newlength)
+				break;
+			a = (a - data[i] + data[i+blocksize]) & 0xffff;
+			b = (b - blocksize*data[i] + a) & 0xffff;
+			w = a | (b << 16);
+			i++;
+		}
+	}
+	if (lit < newlength)
+		add_op(d, LITERAL, lit, newlength - lit);
+
+	free(heads);
+	free(next);
+}
+
+/* Sends the operations in an order which is safe for an in-place update;
+ * see above. */
+
+static int overwritten(const struct op* op, const struct op** written,
+	int numwritten)
+{
+	int i;
+
+	for (i=0; i<numwritten; i++)
+	{
+		const struct op* w = written[i];
+		if ((op->src < (w->dest + w->len)) && (w->dest < (op->src + op->len)))
+			return 1;
+	}
+	return 0;
+}
+
+static void send_inplace(struct delta* d)
+{
+	const struct op** written = malloc(d->numops * sizeof(struct op*));
+	int numwritten = 0;
+	int pass, i;
+
+	for (pass=0; pass<2; pass++)
+	{
+		for (i=0; i<d->numops; i++)
+		{
+			struct op* op = &d->ops[(pass == 0) ? i : (d->numops-1-i)];
+
+			if (op->src == LITERAL)
+				continue;
+			if (op->src == op->dest)
+			{
+				if (pass == 0)
+					d->unchanged_bytes += op->len;
+				continue;
+			}
+			if ((pass == 0) != (op->src > op->dest))
+				continue;
+
+			if (overwritten(op, written, numwritten))
+				op->src = LITERAL;
+			else
+				send_copy(d, op);
+			written[numwritten++] = op;
+		}
+	}
+
+	for (i=0; i<d->numops; i++)
+	{
+		struct op* op = &d->ops[i];
+		if (op->src == LITERAL)
+			send_literal(d, op->dest, op->len);
+	}
+	free(written);
+}
+
+static void send_fresh(struct delta* d)
+{
+	int i;
+
+	for (i=0; i<d->numops; i++)
+	{
+		struct op* op = &d->ops[i];
+		if (op->src == LITERAL)
+			send_literal(d, op->dest, op->len);
+		else
+			send_copy(d, op);
+	}
+}
+
+static uint32_t remote_crc32(int handle, uint32_t length)
+{
+	uint8_t req[13];
+	struct packet pkt;
+	uint32_t offset = 0;
+	uint32_t crc = 0;
+
+	do
+	{
+		uint32_t n = length - offset;
+		if (n > SYNC_MAX_REQUEST)
+			n = SYNC_MAX_REQUEST;
+
+		req[0] = handle;
+		put32(req+1, offset);
+		put32(req+5, n);
+		put32(req+9, crc);
+		transact(RPC_CRC32, req, 13, &pkt);
+		crc = get32(pkt.data+1);
+		offset += n;
+	}
+	while (offset < length);
+	return crc;
+}
+
+static void cmd_sync(int argc, char* argv[])
+{
+	uint32_t blocksize = SYNC_BLOCKSIZE;
+	uint32_t oldlength, newlength, nblocks, i;
+	uint32_t* weak;
+	uint32_t* strong;
+	uint8_t* data;
+	struct delta d;
+	struct packet pkt;
+	struct timespec start, end;
+	uint32_t ms;
+	int inplace;
+	FILE* fp;
+
+	if ((argc > 2) && (strcmp(argv[1], "-b") == 0))
+	{
+		blocksize = strtoul(argv[2], NULL, 0);
+		argc -= 2;
+		argv += 2;
+	}
+	if (((argc != 3) && (argc != 4)) || (blocksize < 16) || (blocksize > 32768))
+		fatal("syntax: sync [-b <blocksize>] <local> <remote> [<remote base>]");
+	inplace = (argc == 3);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bytes_in = bytes_out = 0;
+
+	fp = fopen(argv[1], "rb");
+	if (!fp)
+		fatal("cannot open %s: %s", argv[1], strerror(errno));
+	fseek(fp, 0, SEEK_END);
+	newlength = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = malloc(newlength + 1);
+	if (fread(data, 1, newlength, fp) != newlength)
+		fatal("cannot read %s", argv[1]);
+	fclose(fp);
+
+	memset(&d, 0, sizeof(d));
+	d.data = data;
+	if (inplace)
+		d.src = d.dest = open_remote(argv[2], 2, &oldlength);
+	else
+	{
+		d.src = open_remote(argv[3], 0, &oldlength);
+		d.dest = open_remote(argv[2], 1, NULL);
+	}
+
+	/* Fetch the signature of the full blocks of the old file. */
+
+	nblocks = oldlength / blocksize;
+	weak = malloc((nblocks+1) * sizeof(uint32_t));
+	strong = malloc((nblocks+1) * sizeof(uint32_t));
+	for (i=0; i<nblocks; )
+	{
+		uint8_t req[9];
+		uint32_t count = nblocks - i;
+		uint32_t j;
+
+		if (count > ((RPC_MAX_PAYLOAD-1) / 8))
+			count = (RPC_MAX_PAYLOAD-1) / 8;
+		if (count > (SYNC_MAX_REQUEST / blocksize))
+			count = SYNC_MAX_REQUEST / blocksize;
+
+		req[0] = d.src;
+		put32(req+1, i * blocksize);
+		put16(req+5, blocksize);
+		put16(req+7, count);
+		transact(RPC_SIGNATURE, req, 9, &pkt);
+		if ((pkt.len - 1) != (count * 8))
+			fatal("short signature");
+
+		for (j=0; j<count; j++)
+		{
+			weak[i+j] = get32(pkt.data + 1 + j*8);
+			strong[i+j] = get32(pkt.data + 5 + j*8);
+		}
+		i += count;
+	}
+
+	make_delta(&d, newlength, blocksize, nblocks, weak, strong);
+	if (inplace)
+		send_inplace(&d);
+	else
+		send_fresh(&d);
+	while (outstanding)
+		receive_reply(&pkt);
+
+	if (inplace && (newlength < oldlength))
+	{
+		uint8_t req[5];
+		req[0] = d.dest;
+		put32(req+1, newlength);
+		transact(RPC_TRUNCATE, req, 5, &pkt);
+	}
+
+	/* Check the result; if it's wrong (a checksum collision, most
+	 * likely), fall back to sending the whole thing. */
+
+	if (remote_crc32(d.dest, newlength) != update_crc32(0, data, newlength))
+	{
+		fprintf(stderr, "piface-rpc: delta result is wrong; sending the whole file\n");
+		send_literal(&d, 0, newlength);
+		while (outstanding)
+			receive_reply(&pkt);
+		if (remote_crc32(d.dest, newlength) != update_crc32(0, data, newlength))
+			fatal("remote file is still wrong");
+	}
+
+	if (!inplace)
+		close_remote(d.src);
+	close_remote(d.dest);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = (end.tv_sec - start.tv_sec)*1000 + (end.tv_nsec - start.tv_nsec)/1000000;
+	printf("synced %u bytes in %u.%03u s: %u unchanged, %u copied, %u sent\n",
+		newlength, ms/1000, ms%1000,
+		d.unchanged_bytes, d.copied_bytes, d.literal_bytes);
+	printf("%u bytes on the wire (%u out, %u in)\n",
+		bytes_out + bytes_in, bytes_out, bytes_in);
+
+	free(data);
+	free(weak);
+	free(strong);
+	free(d.ops);
+}
+
+static void cmd_ls(int argc, char* argv[])
+{
+	uint8_t req[RPC_MAX_PAYLOAD];
+	struct packet pkt;
+	int len, first;
+
+	if (argc != 2)
+		fatal("syntax: ls <path>");
+	len = strlen(argv[1]) + 1;
+	if (len > (RPC_MAX_PAYLOAD-2))
+		fatal("path too long");
+
+	first = 0;
+	for (;;)
+	{
+		int i;
+
+		req[0] = first;
+		req[1] = first >> 8;
+		memcpy(req+2, argv[1], len);
+		transact(RPC_ENUM, req, len+2, &pkt);
+
+		i = 2;
+		while (i < pkt.len)
+		{
+			uint8_t* p = pkt.data + i;
+			if (p[0])
+				printf("       [DIR] ");
+			else
+				printf("  %10u ", get32(p+1));
+			printf("%s\n", p+5);
+			i += 5 + strlen((char*) p+5) + 1;
+			first++;
+		}
+
+		if (!pkt.data[1])
+			break;
+	}
+}
+
+static void cmd_exec(int argc, char* argv[])
+{
+	char buffer[RPC_MAX_PAYLOAD];
+	struct packet pkt;
+	int i;
+
+	buffer[0] = '\0';
+	for (i=1; i<argc; i++)
+	{
+		if ((strlen(buffer) + strlen(argv[i]) + 2) > sizeof(buffer))
+			fatal("command too long");
+		if (i > 1)
+			strcat(buffer, " ");
+		strcat(buffer, argv[i]);
+	}
+
+	transact(RPC_EXEC, buffer, strlen(buffer)+1, &pkt);
+}
+
+static void cmd_stats(int argc, char* argv[])
+{
+	struct packet pkt;
+	transact(RPC_STATS, NULL, 0, &pkt);
+	fwrite(pkt.data+1, 1, pkt.len-1, stdout);
+}
+
+static const struct
+{
+	const char* name;
+	void (*cb)(int argc, char* argv[]);
+}
+commands[] =
+{
+	{ "ping",  cmd_ping },
+	{ "peek",  cmd_peek },
+	{ "poke",  cmd_poke },
+	{ "fill",  cmd_fill },
+	{ "get",   cmd_get },
+	{ "put",   cmd_put },
+	{ "sync",  cmd_sync },
+	{ "ls",    cmd_ls },
+	{ "exec",  cmd_exec },
+	{ "stats", cmd_stats },
+};
+#define NUM_COMMANDS (sizeof(commands)/sizeof(*commands))
+
+static void run_command(int argc, char* argv[])
+{
+	int i;
+
+	for (i=0; i<NUM_COMMANDS; i++)
+	{
+		if (strcmp(commands[i].name, argv[0]) == 0)
+		{
+			commands[i].cb(argc, argv);
+			fflush(stdout);
+			return;
+		}
+	}
+	fatal("unknown command '%s'", argv[0]);
+}
+
+static void syntax(void)
+{
+	fprintf(stderr,
+		"syntax: piface-rpc [-b baud] [-w window] <tty> <command> [; <command>...]\n"
+		"        piface-rpc [-w window] -x <program> <command> [; <command>...]\n"
+		"commands:\n"
+		"  ping\n"
+		"  peek <addr> <len>\n"
+		"  poke <addr> <bytes...>\n"
+		"  fill <addr> <len> <pattern>\n"
+		"  get <remote> <local>\n"
+		"  put <local> <remote>\n"
+		"  sync [-b <blocksize>] <local> <remote> [<remote base>]\n"
+		"  ls <remote>\n"
+		"  exec <command line...>\n"
+		"  stats\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	speed_t speed = B115200;
+	const char* program = NULL;
+	struct packet pkt;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+b:w:x:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'b':
+				speed = parse_baud(optarg);
+				break;
+
+			case 'w':
+				window = atoi(optarg);
+				if ((window < 1) || (window > MAX_WINDOW))
+					fatal("window must be between 1 and %d", MAX_WINDOW);
+				break;
+
+			case 'x':
+				program = optarg;
+				break;
+
+			default:
+				syntax();
+		}
+	}
+
+	if (!program)
+	{
+		if (optind >= argc)
+			syntax();
+		open_tty(argv[optind++], speed);
+	}
+	else
+		spawn(program);
+
+	if (optind >= argc)
+		syntax();
+
+	connect_rpc();
+
+	while (optind < argc)
+	{
+		int start = optind;
+		while ((optind < argc) && (strcmp(argv[optind], ";") != 0))
+			optind++;
+		if (optind > start)
+		{
+			char* saved = argv[optind];
+			argv[optind] = NULL;
+			run_command(optind - start, argv + start);
+			argv[optind] = saved;
+		}
+		optind++;
+	}
+
+	transact(RPC_QUIT, NULL, 0, &pkt);
+	return 0;
+}